@@ -6,6 +6,7 @@
 // tune constants based on the selected platform and device.
 static void set_tuning_params(struct futhark_context* ctx);
 static char* get_failure_msg(int failure_idx, int64_t args[]);
+static int cuda_replay_flush(struct futhark_context *ctx);
 
 #define CUDA_SUCCEED_FATAL(x) cuda_api_succeed_fatal(ctx, x, #x, __FILE__, __LINE__)
 #define CUDA_SUCCEED_NONFATAL(x) cuda_api_succeed_nonfatal(ctx, x, #x, __FILE__, __LINE__)
@@ -47,6 +48,9 @@ struct futhark_context_config {
   int (*mem_alloc)(void **, size_t, const char *);
   int (*mem_free)(void *);
   void (*mem_unify)(const char *, const char *);
+  // Flat copies of at least this many bytes use non-temporal stores.
+  // Zero means to pick a threshold based on the cache size.
+  int64_t nt_copy_threshold;
 
   // Uniform fields above.
 
@@ -70,6 +74,24 @@ struct futhark_context_config {
   int default_grid_size_changed;
   int default_tile_size_changed;
 
+  // Maximum number of bytes of device memory kept in the free list.
+  // Zero disables it, so that every free goes straight to gpu_free.
+  size_t gpu_free_list_cap;
+
+  // Pinned host buffers used for staging transfers between host and
+  // device memory.  Staging is disabled if there are no buffers, or
+  // if the driver functions for pinned memory have not been set.
+  size_t staging_buffer_size;
+  int num_staging_buffers;
+
+  int copy_streams;
+
+  int replay_launches;
+
+  // Number of threads used for compiling the program with NVRTC, or
+  // 0 to use all available cores.
+  int compile_threads;
+
   CUdevice setup_dev;
   CUstream setup_stream;
 
@@ -94,6 +116,8 @@ struct futhark_context_config {
   CUresult (*cuCtxSynchronize)(void);
   CUresult (*cuMemAlloc)(CUdeviceptr *, size_t);
   CUresult (*cuMemFree)(CUdeviceptr);
+  CUresult (*cuMemAllocHost)(void **, size_t);
+  CUresult (*cuMemFreeHost)(void *);
   CUresult (*cuMemcpy)(CUdeviceptr, CUdeviceptr, size_t);
   CUresult (*cuMemcpyHtoD)(CUdeviceptr, const void *, size_t);
   CUresult (*cuMemcpyDtoH)(void *, CUdeviceptr, size_t);
@@ -101,9 +125,19 @@ struct futhark_context_config {
   CUresult (*cuMemcpyHtoDAsync)(CUdeviceptr, const void *, size_t, CUstream);
   CUresult (*cuMemcpyDtoHAsync)(void *, CUdeviceptr, size_t, CUstream);
   CUresult (*cuStreamSynchronize)(CUstream);
+  CUresult (*cuStreamCreate)(CUstream *, unsigned int);
+  CUresult (*cuStreamDestroy)(CUstream);
+  CUresult (*cuStreamWaitEvent)(CUstream, CUevent, unsigned int);
+  CUresult (*cuStreamBeginCapture)(CUstream, CUstreamCaptureMode);
+  CUresult (*cuStreamEndCapture)(CUstream, CUgraph *);
+  CUresult (*cuGraphInstantiateWithFlags)(CUgraphExec *, CUgraph, unsigned long long);
+  CUresult (*cuGraphLaunch)(CUgraphExec, CUstream);
+  CUresult (*cuGraphExecDestroy)(CUgraphExec);
+  CUresult (*cuGraphDestroy)(CUgraph);
   CUresult (*cuEventCreate)(CUevent *, unsigned int);
   CUresult (*cuEventDestroy)(CUevent);
   CUresult (*cuEventRecord)(CUevent, CUstream);
+  CUresult (*cuEventSynchronize)(CUevent);
   CUresult (*cuEventElapsedTime)(float *, CUevent, CUevent);
   const char *(*nvrtcGetErrorString)(int);
   nvrtcResult (*nvrtcCreateProgram)(nvrtcProgram *,
@@ -218,6 +252,14 @@ void futhark_context_config_set_cuMemFree(struct futhark_context_config *cfg, vo
   cfg->cuMemFree = ptr;
 }
 
+void futhark_context_config_set_cuMemAllocHost(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuMemAllocHost = ptr;
+}
+
+void futhark_context_config_set_cuMemFreeHost(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuMemFreeHost = ptr;
+}
+
 void futhark_context_config_set_cuMemcpy(struct futhark_context_config *cfg, void *ptr) {
   cfg->cuMemcpy = ptr;
 }
@@ -246,6 +288,42 @@ void futhark_context_config_set_cuStreamSynchronize(struct futhark_context_confi
   cfg->cuStreamSynchronize = ptr;
 }
 
+void futhark_context_config_set_cuStreamCreate(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuStreamCreate = ptr;
+}
+
+void futhark_context_config_set_cuStreamDestroy(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuStreamDestroy = ptr;
+}
+
+void futhark_context_config_set_cuStreamWaitEvent(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuStreamWaitEvent = ptr;
+}
+
+void futhark_context_config_set_cuStreamBeginCapture(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuStreamBeginCapture = ptr;
+}
+
+void futhark_context_config_set_cuStreamEndCapture(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuStreamEndCapture = ptr;
+}
+
+void futhark_context_config_set_cuGraphInstantiateWithFlags(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuGraphInstantiateWithFlags = ptr;
+}
+
+void futhark_context_config_set_cuGraphLaunch(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuGraphLaunch = ptr;
+}
+
+void futhark_context_config_set_cuGraphExecDestroy(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuGraphExecDestroy = ptr;
+}
+
+void futhark_context_config_set_cuGraphDestroy(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuGraphDestroy = ptr;
+}
+
 void futhark_context_config_set_cuEventCreate(struct futhark_context_config *cfg, void *ptr) {
   cfg->cuEventCreate = ptr;
 }
@@ -258,6 +336,10 @@ void futhark_context_config_set_cuEventRecord(struct futhark_context_config *cfg
   cfg->cuEventRecord = ptr;
 }
 
+void futhark_context_config_set_cuEventSynchronize(struct futhark_context_config *cfg, void *ptr) {
+  cfg->cuEventSynchronize = ptr;
+}
+
 void futhark_context_config_set_cuEventElapsedTime(struct futhark_context_config *cfg, void *ptr) {
   cfg->cuEventElapsedTime = ptr;
 }
@@ -340,6 +422,32 @@ static void backend_context_config_setup(struct futhark_context_config *cfg) {
   cfg->default_block_size_changed = 0;
   cfg->default_grid_size_changed = 0;
   cfg->default_tile_size_changed = 0;
+
+  cfg->gpu_free_list_cap = 0;
+
+  cfg->staging_buffer_size = 4*1024*1024;
+  cfg->num_staging_buffers = 2;
+
+  cfg->copy_streams = 1;
+
+  cfg->replay_launches = 0;
+
+  cfg->compile_threads = 0;
+
+  // These driver functions are optional, so they must not be left
+  // uninitialised.
+  cfg->cuMemAllocHost = NULL;
+  cfg->cuMemFreeHost = NULL;
+  cfg->cuEventSynchronize = NULL;
+  cfg->cuStreamCreate = NULL;
+  cfg->cuStreamDestroy = NULL;
+  cfg->cuStreamWaitEvent = NULL;
+  cfg->cuStreamBeginCapture = NULL;
+  cfg->cuStreamEndCapture = NULL;
+  cfg->cuGraphInstantiateWithFlags = NULL;
+  cfg->cuGraphLaunch = NULL;
+  cfg->cuGraphExecDestroy = NULL;
+  cfg->cuGraphDestroy = NULL;
 }
 
 static void backend_context_config_teardown(struct futhark_context_config* cfg) {
@@ -427,6 +535,26 @@ void futhark_context_config_set_default_threshold(struct futhark_context_config
   cfg->default_threshold = size;
 }
 
+void futhark_context_config_set_staging_buffer_size(struct futhark_context_config *cfg, size_t size) {
+  cfg->staging_buffer_size = size;
+}
+
+void futhark_context_config_set_num_staging_buffers(struct futhark_context_config *cfg, int num) {
+  cfg->num_staging_buffers = num;
+}
+
+void futhark_context_config_set_copy_streams(struct futhark_context_config *cfg, int flag) {
+  cfg->copy_streams = flag;
+}
+
+void futhark_context_config_set_replay_launches(struct futhark_context_config *cfg, int num) {
+  cfg->replay_launches = num;
+}
+
+void futhark_context_config_set_compile_threads(struct futhark_context_config *cfg, int num) {
+  cfg->compile_threads = num;
+}
+
 int futhark_context_config_set_tuning_param(struct futhark_context_config *cfg,
                                             const char *param_name,
                                             size_t new_value) {
@@ -458,9 +586,95 @@ int futhark_context_config_set_tuning_param(struct futhark_context_config *cfg,
     cfg->default_reg_tile_size = new_value;
     return 0;
   }
+  if (strcmp(param_name, "nt_copy_threshold") == 0) {
+    cfg->nt_copy_threshold = new_value;
+    return 0;
+  }
   return 1;
 }
 
+// A pinned host buffer used for staging a chunk of a transfer.  The
+// 'done' event is recorded after the transfer that uses the buffer.
+// For device-to-host transfers, the chunk must subsequently be copied
+// from the buffer to 'dst', which is done when the buffer is waited
+// upon (see cuda_staging_wait()).
+struct cuda_staging_buffer {
+  unsigned char *host;
+  CUevent done;
+  int busy;
+  unsigned char *dst;
+  size_t size;
+};
+
+// Scalar reads issued with gpu_scalar_from_device_async() are copied
+// into consecutive slots of a small pinned buffer, and from there to
+// their destinations once gpu_scalar_sync() has waited for the
+// stream.  This lets several reads share a single synchronisation.
+#define CUDA_SCALAR_SLOTS 64
+#define CUDA_SCALAR_SLOT_SIZE 16
+
+struct cuda_scalar_read {
+  void *dst;
+  size_t size;
+};
+
+// Copy streams, indexing ctx->copy_streams.
+enum cuda_copy_dir {
+  CUDA_COPY_HOST_TO_DEVICE = 0,
+  CUDA_COPY_DEVICE_TO_HOST = 1
+};
+
+// Synchronisation state of a device memory block allocated through
+// gpu_alloc_actual(), used to order the copy streams with respect to
+// the compute stream.  Operations on the compute stream that touch
+// the block stamp it with their sequence number, and transfers on a
+// copy stream record the 'copy' event afterwards.
+struct cuda_mem_sync {
+  CUdeviceptr mem;     // 0 if the slot is unused.
+  int64_t compute_seq; // Last compute operation touching 'mem', or 0.
+  CUevent copy;        // Created on first transfer; NULL before.
+  int copy_dir;        // The copy stream 'copy' was last recorded on.
+  int copy_pending;    // Whether the compute stream must wait for 'copy'.
+};
+
+// Open addressing with linear probing, keyed on the device pointer.
+struct cuda_mem_sync_table {
+  struct cuda_mem_sync *slots;
+  int capacity; // Always a power of two.
+  int used;
+};
+
+// A kernel launch or device-to-device copy, as recorded for replay.
+// For kernels, the header is followed by 'num_args' argument sizes
+// and then the argument values, each padded to eight bytes.  Commands
+// are compared bytewise, so any padding must be zeroed.
+struct cuda_replay_cmd {
+  size_t size;           // Including the arguments.
+  CUfunction kernel;     // NULL for a copy.
+  unsigned int dims[7];  // Grid, block, and shared memory.
+  int num_args;
+  CUdeviceptr dst, src;  // For copies; offsets are included.
+  size_t nbytes;
+};
+
+// A sequence of commands issued between two synchronisation points,
+// and the graph captured from them once they have been seen twice.
+struct cuda_recording {
+  unsigned char *cmds;
+  size_t size, capacity;
+  int num_cmds;
+  CUgraphExec graph;
+  int no_graph;      // Capture failed; do not try again.
+  int64_t last_used;
+};
+
+enum cuda_replay_state {
+  CUDA_REPLAY_IDLE,      // No commands since the last flush.
+  CUDA_REPLAY_MATCHING,  // Commands so far match a prefix of replay_cur.
+  CUDA_REPLAY_RECORDING, // Commands are issued and appended to replay_cur.
+  CUDA_REPLAY_DIRECT     // Too many commands; just issue them.
+};
+
 // A record of something that happened.
 struct profiling_record {
   CUevent *events; // Points to two events.
@@ -483,6 +697,8 @@ struct futhark_context {
   struct event_list event_list;
   int64_t peak_mem_usage_default;
   int64_t cur_mem_usage_default;
+  // Number of times the host has waited for the device.
+  int64_t num_syncs;
   // Uniform fields above.
 
   CUdevice dev;
@@ -500,9 +716,55 @@ struct futhark_context {
   int64_t cur_mem_usage_device;
   struct program* program;
 
-  CUmodule module;
-
-  //struct free_list gpu_free_list;
+  // The program may be compiled as several modules; see
+  // gpu_compile.h.
+  CUmodule *modules;
+  int num_modules;
+
+  struct free_list gpu_free_list;
+  size_t gpu_free_list_size;
+
+  // Staging buffers are allocated on first use.  'staging_state' is
+  // 0 before that, 1 once they are available, and -1 if they cannot
+  // be used.
+  struct cuda_staging_buffer *staging;
+  int staging_state;
+  int staging_next;
+
+  // Pending scalar reads; 'scalar_staging_state' is interpreted like
+  // 'staging_state'.
+  unsigned char *scalar_staging;
+  int scalar_staging_state;
+  struct cuda_scalar_read scalar_reads[CUDA_SCALAR_SLOTS];
+  int num_scalar_reads;
+
+  // When 'use_copy_streams' is set, transfers to and from blocks in
+  // 'mem_sync' are issued on their own streams, such that they may
+  // overlap with kernels on 'stream'.  The copy streams wait for the
+  // compute stream through 'compute_tail', which is recorded on
+  // demand, and 'compute_tail_seq' is the value of 'compute_seq'
+  // when it was last recorded.
+  int use_copy_streams;
+  CUstream copy_streams[2];
+  struct cuda_mem_sync_table mem_sync;
+  CUevent compute_tail;
+  int64_t compute_seq;
+  int64_t compute_tail_seq;
+
+  // Launch recordings; NULL if replay is not used.  While matching,
+  // commands are deferred, and 'replay_pos' is the offset of the
+  // next command in replay_cur->cmds.  A failure to issue deferred
+  // commands at the end of an API call is reported by the next
+  // futhark_context_sync().
+  struct cuda_recording *recordings;
+  enum cuda_replay_state replay_state;
+  struct cuda_recording *replay_cur;
+  size_t replay_pos;
+  int replay_pos_cmds;
+  unsigned char *replay_scratch;
+  size_t replay_scratch_capacity;
+  int64_t replay_clock;
+  int replay_failed;
 
   size_t max_thread_block_size;
   size_t max_grid_size;
@@ -828,26 +1090,84 @@ static char* cuda_nvrtc_build(struct futhark_context *ctx, const char *src,
   return NULL;
 }
 
-static void cuda_load_ptx_from_cache(struct futhark_context_config *cfg,
-                                     const char *src,
-                                     const char *opts[], size_t n_opts,
-                                     struct cache_hash *h, const char *cache_fname,
-                                     char **ptx) {
+// Returns the number of modules restored from the cache, or 0.  On
+// success, *codes point into the restored buffer, which must be
+// released with cache_release().
+static int cuda_load_ptx_from_cache(struct futhark_context_config *cfg,
+                                    const char *src,
+                                    const char *opts[], size_t n_opts,
+                                    struct cache_hash *h, const char *cache_fname,
+                                    unsigned char **buf, size_t *bufsize,
+                                    const unsigned char ***codes, size_t **sizes) {
   if (cfg->logging) {
-    fprintf(stderr, "Restoring cache from from %s...\n", cache_fname);
+    fprintf(stderr, "Restoring cache from %s...\n", cache_fname);
   }
   cache_hash_init(h);
   for (size_t i = 0; i < n_opts; i++) {
     cache_hash(h, opts[i], strlen(opts[i]));
   }
   cache_hash(h, src, strlen(src));
-  size_t ptxsize;
   errno = 0;
-  if (cache_restore(cache_fname, h, (unsigned char**)ptx, &ptxsize) != 0) {
+  if (cache_restore(cache_fname, h, buf, bufsize) != 0) {
     if (cfg->logging) {
       fprintf(stderr, "Failed to restore cache (errno: %s)\n", strerror(errno));
     }
+    return 0;
+  }
+  int n = gpu_unpack_modules(*buf, *bufsize, codes, sizes);
+  // Each PTX module is stored with its NUL terminator, as it is
+  // passed to the driver as a C string directly from the mapped
+  // cache file.
+  for (int i = 0; i < n; i++) {
+    if ((*sizes)[i] == 0 || (*codes)[i][(*sizes)[i]-1] != 0) {
+      free(*codes);
+      free(*sizes);
+      n = -1;
+      break;
+    }
+  }
+  if (n <= 0) {
+    cache_release(*buf, *bufsize);
+    return 0;
+  }
+  return n;
+}
+
+struct cuda_nvrtc_job {
+  struct futhark_context *ctx;
+  const char **opts;
+  size_t n_opts;
+};
+
+// A gpu_compile_fn for NVRTC.
+static char* cuda_nvrtc_compile(void *arg, const char *src,
+                                char **ptx, size_t *ptx_size) {
+  struct cuda_nvrtc_job *job = (struct cuda_nvrtc_job*)arg;
+  char *problem = cuda_nvrtc_build(job->ctx, src, job->opts, job->n_opts, ptx);
+  if (problem == NULL) {
+    *ptx_size = strlen(*ptx) + 1;
+  }
+  return problem;
+}
+
+// Load the given PTX modules into ctx->modules.  If any fails to
+// load, unloads the others and returns the error.
+static CUresult cuda_load_modules(struct futhark_context *ctx, int num_modules,
+                                  const unsigned char **ptxs) {
+  ctx->modules = (CUmodule*) malloc(num_modules * sizeof(CUmodule));
+  for (int i = 0; i < num_modules; i++) {
+    CUresult res = (ctx->cfg->cuModuleLoadData)(&ctx->modules[i], ptxs[i]);
+    if (res != CUDA_SUCCESS) {
+      while (i-- > 0) {
+        (ctx->cfg->cuModuleUnload)(ctx->modules[i]);
+      }
+      free(ctx->modules);
+      ctx->modules = NULL;
+      return res;
+    }
   }
+  ctx->num_modules = num_modules;
+  return CUDA_SUCCESS;
 }
 
 static void cuda_size_setup(struct futhark_context *ctx)
@@ -930,11 +1250,15 @@ static char* cuda_module_setup(struct futhark_context *ctx,
                                const char *src,
                                const char *extra_opts[],
                                const char* cache_fname) {
-  char *ptx = NULL;
+  struct gpu_module *modules = NULL;
+  int num_modules = 0;
   struct futhark_context_config *cfg = ctx->cfg;
 
   if (cfg->load_ptx_from) {
-    ptx = slurp_file(cfg->load_ptx_from, NULL);
+    modules = (struct gpu_module*) calloc(1, sizeof(struct gpu_module));
+    modules[0].code = (char*) slurp_file(cfg->load_ptx_from, NULL);
+    modules[0].code_size = strlen(modules[0].code) + 1;
+    num_modules = 1;
   }
 
   char **opts;
@@ -949,16 +1273,25 @@ static char* cuda_module_setup(struct futhark_context *ctx,
     fprintf(stderr, "\n");
   }
 
+  // When dumping PTX we compile the program as a single module, such
+  // that the dump can be loaded again with --load-ptx.
+  int use_cache = cache_fname != NULL && modules == NULL && cfg->dump_ptx_to == NULL;
+
   struct cache_hash h;
   int loaded_ptx_from_cache = 0;
-  if (cache_fname != NULL) {
-    cuda_load_ptx_from_cache(cfg, src, (const char**)opts, n_opts, &h, cache_fname, &ptx);
-
-    if (ptx != NULL) {
+  if (use_cache) {
+    unsigned char *buf;
+    size_t bufsize;
+    const unsigned char **codes;
+    size_t *sizes;
+    int n = cuda_load_ptx_from_cache(cfg, src, (const char**)opts, n_opts, &h, cache_fname,
+                                     &buf, &bufsize, &codes, &sizes);
+
+    if (n > 0) {
       if (cfg->logging) {
-        fprintf(stderr, "Restored PTX from cache; now loading module...\n");
+        fprintf(stderr, "Restored PTX for %d module(s) from cache; now loading...\n", n);
       }
-      if ((ctx->cfg->cuModuleLoadData)(&ctx->module, ptx) == CUDA_SUCCESS) {
+      if (cuda_load_modules(ctx, n, codes) == CUDA_SUCCESS) {
         if (cfg->logging) {
           fprintf(stderr, "Success!\n");
         }
@@ -967,42 +1300,73 @@ static char* cuda_module_setup(struct futhark_context *ctx,
         if (cfg->logging) {
           fprintf(stderr, "Failed!\n");
         }
-        free(ptx);
-        ptx = NULL;
       }
+      free(codes);
+      free(sizes);
+      cache_release(buf, bufsize);
     }
   }
 
-  if (ptx == NULL) {
-    char* problem = cuda_nvrtc_build(ctx, src, (const char**)opts, n_opts, &ptx);
-    if (problem != NULL) {
-      return problem;
+  if (!loaded_ptx_from_cache) {
+    if (modules == NULL) {
+      int num_threads = cfg->compile_threads > 0
+        ? cfg->compile_threads : gpu_num_compile_threads();
+      num_modules = gpu_split_program(src, cfg->dump_ptx_to == NULL ? num_threads : 1,
+                                      &modules);
+      if (cfg->logging) {
+        fprintf(stderr, "Compiling %d module(s) with NVRTC using up to %d thread(s)...\n",
+                num_modules, num_threads);
+      }
+      struct cuda_nvrtc_job job;
+      job.ctx = ctx;
+      job.opts = (const char**)opts;
+      job.n_opts = n_opts;
+      char *problem = gpu_compile_modules(modules, num_modules, num_threads,
+                                          cuda_nvrtc_compile, &job);
+      if (problem != NULL) {
+        for (size_t i = 0; i < n_opts; i++) {
+          free((char *)opts[i]);
+        }
+        free(opts);
+        gpu_free_modules(modules, num_modules);
+        return problem;
+      }
     }
-  }
 
-  if (cfg->dump_ptx_to != NULL) {
-    dump_file(cfg->dump_ptx_to, ptx, strlen(ptx));
-  }
+    if (cfg->dump_ptx_to != NULL) {
+      dump_file(cfg->dump_ptx_to, modules[0].code, strlen(modules[0].code));
+    }
 
-  if (!loaded_ptx_from_cache) {
-    CUDA_SUCCEED_FATAL((ctx->cfg->cuModuleLoadData)(&ctx->module, ptx));
+    const unsigned char **codes =
+      (const unsigned char**) malloc(num_modules * sizeof(const unsigned char*));
+    for (int i = 0; i < num_modules; i++) {
+      codes[i] = (const unsigned char*)modules[i].code;
+    }
+    CUDA_SUCCEED_FATAL(cuda_load_modules(ctx, num_modules, codes));
+    free(codes);
   }
 
-  if (cache_fname != NULL && !loaded_ptx_from_cache) {
+  if (use_cache && !loaded_ptx_from_cache) {
     if (cfg->logging) {
       fprintf(stderr, "Caching PTX in %s...\n", cache_fname);
     }
+    unsigned char *buf;
+    size_t bufsize;
+    gpu_pack_modules(modules, num_modules, &buf, &bufsize);
     errno = 0;
-    if (cache_store(cache_fname, &h, (const unsigned char*)ptx, strlen(ptx)) != 0) {
+    if (cache_store(cache_fname, &h, buf, bufsize) != 0) {
       fprintf(stderr, "Failed to cache PTX: %s\n", strerror(errno));
     }
+    free(buf);
   }
 
   for (size_t i = 0; i < n_opts; i++) {
     free((char *)opts[i]);
   }
   free(opts);
-  free(ptx);
+  if (modules != NULL) {
+    gpu_free_modules(modules, num_modules);
+  }
 
   return NULL;
 }
@@ -1092,15 +1456,674 @@ CUdevice futhark_context_set_device(struct futhark_context* ctx, CUdevice dev) {
 
 CUstream futhark_context_set_stream(struct futhark_context* ctx, CUstream stream) {
   CUstream old_stream = ctx->stream;
+  if (cuda_replay_flush(ctx) != FUTHARK_SUCCESS) {
+    ctx->replay_failed = 1;
+  }
+  if (ctx->use_copy_streams) {
+    // The copy streams only know how to wait for the current compute
+    // stream.
+    (void)(ctx->cfg->cuStreamSynchronize)(old_stream);
+  }
   ctx->stream = stream;
   return old_stream;
 }
 
+static int cuda_staging_setup(struct futhark_context *ctx) {
+  struct futhark_context_config *cfg = ctx->cfg;
+  if (ctx->staging_state != 0) {
+    return ctx->staging_state > 0;
+  }
+  ctx->staging_state = -1;
+  if (cfg->num_staging_buffers <= 0 || cfg->staging_buffer_size == 0 ||
+      cfg->cuMemAllocHost == NULL || cfg->cuMemFreeHost == NULL ||
+      cfg->cuEventSynchronize == NULL) {
+    return 0;
+  }
+
+  ctx->staging = calloc(cfg->num_staging_buffers, sizeof(struct cuda_staging_buffer));
+  for (int i = 0; i < cfg->num_staging_buffers; i++) {
+    struct cuda_staging_buffer *b = &ctx->staging[i];
+    if ((cfg->cuMemAllocHost)((void**)&b->host, cfg->staging_buffer_size) != CUDA_SUCCESS ||
+        (cfg->cuEventCreate)(&b->done, CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS) {
+      if (ctx->logging) {
+        fprintf(ctx->log, "Could not allocate staging buffers; transferring directly.\n");
+      }
+      for (int j = 0; j <= i; j++) {
+        if (ctx->staging[j].host != NULL) {
+          (void)(cfg->cuMemFreeHost)(ctx->staging[j].host);
+        }
+        if (j < i) {
+          (void)(cfg->cuEventDestroy)(ctx->staging[j].done);
+        }
+      }
+      free(ctx->staging);
+      ctx->staging = NULL;
+      return 0;
+    }
+  }
+  ctx->staging_next = 0;
+  ctx->staging_state = 1;
+  return 1;
+}
+
+// Wait until the transfer using the buffer has finished, and finish
+// any pending device-to-host copy.
+static int cuda_staging_wait(struct futhark_context *ctx,
+                             struct cuda_staging_buffer *b) {
+  if (b->busy) {
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventSynchronize)(b->done));
+    b->busy = 0;
+    if (b->dst != NULL) {
+      memcpy(b->dst, b->host, b->size);
+      b->dst = NULL;
+    }
+  }
+  return FUTHARK_SUCCESS;
+}
+
+// Buffers are used round-robin, so the next buffer is also the one
+// used least recently.
+static int cuda_staging_acquire(struct futhark_context *ctx,
+                                struct cuda_staging_buffer **b_out) {
+  struct cuda_staging_buffer *b = &ctx->staging[ctx->staging_next];
+  ctx->staging_next = (ctx->staging_next + 1) % ctx->cfg->num_staging_buffers;
+  *b_out = b;
+  return cuda_staging_wait(ctx, b);
+}
+
+// Wait for all staging buffers, oldest first, such that pending
+// copies to host memory are performed in the order they were issued.
+static int cuda_staging_flush(struct futhark_context *ctx) {
+  if (ctx->staging_state <= 0) {
+    return FUTHARK_SUCCESS;
+  }
+  int n = ctx->cfg->num_staging_buffers;
+  for (int i = 0; i < n; i++) {
+    int err = cuda_staging_wait(ctx, &ctx->staging[(ctx->staging_next + i) % n]);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static int cuda_scalar_staging_setup(struct futhark_context *ctx) {
+  if (ctx->scalar_staging_state == 0) {
+    ctx->scalar_staging_state = -1;
+    if (ctx->cfg->cuMemAllocHost != NULL && ctx->cfg->cuMemFreeHost != NULL &&
+        (ctx->cfg->cuMemAllocHost)((void**)&ctx->scalar_staging,
+                                   CUDA_SCALAR_SLOTS * CUDA_SCALAR_SLOT_SIZE) == CUDA_SUCCESS) {
+      ctx->scalar_staging_state = 1;
+    }
+  }
+  return ctx->scalar_staging_state > 0;
+}
+
+static void cuda_scalar_staging_free(struct futhark_context *ctx) {
+  if (ctx->scalar_staging_state > 0) {
+    (void)(ctx->cfg->cuMemFreeHost)(ctx->scalar_staging);
+    ctx->scalar_staging = NULL;
+  }
+  ctx->scalar_staging_state = 0;
+  ctx->num_scalar_reads = 0;
+}
+
+static int cuda_staging_free(struct futhark_context *ctx) {
+  int err = cuda_staging_flush(ctx);
+  if (ctx->staging_state > 0) {
+    for (int i = 0; i < ctx->cfg->num_staging_buffers; i++) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventDestroy)(ctx->staging[i].done));
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemFreeHost)(ctx->staging[i].host));
+    }
+    free(ctx->staging);
+    ctx->staging = NULL;
+  }
+  ctx->staging_state = 0;
+  return err;
+}
+
+// Copy from host memory through the staging buffers.  The host
+// memory may be reused as soon as this function returns.
+static int cuda_memcpy_host2gpu_staged(struct futhark_context* ctx,
+                                       CUstream stream,
+                                       CUdeviceptr dst,
+                                       const unsigned char* src,
+                                       int64_t nbytes) {
+  int64_t chunk = ctx->cfg->staging_buffer_size;
+  for (int64_t offset = 0; offset < nbytes; offset += chunk) {
+    int64_t n = nbytes - offset < chunk ? nbytes - offset : chunk;
+    struct cuda_staging_buffer *b;
+    int err = cuda_staging_acquire(ctx, &b);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+    memcpy(b->host, src + offset, n);
+    CUDA_SUCCEED_OR_RETURN
+      ((ctx->cfg->cuMemcpyHtoDAsync)(dst + offset, b->host, n, stream));
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventRecord)(b->done, stream));
+    b->busy = 1;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+// Copy to host memory through the staging buffers.  The copies out of
+// the staging buffers are only guaranteed to have happened after
+// cuda_staging_flush().
+static int cuda_memcpy_gpu2host_staged(struct futhark_context* ctx,
+                                       CUstream stream,
+                                       unsigned char* dst,
+                                       CUdeviceptr src,
+                                       int64_t nbytes) {
+  int64_t chunk = ctx->cfg->staging_buffer_size;
+  for (int64_t offset = 0; offset < nbytes; offset += chunk) {
+    int64_t n = nbytes - offset < chunk ? nbytes - offset : chunk;
+    struct cuda_staging_buffer *b;
+    int err = cuda_staging_acquire(ctx, &b);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+    CUDA_SUCCEED_OR_RETURN
+      ((ctx->cfg->cuMemcpyDtoHAsync)(b->host, src + offset, n, stream));
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventRecord)(b->done, stream));
+    b->busy = 1;
+    b->dst = dst + offset;
+    b->size = n;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static size_t cuda_mem_sync_hash(CUdeviceptr mem) {
+  // Allocations are aligned, so the low bits carry little information.
+  uint64_t h = (uint64_t)mem;
+  h ^= h >> 29;
+  h *= 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 32);
+}
+
+// The slot containing 'mem', or the empty slot where it would go.
+static struct cuda_mem_sync* cuda_mem_sync_slot(struct cuda_mem_sync_table *t,
+                                                CUdeviceptr mem) {
+  size_t mask = t->capacity - 1;
+  size_t i = cuda_mem_sync_hash(mem) & mask;
+  while (t->slots[i].mem != 0 && t->slots[i].mem != mem) {
+    i = (i + 1) & mask;
+  }
+  return &t->slots[i];
+}
+
+static struct cuda_mem_sync* cuda_mem_sync_lookup(struct futhark_context *ctx,
+                                                  CUdeviceptr mem) {
+  if (mem == 0 || ctx->mem_sync.used == 0) {
+    return NULL;
+  }
+  struct cuda_mem_sync *b = cuda_mem_sync_slot(&ctx->mem_sync, mem);
+  return b->mem == 0 ? NULL : b;
+}
+
+static void cuda_mem_sync_insert(struct futhark_context *ctx, CUdeviceptr mem) {
+  struct cuda_mem_sync_table *t = &ctx->mem_sync;
+  if (2 * (t->used + 1) > t->capacity) {
+    struct cuda_mem_sync *old_slots = t->slots;
+    int old_capacity = t->capacity;
+    t->capacity *= 2;
+    t->slots = calloc(t->capacity, sizeof(struct cuda_mem_sync));
+    for (int i = 0; i < old_capacity; i++) {
+      if (old_slots[i].mem != 0) {
+        *cuda_mem_sync_slot(t, old_slots[i].mem) = old_slots[i];
+      }
+    }
+    free(old_slots);
+  }
+  struct cuda_mem_sync *b = cuda_mem_sync_slot(t, mem);
+  if (b->mem == 0) {
+    t->used++;
+    b->mem = mem;
+    b->copy = NULL;
+  }
+  b->compute_seq = 0;
+  b->copy_pending = 0;
+}
+
+// Removes the entry, shifting back any following entries in the same
+// probe sequence so that no tombstones are needed.
+static void cuda_mem_sync_remove(struct futhark_context *ctx, struct cuda_mem_sync *b) {
+  struct cuda_mem_sync_table *t = &ctx->mem_sync;
+  size_t mask = t->capacity - 1;
+  size_t i = b - t->slots;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (t->slots[j].mem == 0) {
+      break;
+    }
+    size_t k = cuda_mem_sync_hash(t->slots[j].mem) & mask;
+    // Move the entry at j into the hole at i, unless its home slot k
+    // lies cyclically in (i,j].
+    if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+  memset(&t->slots[i], 0, sizeof(struct cuda_mem_sync));
+  t->used--;
+}
+
+static int cuda_copy_streams_setup(struct futhark_context *ctx) {
+  struct futhark_context_config *cfg = ctx->cfg;
+  ctx->use_copy_streams = 0;
+  ctx->compute_seq = 0;
+  ctx->compute_tail_seq = 0;
+  ctx->mem_sync.slots = NULL;
+  ctx->mem_sync.capacity = 0;
+  ctx->mem_sync.used = 0;
+  if (!cfg->copy_streams ||
+      cfg->cuStreamCreate == NULL || cfg->cuStreamDestroy == NULL ||
+      cfg->cuStreamWaitEvent == NULL || cfg->cuEventSynchronize == NULL) {
+    return 0;
+  }
+  int created = 0;
+  for (; created < 2; created++) {
+    if ((cfg->cuStreamCreate)(&ctx->copy_streams[created],
+                              CU_STREAM_NON_BLOCKING) != CUDA_SUCCESS) {
+      break;
+    }
+  }
+  if (created < 2 ||
+      (cfg->cuEventCreate)(&ctx->compute_tail, CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS) {
+    if (ctx->logging) {
+      fprintf(ctx->log, "Could not create copy streams; using a single stream.\n");
+    }
+    for (int i = 0; i < created; i++) {
+      (void)(cfg->cuStreamDestroy)(ctx->copy_streams[i]);
+    }
+    return 0;
+  }
+  ctx->mem_sync.capacity = 64;
+  ctx->mem_sync.slots = calloc(ctx->mem_sync.capacity, sizeof(struct cuda_mem_sync));
+  ctx->use_copy_streams = 1;
+  return 1;
+}
+
+// Wait for and release everything.  Entries still in the table belong
+// to blocks that were never freed.
+static int cuda_copy_streams_free(struct futhark_context *ctx) {
+  if (!ctx->use_copy_streams) {
+    return FUTHARK_SUCCESS;
+  }
+  struct futhark_context_config *cfg = ctx->cfg;
+  for (int i = 0; i < 2; i++) {
+    CUDA_SUCCEED_OR_RETURN((cfg->cuStreamSynchronize)(ctx->copy_streams[i]));
+    CUDA_SUCCEED_OR_RETURN((cfg->cuStreamDestroy)(ctx->copy_streams[i]));
+  }
+  for (int i = 0; i < ctx->mem_sync.capacity; i++) {
+    if (ctx->mem_sync.slots[i].mem != 0 && ctx->mem_sync.slots[i].copy != NULL) {
+      CUDA_SUCCEED_OR_RETURN((cfg->cuEventDestroy)(ctx->mem_sync.slots[i].copy));
+    }
+  }
+  CUDA_SUCCEED_OR_RETURN((cfg->cuEventDestroy)(ctx->compute_tail));
+  free(ctx->mem_sync.slots);
+  ctx->mem_sync.slots = NULL;
+  ctx->mem_sync.used = 0;
+  ctx->use_copy_streams = 0;
+  return FUTHARK_SUCCESS;
+}
+
+// Must be called for every block touched by an operation on the
+// compute stream, after incrementing ctx->compute_seq and before
+// enqueueing the operation.
+static int cuda_compute_uses(struct futhark_context *ctx, CUdeviceptr mem) {
+  struct cuda_mem_sync *b = cuda_mem_sync_lookup(ctx, mem);
+  if (b != NULL) {
+    if (b->copy_pending) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuStreamWaitEvent)(ctx->stream, b->copy, 0));
+      b->copy_pending = 0;
+    }
+    b->compute_seq = ctx->compute_seq;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+// Pick the stream for a transfer to or from 'mem', and make it wait
+// for prior work touching 'mem'.  Transfers involving memory we know
+// nothing about (such as memory passed to futhark_new_raw) go on the
+// compute stream, in which case *b_out is NULL.
+static int cuda_copy_begin(struct futhark_context *ctx, enum cuda_copy_dir dir,
+                           CUdeviceptr mem,
+                           struct cuda_mem_sync **b_out, CUstream *stream_out) {
+  struct cuda_mem_sync *b =
+    ctx->use_copy_streams ? cuda_mem_sync_lookup(ctx, mem) : NULL;
+  *b_out = b;
+  if (b == NULL) {
+    *stream_out = ctx->stream;
+    return FUTHARK_SUCCESS;
+  }
+  CUstream stream = ctx->copy_streams[dir];
+  *stream_out = stream;
+  if (b->compute_seq > 0) {
+    if (ctx->compute_tail_seq < b->compute_seq) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventRecord)(ctx->compute_tail, ctx->stream));
+      ctx->compute_tail_seq = ctx->compute_seq;
+    }
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuStreamWaitEvent)(stream, ctx->compute_tail, 0));
+  }
+  // Unless the compute stream has already waited for the previous
+  // transfer (and thus compute_tail covers it), we must wait directly.
+  if (b->copy != NULL && b->copy_dir != (int)dir &&
+      (b->copy_pending || b->compute_seq == 0)) {
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuStreamWaitEvent)(stream, b->copy, 0));
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static int cuda_copy_end(struct futhark_context *ctx, enum cuda_copy_dir dir,
+                         struct cuda_mem_sync *b) {
+  if (b != NULL) {
+    if (b->copy == NULL) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventCreate)(&b->copy, CU_EVENT_DISABLE_TIMING));
+    }
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventRecord)(b->copy, ctx->copy_streams[dir]));
+    b->copy_dir = dir;
+    b->copy_pending = 1;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+// At most this many commands are recorded between two flushes.
+static const int cuda_replay_max_cmds = 4096;
+
+static size_t cuda_replay_pad(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+static void cuda_replay_setup(struct futhark_context *ctx) {
+  struct futhark_context_config *cfg = ctx->cfg;
+  ctx->recordings = NULL;
+  ctx->replay_state = CUDA_REPLAY_IDLE;
+  ctx->replay_cur = NULL;
+  ctx->replay_scratch = NULL;
+  ctx->replay_scratch_capacity = 0;
+  ctx->replay_clock = 0;
+  ctx->replay_failed = 0;
+  if (cfg->replay_launches <= 0 ||
+      cfg->cuStreamBeginCapture == NULL || cfg->cuStreamEndCapture == NULL ||
+      cfg->cuGraphInstantiateWithFlags == NULL || cfg->cuGraphLaunch == NULL ||
+      cfg->cuGraphExecDestroy == NULL || cfg->cuGraphDestroy == NULL) {
+    return;
+  }
+  ctx->recordings = calloc(cfg->replay_launches, sizeof(struct cuda_recording));
+}
+
+static int cuda_replay_enabled(struct futhark_context *ctx) {
+  return ctx->recordings != NULL && !ctx->profiling && !ctx->debugging;
+}
+
+// Forget the commands after the first 'num_cmds'.
+static int cuda_recording_truncate(struct futhark_context *ctx, struct cuda_recording *r,
+                                   size_t size, int num_cmds) {
+  r->size = size;
+  r->num_cmds = num_cmds;
+  if (r->graph != NULL) {
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuGraphExecDestroy)(r->graph));
+    r->graph = NULL;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static void cuda_recording_append(struct cuda_recording *r, const struct cuda_replay_cmd *cmd) {
+  if (r->size + cmd->size > r->capacity) {
+    r->capacity = (r->size + cmd->size) * 2;
+    r->cmds = realloc(r->cmds, r->capacity);
+  }
+  memcpy(r->cmds + r->size, cmd, cmd->size);
+  r->size += cmd->size;
+  r->num_cmds++;
+}
+
+// Build a command in the scratch buffer.
+static struct cuda_replay_cmd* cuda_replay_cmd_new(struct futhark_context *ctx, int num_args,
+                                                   void* args[], size_t args_sizes[]) {
+  size_t size = sizeof(struct cuda_replay_cmd) + num_args * sizeof(size_t);
+  for (int i = 0; i < num_args; i++) {
+    size += cuda_replay_pad(args_sizes[i]);
+  }
+  if (size > ctx->replay_scratch_capacity) {
+    ctx->replay_scratch_capacity = size * 2;
+    ctx->replay_scratch = realloc(ctx->replay_scratch, ctx->replay_scratch_capacity);
+  }
+  memset(ctx->replay_scratch, 0, size);
+  struct cuda_replay_cmd *cmd = (struct cuda_replay_cmd*)ctx->replay_scratch;
+  cmd->size = size;
+  cmd->num_args = num_args;
+  size_t *sizes = (size_t*)(cmd + 1);
+  unsigned char *vals = (unsigned char*)(sizes + num_args);
+  for (int i = 0; i < num_args; i++) {
+    sizes[i] = args_sizes[i];
+    memcpy(vals, args[i], args_sizes[i]);
+    vals += cuda_replay_pad(args_sizes[i]);
+  }
+  return cmd;
+}
+
+static int cuda_replay_issue(struct futhark_context *ctx, const struct cuda_replay_cmd *cmd) {
+  if (cmd->kernel == NULL) {
+    CUDA_SUCCEED_OR_RETURN
+      ((ctx->cfg->cuMemcpyAsync)(cmd->dst, cmd->src, cmd->nbytes, ctx->stream));
+  } else {
+    void* args[cmd->num_args > 0 ? cmd->num_args : 1];
+    const size_t *sizes = (const size_t*)(cmd + 1);
+    unsigned char *vals = (unsigned char*)(sizes + cmd->num_args);
+    for (int i = 0; i < cmd->num_args; i++) {
+      args[i] = vals;
+      vals += cuda_replay_pad(sizes[i]);
+    }
+    CUDA_SUCCEED_OR_RETURN
+      ((ctx->cfg->cuLaunchKernel)(cmd->kernel,
+                                  cmd->dims[0], cmd->dims[1], cmd->dims[2],
+                                  cmd->dims[3], cmd->dims[4], cmd->dims[5],
+                                  cmd->dims[6], ctx->stream,
+                                  args, NULL));
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static int cuda_replay_issue_range(struct futhark_context *ctx, struct cuda_recording *r,
+                                   size_t size) {
+  for (size_t pos = 0; pos < size; ) {
+    const struct cuda_replay_cmd *cmd = (const struct cuda_replay_cmd*)(r->cmds + pos);
+    int err = cuda_replay_issue(ctx, cmd);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+    pos += cmd->size;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+// Capture the recording into a graph by issuing it on the stream
+// while capturing.  On failure, the commands have not been executed.
+static void cuda_recording_capture(struct futhark_context *ctx, struct cuda_recording *r) {
+  struct futhark_context_config *cfg = ctx->cfg;
+  CUgraph graph = NULL;
+  if ((cfg->cuStreamBeginCapture)(ctx->stream, CU_STREAM_CAPTURE_MODE_RELAXED) != CUDA_SUCCESS) {
+    r->no_graph = 1;
+  } else {
+    // Errors while capturing are not errors of the program.
+    char *error = ctx->error;
+    ctx->error = NULL;
+    int ok = cuda_replay_issue_range(ctx, r, r->size) == FUTHARK_SUCCESS;
+    if ((cfg->cuStreamEndCapture)(ctx->stream, &graph) != CUDA_SUCCESS) {
+      ok = 0;
+    }
+    if (ok && (cfg->cuGraphInstantiateWithFlags)(&r->graph, graph, 0) != CUDA_SUCCESS) {
+      r->graph = NULL;
+    }
+    if (graph != NULL) {
+      (void)(cfg->cuGraphDestroy)(graph);
+    }
+    free(ctx->error);
+    ctx->error = error;
+    r->no_graph = r->graph == NULL;
+  }
+  if (r->no_graph && ctx->logging) {
+    fprintf(ctx->log, "Could not capture launch sequence; issuing launches directly.\n");
+  }
+}
+
+// Issue any deferred commands.  Must be called before anything that
+// depends on the stream being up to date.
+static int cuda_replay_flush(struct futhark_context *ctx) {
+  struct cuda_recording *r = ctx->replay_cur;
+  enum cuda_replay_state state = ctx->replay_state;
+  ctx->replay_state = CUDA_REPLAY_IDLE;
+  ctx->replay_cur = NULL;
+  int err = FUTHARK_SUCCESS;
+  if (state == CUDA_REPLAY_MATCHING) {
+    if (ctx->replay_pos == r->size) {
+      if (r->graph == NULL && !r->no_graph) {
+        cuda_recording_capture(ctx, r);
+      }
+      if (r->graph != NULL) {
+        CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuGraphLaunch)(r->graph, ctx->stream));
+      } else {
+        err = cuda_replay_issue_range(ctx, r, r->size);
+      }
+    } else {
+      // Only a prefix was seen this time; remember that instead.
+      err = cuda_replay_issue_range(ctx, r, ctx->replay_pos);
+      if (err == FUTHARK_SUCCESS) {
+        err = cuda_recording_truncate(ctx, r, ctx->replay_pos, ctx->replay_pos_cmds);
+      }
+    }
+  }
+  return err;
+}
+
+// Called at the end of every API function.
+static void cuda_replay_end(struct futhark_context *ctx) {
+  if (ctx->replay_state != CUDA_REPLAY_IDLE &&
+      cuda_replay_flush(ctx) != FUTHARK_SUCCESS) {
+    ctx->replay_failed = 1;
+  }
+}
+
+// Account for a command.  If it continues the recording being
+// matched, it is deferred and *deferred is set, in which case the
+// caller must not issue it.
+static int cuda_replay_add(struct futhark_context *ctx, const struct cuda_replay_cmd *cmd,
+                           int *deferred) {
+  struct cuda_recording *r = ctx->replay_cur;
+  *deferred = 0;
+  switch (ctx->replay_state) {
+  case CUDA_REPLAY_IDLE: {
+    struct cuda_recording *victim = &ctx->recordings[0];
+    for (int i = 0; i < ctx->cfg->replay_launches; i++) {
+      struct cuda_recording *c = &ctx->recordings[i];
+      if (c->num_cmds > 0 &&
+          ((struct cuda_replay_cmd*)c->cmds)->size == cmd->size &&
+          memcmp(c->cmds, cmd, cmd->size) == 0) {
+        c->last_used = ++ctx->replay_clock;
+        ctx->replay_state = CUDA_REPLAY_MATCHING;
+        ctx->replay_cur = c;
+        ctx->replay_pos = cmd->size;
+        ctx->replay_pos_cmds = 1;
+        *deferred = 1;
+        return FUTHARK_SUCCESS;
+      }
+      if (c->last_used < victim->last_used) {
+        victim = c;
+      }
+    }
+    int err = cuda_recording_truncate(ctx, victim, 0, 0);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+    victim->no_graph = 0;
+    victim->last_used = ++ctx->replay_clock;
+    cuda_recording_append(victim, cmd);
+    ctx->replay_state = CUDA_REPLAY_RECORDING;
+    ctx->replay_cur = victim;
+    return FUTHARK_SUCCESS;
+  }
+  case CUDA_REPLAY_MATCHING: {
+    if (ctx->replay_pos < r->size &&
+        ((struct cuda_replay_cmd*)(r->cmds + ctx->replay_pos))->size == cmd->size &&
+        memcmp(r->cmds + ctx->replay_pos, cmd, cmd->size) == 0) {
+      ctx->replay_pos += cmd->size;
+      ctx->replay_pos_cmds++;
+      *deferred = 1;
+      return FUTHARK_SUCCESS;
+    }
+    // Diverged: issue what we deferred, and record from here on.
+    int err = cuda_replay_issue_range(ctx, r, ctx->replay_pos);
+    if (err == FUTHARK_SUCCESS) {
+      err = cuda_recording_truncate(ctx, r, ctx->replay_pos, ctx->replay_pos_cmds);
+    }
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+    r->no_graph = 0;
+    ctx->replay_state = CUDA_REPLAY_RECORDING;
+  }
+    // Fall through.
+  case CUDA_REPLAY_RECORDING:
+    if (r->num_cmds < cuda_replay_max_cmds) {
+      cuda_recording_append(r, cmd);
+    } else {
+      int err = cuda_recording_truncate(ctx, r, 0, 0);
+      if (err != FUTHARK_SUCCESS) {
+        return err;
+      }
+      ctx->replay_state = CUDA_REPLAY_DIRECT;
+    }
+    return FUTHARK_SUCCESS;
+  case CUDA_REPLAY_DIRECT:
+    return FUTHARK_SUCCESS;
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static int cuda_replay_free(struct futhark_context *ctx) {
+  if (ctx->recordings == NULL) {
+    return FUTHARK_SUCCESS;
+  }
+  int err = cuda_replay_flush(ctx);
+  for (int i = 0; i < ctx->cfg->replay_launches; i++) {
+    if (ctx->recordings[i].graph != NULL) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuGraphExecDestroy)(ctx->recordings[i].graph));
+    }
+    free(ctx->recordings[i].cmds);
+  }
+  free(ctx->recordings);
+  ctx->recordings = NULL;
+  free(ctx->replay_scratch);
+  ctx->replay_scratch = NULL;
+  return err;
+}
+
 int futhark_context_may_fail(struct futhark_context* ctx) {
   return ctx->failure_is_an_option;
 }
 
 int futhark_context_sync(struct futhark_context* ctx) {
+  int err = cuda_replay_flush(ctx);
+  if (err == FUTHARK_SUCCESS && ctx->replay_failed) {
+    ctx->replay_failed = 0;
+    // Keeps the driver error if the failing flush already set one.
+    set_error(ctx, strdup("Failed to replay deferred CUDA launches.\n"));
+    err = FUTHARK_PROGRAM_ERROR;
+  }
+  if (err == FUTHARK_SUCCESS) {
+    err = cuda_staging_flush(ctx);
+  }
+  if (err != FUTHARK_SUCCESS) {
+    return err;
+  }
+  ctx->num_syncs++;
+  if (ctx->use_copy_streams) {
+    for (int i = 0; i < 2; i++) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuStreamSynchronize)(ctx->copy_streams[i]));
+    }
+  }
   //CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuCtxPushCurrent)(ctx->cu_ctx));
   //CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuCtxSynchronize)());
   if (ctx->failure_is_an_option) {
@@ -1148,10 +2171,13 @@ void free_builtin_kernels(struct futhark_context* ctx, struct builtin_kernels* k
 int backend_context_setup(struct futhark_context* ctx) {
   ctx->dev = ctx->cfg->setup_dev;
   ctx->stream = ctx->cfg->setup_stream;
+  int64_t t_start = get_wall_time();
 
   ctx->failure_is_an_option = 0;
   ctx->total_runs = 0;
   ctx->total_runtime = 0;
+  ctx->modules = NULL;
+  ctx->num_modules = 0;
   ctx->peak_mem_usage_device = 0;
   ctx->cur_mem_usage_device = 0;
 
@@ -1162,7 +2188,15 @@ int backend_context_setup(struct futhark_context* ctx) {
   //CUDA_SUCCEED_FATAL(cuCtxCreate(&ctx->cu_ctx, 0, ctx->dev));
   CUDA_SUCCEED_FATAL((ctx->cfg->cuDevicePrimaryCtxRetain)(&ctx->cu_ctx, ctx->dev));
 
-  //free_list_init(&ctx->gpu_free_list);
+  free_list_init(&ctx->gpu_free_list);
+  ctx->gpu_free_list_size = 0;
+
+  ctx->staging = NULL;
+  ctx->staging_state = 0;
+
+  ctx->scalar_staging = NULL;
+  ctx->scalar_staging_state = 0;
+  ctx->num_scalar_reads = 0;
 
   // MAX_SHARED_MEMORY_PER_BLOCK gives bogus numbers (48KiB); probably
   // for backwards compatibility.  Add _OPTIN and you seem to get the
@@ -1180,7 +2214,10 @@ int backend_context_setup(struct futhark_context* ctx) {
   ctx->max_cache = device_query(ctx->dev, L2_CACHE_SIZE);
   ctx->lockstep_width = device_query(ctx->dev, WARP_SIZE);
   //CUDA_SUCCEED_FATAL(cuStreamCreate(&ctx->stream, CU_STREAM_DEFAULT));
+  cuda_copy_streams_setup(ctx);
+  cuda_replay_setup(ctx);
   cuda_size_setup(ctx);
+  int64_t t_module = get_wall_time();
   ctx->error = cuda_module_setup(ctx,
                                  ctx->cfg->program,
                                  (const char**)ctx->cfg->nvrtc_opts,
@@ -1189,6 +2226,10 @@ int backend_context_setup(struct futhark_context* ctx) {
   if (ctx->error != NULL) {
     futhark_panic(1, "During CUDA initialisation:\n%s\n", ctx->error);
   }
+  if (ctx->logging) {
+    fprintf(ctx->log, "CUDA setup: device %ldus, module %ldus.\n",
+            (long)(t_module - t_start), (long)(get_wall_time() - t_module));
+  }
 
   int32_t no_error = -1;
   CUDA_SUCCEED_FATAL((ctx->cfg->gpu_global_failure_alloc)(&ctx->global_failure, sizeof(int64_t) * (max_failure_args + 1)));
@@ -1209,9 +2250,16 @@ int backend_context_setup(struct futhark_context* ctx) {
 void backend_context_teardown(struct futhark_context* ctx) {
   free_builtin_kernels(ctx, ctx->kernels);
   (ctx->cfg->gpu_global_failure_free)(ctx->global_failure);
-  //CUDA_SUCCEED_FATAL(gpu_free_all(ctx));
-  //free_list_destroy(&ctx->gpu_free_list);
-  CUDA_SUCCEED_FATAL((ctx->cfg->cuModuleUnload)(ctx->module));
+  (void)gpu_free_all(ctx);
+  free_list_destroy(&ctx->gpu_free_list);
+  (void)cuda_replay_free(ctx);
+  (void)cuda_staging_free(ctx);
+  cuda_scalar_staging_free(ctx);
+  (void)cuda_copy_streams_free(ctx);
+  for (int i = 0; i < ctx->num_modules; i++) {
+    CUDA_SUCCEED_FATAL((ctx->cfg->cuModuleUnload)(ctx->modules[i]));
+  }
+  free(ctx->modules);
   //CUDA_SUCCEED_FATAL(cuStreamDestroy(ctx->stream));
   //CUDA_SUCCEED_FATAL((ctx->cfg->cuCtxDestroy)(ctx->cu_ctx));
   CUDA_SUCCEED_FATAL((ctx->cfg->cuDevicePrimaryCtxRelease)(ctx->dev));
@@ -1219,9 +2267,10 @@ void backend_context_teardown(struct futhark_context* ctx) {
 
 void backend_context_release(struct futhark_context* ctx) {
   if (ctx->cfg->tracing) printf("TRACE: rts: cuda: backend_context_release: ...\n");
-  //CUDA_SUCCEED_FATAL(gpu_free_all(ctx));
-  //free_list_destroy(&ctx->gpu_free_list);
-  //free_list_init(&ctx->gpu_free_list);
+  (void)cuda_replay_flush(ctx);
+  (void)gpu_free_all(ctx);
+  (void)cuda_staging_free(ctx);
+  cuda_scalar_staging_free(ctx);
   if (ctx->cfg->tracing) printf("TRACE: rts: cuda: backend_context_release: done\n");
 }
 
@@ -1238,7 +2287,12 @@ static void gpu_create_kernel(struct futhark_context *ctx,
   if (ctx->debugging) {
     fprintf(ctx->log, "Creating kernel %s.\n", name);
   }
-  CUDA_SUCCEED_FATAL((ctx->cfg->cuModuleGetFunction)(kernel, ctx->module, name));
+  // The kernel is in exactly one of the modules.
+  CUresult res = CUDA_ERROR_NOT_FOUND;
+  for (int i = 0; i < ctx->num_modules && res == CUDA_ERROR_NOT_FOUND; i++) {
+    res = (ctx->cfg->cuModuleGetFunction)(kernel, ctx->modules[i], name);
+  }
+  CUDA_SUCCEED_FATAL(res);
   // Unless the below is set, the kernel is limited to 48KiB of memory.
   CUDA_SUCCEED_FATAL((ctx->cfg->cuFuncSetAttribute)(*kernel,
                                         cudaFuncAttributeMaxDynamicSharedMemorySize,
@@ -1254,6 +2308,10 @@ static void gpu_free_kernel(struct futhark_context *ctx,
 static int gpu_scalar_to_device(struct futhark_context* ctx,
                                 gpu_mem dst, size_t offset, size_t size,
                                 void *src) {
+  int err = cuda_replay_flush(ctx);
+  if (err != FUTHARK_SUCCESS) {
+    return err;
+  }
   struct cuda_event *event = cuda_event_new(ctx);
   if (event != NULL) {
     add_event(ctx,
@@ -1263,16 +2321,45 @@ static int gpu_scalar_to_device(struct futhark_context* ctx,
               (event_report_fn)cuda_event_report);
     CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, ctx->stream));
   }
-  CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpyHtoD)(dst + offset, src, size));
+  if (ctx->use_copy_streams) {
+    ctx->compute_seq++;
+    err = cuda_compute_uses(ctx, dst);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+  }
+  // Copies from pageable memory return once 'src' has been read.
+  CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpyHtoDAsync)(dst + offset, src, size, ctx->stream));
   if (event != NULL) {
-    CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, ctx->stream));
+    CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->end, ctx->stream));
   }
   return FUTHARK_SUCCESS;
 }
 
-static int gpu_scalar_from_device(struct futhark_context* ctx,
-                                  void *dst,
-                                  gpu_mem src, size_t offset, size_t size) {
+// Wait for the stream and deliver all pending scalar reads.
+static int gpu_scalar_sync(struct futhark_context* ctx) {
+  int n = ctx->num_scalar_reads;
+  ctx->num_scalar_reads = 0;
+  CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuStreamSynchronize)(ctx->stream));
+  ctx->num_syncs++;
+  for (int i = 0; i < n; i++) {
+    memcpy(ctx->scalar_reads[i].dst,
+           ctx->scalar_staging + i * CUDA_SCALAR_SLOT_SIZE,
+           ctx->scalar_reads[i].size);
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static int cuda_scalar_from_device_async(struct futhark_context* ctx,
+                                         void *dst,
+                                         gpu_mem src, size_t offset, size_t size) {
+  int err = cuda_replay_flush(ctx);
+  if (err == FUTHARK_SUCCESS && ctx->num_scalar_reads == CUDA_SCALAR_SLOTS) {
+    err = gpu_scalar_sync(ctx);
+  }
+  if (err != FUTHARK_SUCCESS) {
+    return err;
+  }
   struct cuda_event *event = cuda_event_new(ctx);
   if (event != NULL) {
     add_event(ctx,
@@ -1282,13 +2369,53 @@ static int gpu_scalar_from_device(struct futhark_context* ctx,
               (event_report_fn)cuda_event_report);
     CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, ctx->stream));
   }
-  CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpyDtoH)(dst, src + offset, size));
+  if (ctx->use_copy_streams) {
+    ctx->compute_seq++;
+    err = cuda_compute_uses(ctx, src);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+  }
+  if (size <= CUDA_SCALAR_SLOT_SIZE && cuda_scalar_staging_setup(ctx)) {
+    int i = ctx->num_scalar_reads++;
+    ctx->scalar_reads[i].dst = dst;
+    ctx->scalar_reads[i].size = size;
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpyDtoHAsync)(ctx->scalar_staging + i * CUDA_SCALAR_SLOT_SIZE,
+                                                         src + offset, size, ctx->stream));
+  } else {
+    // Copies to pageable memory return once 'dst' has been written.
+    CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpyDtoHAsync)(dst, src + offset, size, ctx->stream));
+  }
   if (event != NULL) {
     CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->end, ctx->stream));
   }
   return FUTHARK_SUCCESS;
 }
 
+// Enqueue a scalar read.  'dst' is not written until the next
+// gpu_scalar_sync().
+static int gpu_scalar_from_device_async(struct futhark_context* ctx,
+                                        void *dst,
+                                        gpu_mem src, size_t offset, size_t size) {
+  int err = cuda_scalar_from_device_async(ctx, dst, src, offset, size);
+  if (err != FUTHARK_SUCCESS) {
+    // The caller will not wait for the pending reads, and their
+    // destinations may not outlive it.
+    ctx->num_scalar_reads = 0;
+  }
+  return err;
+}
+
+static int gpu_scalar_from_device(struct futhark_context* ctx,
+                                  void *dst,
+                                  gpu_mem src, size_t offset, size_t size) {
+  int err = gpu_scalar_from_device_async(ctx, dst, src, offset, size);
+  if (err == FUTHARK_SUCCESS) {
+    err = gpu_scalar_sync(ctx);
+  }
+  return err;
+}
+
 static int gpu_memcpy(struct futhark_context* ctx,
                       gpu_mem dst, int64_t dst_offset,
                       gpu_mem src, int64_t src_offset,
@@ -1302,7 +2429,33 @@ static int gpu_memcpy(struct futhark_context* ctx,
               (event_report_fn)cuda_event_report);
     CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, ctx->stream));
   }
-  CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpy)(dst+dst_offset, src+src_offset, nbytes));
+  if (ctx->use_copy_streams) {
+    ctx->compute_seq++;
+    int err = cuda_compute_uses(ctx, dst);
+    if (err == FUTHARK_SUCCESS) {
+      err = cuda_compute_uses(ctx, src);
+    }
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+  }
+  if (cuda_replay_enabled(ctx)) {
+    struct cuda_replay_cmd *cmd = cuda_replay_cmd_new(ctx, 0, NULL, NULL);
+    cmd->dst = dst + dst_offset;
+    cmd->src = src + src_offset;
+    cmd->nbytes = nbytes;
+    int deferred;
+    int err = cuda_replay_add(ctx, cmd, &deferred);
+    if (err != FUTHARK_SUCCESS || deferred) {
+      return err;
+    }
+  } else {
+    int err = cuda_replay_flush(ctx);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+  }
+  CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuMemcpyAsync)(dst+dst_offset, src+src_offset, nbytes, ctx->stream));
   if (event != NULL) {
     CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->end, ctx->stream));
   }
@@ -1314,6 +2467,15 @@ static int memcpy_host2gpu(struct futhark_context* ctx, bool sync,
                            const unsigned char* src, int64_t src_offset,
                            int64_t nbytes) {
   if (nbytes > 0) {
+    struct cuda_mem_sync *b;
+    CUstream stream;
+    int err = cuda_replay_flush(ctx);
+    if (err == FUTHARK_SUCCESS) {
+      err = cuda_copy_begin(ctx, CUDA_COPY_HOST_TO_DEVICE, dst, &b, &stream);
+    }
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
     struct cuda_event *event = cuda_event_new(ctx);
     if (event != NULL) {
       add_event(ctx,
@@ -1321,19 +2483,35 @@ static int memcpy_host2gpu(struct futhark_context* ctx, bool sync,
                 strdup(""),
                 event,
                 (event_report_fn)cuda_event_report);
-      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, ctx->stream));
+      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, stream));
     }
     if (sync) {
+      ctx->num_syncs++;
+    }
+    if (cuda_staging_setup(ctx)) {
+      err = cuda_memcpy_host2gpu_staged(ctx, stream, dst + dst_offset, src + src_offset, nbytes);
+      if (err != FUTHARK_SUCCESS) {
+        return err;
+      }
+      if (sync) {
+        CUDA_SUCCEED_OR_RETURN
+          ((ctx->cfg->cuStreamSynchronize)(stream));
+      }
+    } else if (sync) {
       CUDA_SUCCEED_OR_RETURN
-        ((ctx->cfg->cuStreamSynchronize)(ctx->stream));
+        ((ctx->cfg->cuStreamSynchronize)(stream));
       CUDA_SUCCEED_OR_RETURN
         ((ctx->cfg->cuMemcpyHtoD)(dst + dst_offset, src + src_offset, nbytes));
     } else {
       CUDA_SUCCEED_OR_RETURN
-        ((ctx->cfg->cuMemcpyHtoDAsync)(dst + dst_offset, src + src_offset, nbytes, ctx->stream));
+        ((ctx->cfg->cuMemcpyHtoDAsync)(dst + dst_offset, src + src_offset, nbytes, stream));
     }
     if (event != NULL) {
-      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->end, ctx->stream));
+      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->end, stream));
+    }
+    err = cuda_copy_end(ctx, CUDA_COPY_HOST_TO_DEVICE, b);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
     }
   }
   return FUTHARK_SUCCESS;
@@ -1344,6 +2522,15 @@ static int memcpy_gpu2host(struct futhark_context* ctx, bool sync,
                            gpu_mem src, int64_t src_offset,
                            int64_t nbytes) {
   if (nbytes > 0) {
+    struct cuda_mem_sync *b;
+    CUstream stream;
+    int err = cuda_replay_flush(ctx);
+    if (err == FUTHARK_SUCCESS) {
+      err = cuda_copy_begin(ctx, CUDA_COPY_DEVICE_TO_HOST, src, &b, &stream);
+    }
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
     struct cuda_event *event = cuda_event_new(ctx);
     if (event != NULL) {
       add_event(ctx,
@@ -1351,19 +2538,34 @@ static int memcpy_gpu2host(struct futhark_context* ctx, bool sync,
                 strdup(""),
                 event,
                 (event_report_fn)cuda_event_report);
-      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, ctx->stream));
+      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->start, stream));
     }
     if (sync) {
+      ctx->num_syncs++;
+    }
+    if (cuda_staging_setup(ctx)) {
+      err = cuda_memcpy_gpu2host_staged(ctx, stream, dst + dst_offset, src + src_offset, nbytes);
+      if (err == FUTHARK_SUCCESS && sync) {
+        err = cuda_staging_flush(ctx);
+      }
+      if (err != FUTHARK_SUCCESS) {
+        return err;
+      }
+    } else if (sync) {
       CUDA_SUCCEED_OR_RETURN
-        ((ctx->cfg->cuStreamSynchronize)(ctx->stream));
+        ((ctx->cfg->cuStreamSynchronize)(stream));
       CUDA_SUCCEED_OR_RETURN
         ((ctx->cfg->cuMemcpyDtoH)(dst + dst_offset, src + src_offset, nbytes));
     } else {
       CUDA_SUCCEED_OR_RETURN
-        ((ctx->cfg->cuMemcpyDtoHAsync)(dst + dst_offset, src + src_offset, nbytes, ctx->stream));
+        ((ctx->cfg->cuMemcpyDtoHAsync)(dst + dst_offset, src + src_offset, nbytes, stream));
     }
     if (event != NULL) {
-      CUDA_SUCCEED_FATAL(cuEventRecord(event->end, ctx->stream));
+      CUDA_SUCCEED_FATAL((ctx->cfg->cuEventRecord)(event->end, stream));
+    }
+    err = cuda_copy_end(ctx, CUDA_COPY_DEVICE_TO_HOST, b);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
     }
     if (sync &&
         ctx->failure_is_an_option &&
@@ -1382,7 +2584,6 @@ static int gpu_launch_kernel(struct futhark_context* ctx,
                              int num_args,
                              void* args[num_args],
                              size_t args_sizes[num_args]) {
-  (void) args_sizes;
   int64_t time_start = 0, time_end = 0;
 
   if (ctx->debugging) {
@@ -1393,7 +2594,42 @@ static int gpu_launch_kernel(struct futhark_context* ctx,
             name,
             grid[0], grid[1], grid[2],
             block[0], block[1], block[2],
-            local_mem_bytes);
+            shared_mem_bytes);
+  }
+
+  if (ctx->use_copy_streams) {
+    // We do not know which arguments are memory blocks, but any
+    // argument of the right size that is not a known block is simply
+    // not found.
+    ctx->compute_seq++;
+    for (int i = 0; i < num_args; i++) {
+      if (args_sizes[i] == sizeof(CUdeviceptr)) {
+        int err = cuda_compute_uses(ctx, *(CUdeviceptr*)args[i]);
+        if (err != FUTHARK_SUCCESS) {
+          return err;
+        }
+      }
+    }
+  }
+
+  if (cuda_replay_enabled(ctx)) {
+    struct cuda_replay_cmd *cmd = cuda_replay_cmd_new(ctx, num_args, args, args_sizes);
+    cmd->kernel = kernel;
+    for (int i = 0; i < 3; i++) {
+      cmd->dims[i] = grid[i];
+      cmd->dims[3+i] = block[i];
+    }
+    cmd->dims[6] = shared_mem_bytes;
+    int deferred;
+    int err = cuda_replay_add(ctx, cmd, &deferred);
+    if (err != FUTHARK_SUCCESS || deferred) {
+      return err;
+    }
+  } else {
+    int err = cuda_replay_flush(ctx);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
   }
 
   struct cuda_event *event = cuda_event_new(ctx);
@@ -1446,11 +2682,28 @@ static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, const char
     return FUTHARK_OUT_OF_MEMORY;
   }
   CUDA_SUCCEED_OR_RETURN(res);
+  if (ctx->use_copy_streams) {
+    cuda_mem_sync_insert(ctx, *mem_out);
+  }
   return FUTHARK_SUCCESS;
 }
 
 static int gpu_free_actual(struct futhark_context *ctx, gpu_mem mem, size_t size, const char *tag) {
   if (ctx->cfg->tracing) printf("TRACE: rts: gpu_free_actual: dptr=0x%016lx size=%lu\n", mem, size);
+  // Deferred commands may use the block.
+  int err = cuda_replay_flush(ctx);
+  if (err != FUTHARK_SUCCESS) {
+    return err;
+  }
+  struct cuda_mem_sync *b = cuda_mem_sync_lookup(ctx, mem);
+  if (b != NULL) {
+    // A transfer on a copy stream may still be using the block.
+    if (b->copy != NULL) {
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventSynchronize)(b->copy));
+      CUDA_SUCCEED_OR_RETURN((ctx->cfg->cuEventDestroy)(b->copy));
+    }
+    cuda_mem_sync_remove(ctx, b);
+  }
   CUresult res = (ctx->cfg->gpu_free)(mem);
   CUDA_SUCCEED_OR_RETURN(res);
   return FUTHARK_SUCCESS;
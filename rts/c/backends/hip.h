@@ -83,6 +83,9 @@ struct futhark_context_config {
   const char** tuning_param_names;
   const char** tuning_param_vars;
   const char** tuning_param_classes;
+  // Flat copies of at least this many bytes use non-temporal stores.
+  // Zero means to pick a threshold based on the cache size.
+  int64_t nt_copy_threshold;
   // Uniform fields above.
 
   char* program;
@@ -101,6 +104,14 @@ struct futhark_context_config {
   int default_block_size_changed;
   int default_grid_size_changed;
   int default_tile_size_changed;
+
+  // Maximum number of bytes of device memory kept in the free list.
+  // Zero disables it, so that every free goes straight to hipFree.
+  size_t gpu_free_list_cap;
+
+  // Number of threads used for compiling the program with HIPRTC, or
+  // 0 to use all available cores.
+  int compile_threads;
 };
 
 static void backend_context_config_setup(struct futhark_context_config *cfg) {
@@ -120,6 +131,10 @@ static void backend_context_config_setup(struct futhark_context_config *cfg) {
   cfg->default_block_size_changed = 0;
   cfg->default_grid_size_changed = 0;
   cfg->default_tile_size_changed = 0;
+
+  cfg->gpu_free_list_cap = 0;
+
+  cfg->compile_threads = 0;
 }
 
 static void backend_context_config_teardown(struct futhark_context_config* cfg) {
@@ -166,6 +181,10 @@ void futhark_context_config_set_program(struct futhark_context_config *cfg, cons
   cfg->program = strdup(s);
 }
 
+void futhark_context_config_set_compile_threads(struct futhark_context_config *cfg, int num) {
+  cfg->compile_threads = num;
+}
+
 void futhark_context_config_set_default_thread_block_size(struct futhark_context_config *cfg, int size) {
   cfg->default_block_size = size;
   cfg->default_block_size_changed = 1;
@@ -229,9 +248,25 @@ int futhark_context_config_set_tuning_param(struct futhark_context_config *cfg,
     cfg->default_reg_tile_size = new_value;
     return 0;
   }
+  if (strcmp(param_name, "nt_copy_threshold") == 0) {
+    cfg->nt_copy_threshold = new_value;
+    return 0;
+  }
   return 1;
 }
 
+// Scalar reads issued with gpu_scalar_from_device_async() are copied
+// into consecutive slots of a small pinned buffer, and from there to
+// their destinations once gpu_scalar_sync() has waited for the
+// stream.  This lets several reads share a single synchronisation.
+#define HIP_SCALAR_SLOTS 64
+#define HIP_SCALAR_SLOT_SIZE 16
+
+struct hip_scalar_read {
+  void *dst;
+  size_t size;
+};
+
 struct futhark_context {
   struct futhark_context_config* cfg;
   int detail_memory;
@@ -248,6 +283,8 @@ struct futhark_context {
   struct event_list event_list;
   int64_t peak_mem_usage_default;
   int64_t cur_mem_usage_default;
+  // Number of times the host has waited for the device.
+  int64_t num_syncs;
   // Uniform fields above.
 
   void* global_failure;
@@ -263,10 +300,22 @@ struct futhark_context {
 
   hipDevice_t dev;
   int dev_id;
-  hipModule_t module;
+  // The program may be compiled as several modules; see
+  // gpu_compile.h.
+  hipModule_t *modules;
+  int num_modules;
   hipStream_t stream;
 
-  //struct free_list gpu_free_list;
+  struct free_list gpu_free_list;
+  size_t gpu_free_list_size;
+
+  // Pending scalar reads.  'scalar_staging_state' is 0 before the
+  // staging buffer is allocated, 1 once it is available, and -1 if
+  // it cannot be allocated.
+  unsigned char *scalar_staging;
+  int scalar_staging_state;
+  struct hip_scalar_read scalar_reads[HIP_SCALAR_SLOTS];
+  int num_scalar_reads;
 
   size_t max_thread_block_size;
   size_t max_grid_size;
@@ -330,13 +379,17 @@ static int hip_device_setup(struct futhark_context *ctx) {
   return 0;
 }
 
-static void hip_load_code_from_cache(struct futhark_context_config *cfg,
-                                     const char *src,
-                                     const char *opts[], size_t n_opts,
-                                     struct cache_hash *h, const char *cache_fname,
-                                     char **code, size_t *code_size) {
+// Returns the number of modules restored from the cache, or 0.  On
+// success, *codes point into the restored buffer, which must be
+// released with cache_release().
+static int hip_load_code_from_cache(struct futhark_context_config *cfg,
+                                    const char *src,
+                                    const char *opts[], size_t n_opts,
+                                    struct cache_hash *h, const char *cache_fname,
+                                    unsigned char **buf, size_t *bufsize,
+                                    const unsigned char ***codes, size_t **sizes) {
   if (cfg->logging) {
-    fprintf(stderr, "Restoring cache from from %s...\n", cache_fname);
+    fprintf(stderr, "Restoring cache from %s...\n", cache_fname);
   }
   cache_hash_init(h);
   for (size_t i = 0; i < n_opts; i++) {
@@ -344,11 +397,18 @@ static void hip_load_code_from_cache(struct futhark_context_config *cfg,
   }
   cache_hash(h, src, strlen(src));
   errno = 0;
-  if (cache_restore(cache_fname, h, (unsigned char**)code, code_size) != 0) {
+  if (cache_restore(cache_fname, h, buf, bufsize) != 0) {
     if (cfg->logging) {
       fprintf(stderr, "Failed to restore cache (errno: %s)\n", strerror(errno));
     }
+    return 0;
   }
+  int n = gpu_unpack_modules(*buf, *bufsize, codes, sizes);
+  if (n <= 0) {
+    cache_release(*buf, *bufsize);
+    return 0;
+  }
+  return n;
 }
 
 static void hip_size_setup(struct futhark_context *ctx) {
@@ -523,12 +583,44 @@ static void hiprtc_mk_build_options(struct futhark_context *ctx, const char *ext
   *opts_out = opts;
 }
 
+struct hiprtc_job {
+  const char **opts;
+  size_t n_opts;
+};
+
+// A gpu_compile_fn for HIPRTC.
+static char* hiprtc_compile(void *arg, const char *src,
+                            char **code, size_t *code_size) {
+  struct hiprtc_job *job = (struct hiprtc_job*)arg;
+  return hiprtc_build(src, job->opts, job->n_opts, code, code_size);
+}
+
+// Load the given code objects into ctx->modules.  If any fails to
+// load, unloads the others and returns the error.
+static hipError_t hip_load_modules(struct futhark_context *ctx, int num_modules,
+                                   const unsigned char **codes) {
+  ctx->modules = (hipModule_t*) malloc(num_modules * sizeof(hipModule_t));
+  for (int i = 0; i < num_modules; i++) {
+    hipError_t res = hipModuleLoadData(&ctx->modules[i], codes[i]);
+    if (res != hipSuccess) {
+      while (i-- > 0) {
+        hipModuleUnload(ctx->modules[i]);
+      }
+      free(ctx->modules);
+      ctx->modules = NULL;
+      return res;
+    }
+  }
+  ctx->num_modules = num_modules;
+  return hipSuccess;
+}
+
 static char* hip_module_setup(struct futhark_context *ctx,
                               const char *src,
                               const char *extra_opts[],
                               const char* cache_fname) {
-  char *code = NULL;
-  size_t code_size = 0;
+  struct gpu_module *modules = NULL;
+  int num_modules = 0;
   struct futhark_context_config *cfg = ctx->cfg;
 
   char **opts;
@@ -546,13 +638,18 @@ static char* hip_module_setup(struct futhark_context *ctx,
   struct cache_hash h;
   int loaded_code_from_cache = 0;
   if (cache_fname != NULL) {
-    hip_load_code_from_cache(cfg, src, (const char**)opts, n_opts, &h, cache_fname, &code, &code_size);
-
-    if (code != NULL) {
+    unsigned char *buf;
+    size_t bufsize;
+    const unsigned char **codes;
+    size_t *sizes;
+    int n = hip_load_code_from_cache(cfg, src, (const char**)opts, n_opts, &h, cache_fname,
+                                     &buf, &bufsize, &codes, &sizes);
+
+    if (n > 0) {
       if (cfg->logging) {
-        fprintf(stderr, "Restored compiled code from cache; now loading module...\n");
+        fprintf(stderr, "Restored compiled code for %d module(s) from cache; now loading...\n", n);
       }
-      if (hipModuleLoadData(&ctx->module, code) == hipSuccess) {
+      if (hip_load_modules(ctx, n, codes) == hipSuccess) {
         if (cfg->logging) {
           fprintf(stderr, "Success!\n");
         }
@@ -561,38 +658,65 @@ static char* hip_module_setup(struct futhark_context *ctx,
         if (cfg->logging) {
           fprintf(stderr, "Failed!\n");
         }
-        free(code);
-        code = NULL;
       }
+      free(codes);
+      free(sizes);
+      cache_release(buf, bufsize);
     }
   }
 
-  if (code == NULL) {
-    char* problem = hiprtc_build(src, (const char**)opts, n_opts, &code, &code_size);
+  if (!loaded_code_from_cache) {
+    int num_threads = cfg->compile_threads > 0
+      ? cfg->compile_threads : gpu_num_compile_threads();
+    num_modules = gpu_split_program(src, num_threads, &modules);
+    if (cfg->logging) {
+      fprintf(stderr, "Compiling %d module(s) with HIPRTC using up to %d thread(s)...\n",
+              num_modules, num_threads);
+    }
+    struct hiprtc_job job;
+    job.opts = (const char**)opts;
+    job.n_opts = n_opts;
+    char *problem = gpu_compile_modules(modules, num_modules, num_threads,
+                                        hiprtc_compile, &job);
     if (problem != NULL) {
+      for (size_t i = 0; i < n_opts; i++) {
+        free((char *)opts[i]);
+      }
+      free(opts);
+      gpu_free_modules(modules, num_modules);
       return problem;
     }
-  }
 
-  if (!loaded_code_from_cache) {
-    HIP_SUCCEED_FATAL(hipModuleLoadData(&ctx->module, code));
+    const unsigned char **codes =
+      (const unsigned char**) malloc(num_modules * sizeof(const unsigned char*));
+    for (int i = 0; i < num_modules; i++) {
+      codes[i] = (const unsigned char*)modules[i].code;
+    }
+    HIP_SUCCEED_FATAL(hip_load_modules(ctx, num_modules, codes));
+    free(codes);
   }
 
   if (cache_fname != NULL && !loaded_code_from_cache) {
     if (cfg->logging) {
       fprintf(stderr, "Caching compiled code in %s...\n", cache_fname);
     }
+    unsigned char *buf;
+    size_t bufsize;
+    gpu_pack_modules(modules, num_modules, &buf, &bufsize);
     errno = 0;
-    if (cache_store(cache_fname, &h, (const unsigned char*)code, code_size) != 0) {
+    if (cache_store(cache_fname, &h, buf, bufsize) != 0) {
       fprintf(stderr, "Failed to cache compiled code: %s\n", strerror(errno));
     }
+    free(buf);
   }
 
   for (size_t i = 0; i < n_opts; i++) {
     free((char *)opts[i]);
   }
   free(opts);
-  free(code);
+  if (modules != NULL) {
+    gpu_free_modules(modules, num_modules);
+  }
 
   return NULL;
 }
@@ -637,6 +761,7 @@ static int hip_event_report(struct str_builder* sb, struct hip_event* e) {
 }
 
 int futhark_context_sync(struct futhark_context* ctx) {
+  ctx->num_syncs++;
   HIP_SUCCEED_OR_RETURN(hipStreamSynchronize(ctx->stream));
   if (ctx->failure_is_an_option) {
     // Check for any delayed error.
@@ -674,15 +799,23 @@ int backend_context_setup(struct futhark_context* ctx) {
   ctx->failure_is_an_option = 0;
   ctx->total_runs = 0;
   ctx->total_runtime = 0;
+  ctx->modules = NULL;
+  ctx->num_modules = 0;
   ctx->peak_mem_usage_device = 0;
   ctx->cur_mem_usage_device = 0;
+  int64_t t_start = get_wall_time();
 
   HIP_SUCCEED_FATAL(hipInit(0));
   if (hip_device_setup(ctx) != 0) {
     futhark_panic(-1, "No suitable HIP device found.\n");
   }
 
-  //free_list_init(&ctx->gpu_free_list);
+  free_list_init(&ctx->gpu_free_list);
+  ctx->gpu_free_list_size = 0;
+
+  ctx->scalar_staging = NULL;
+  ctx->scalar_staging_state = 0;
+  ctx->num_scalar_reads = 0;
 
   ctx->max_shared_memory = device_query(ctx->dev, hipDeviceAttributeMaxSharedMemoryPerBlock);
   ctx->max_thread_block_size = device_query(ctx->dev, hipDeviceAttributeMaxThreadsPerBlock);
@@ -701,6 +834,7 @@ int backend_context_setup(struct futhark_context* ctx) {
   ctx->lockstep_width = 32;
   HIP_SUCCEED_FATAL(hipStreamCreate(&ctx->stream));
   hip_size_setup(ctx);
+  int64_t t_module = get_wall_time();
   ctx->error = hip_module_setup(ctx,
                                 ctx->cfg->program,
                                 (const char**)ctx->cfg->build_opts,
@@ -709,6 +843,10 @@ int backend_context_setup(struct futhark_context* ctx) {
   if (ctx->error != NULL) {
     futhark_panic(1, "During HIP initialisation:\n%s\n", ctx->error);
   }
+  if (ctx->logging) {
+    fprintf(ctx->log, "HIP setup: device %ldus, module %ldus.\n",
+            (long)(t_module - t_start), (long)(get_wall_time() - t_module));
+  }
 
   int32_t no_error = -1;
   HIP_SUCCEED_FATAL(hipMalloc(&ctx->global_failure, sizeof(no_error)));
@@ -723,18 +861,44 @@ int backend_context_setup(struct futhark_context* ctx) {
   return 0;
 }
 
+static int hip_scalar_staging_setup(struct futhark_context *ctx) {
+  if (ctx->scalar_staging_state == 0) {
+    ctx->scalar_staging_state = -1;
+    if (hipHostMalloc((void**)&ctx->scalar_staging,
+                      HIP_SCALAR_SLOTS * HIP_SCALAR_SLOT_SIZE,
+                      hipHostMallocDefault) == hipSuccess) {
+      ctx->scalar_staging_state = 1;
+    }
+  }
+  return ctx->scalar_staging_state > 0;
+}
+
+static void hip_scalar_staging_free(struct futhark_context *ctx) {
+  if (ctx->scalar_staging_state > 0) {
+    (void)hipHostFree(ctx->scalar_staging);
+    ctx->scalar_staging = NULL;
+  }
+  ctx->scalar_staging_state = 0;
+  ctx->num_scalar_reads = 0;
+}
+
 void backend_context_teardown(struct futhark_context* ctx) {
   free_builtin_kernels(ctx, ctx->kernels);
   hipFree(ctx->global_failure);
   hipFree(ctx->global_failure_args);
-  //HIP_SUCCEED_FATAL(gpu_free_all(ctx));
-  //free_list_destroy(&ctx->gpu_free_list);
+  (void)gpu_free_all(ctx);
+  free_list_destroy(&ctx->gpu_free_list);
+  hip_scalar_staging_free(ctx);
   HIP_SUCCEED_FATAL(hipStreamDestroy(ctx->stream));
-  HIP_SUCCEED_FATAL(hipModuleUnload(ctx->module));
+  for (int i = 0; i < ctx->num_modules; i++) {
+    HIP_SUCCEED_FATAL(hipModuleUnload(ctx->modules[i]));
+  }
+  free(ctx->modules);
 }
 
 void backend_context_release(struct futhark_context* ctx) {
-  (void)ctx;
+  (void)gpu_free_all(ctx);
+  hip_scalar_staging_free(ctx);
 }
 
 // GPU ABSTRACTION LAYER
@@ -748,7 +912,12 @@ static void gpu_create_kernel(struct futhark_context *ctx,
   if (ctx->debugging) {
     fprintf(ctx->log, "Creating kernel %s.\n", name);
   }
-  HIP_SUCCEED_FATAL(hipModuleGetFunction(kernel, ctx->module, name));
+  // The kernel is in exactly one of the modules.
+  hipError_t res = hipErrorNotFound;
+  for (int i = 0; i < ctx->num_modules && res == hipErrorNotFound; i++) {
+    res = hipModuleGetFunction(kernel, ctx->modules[i], name);
+  }
+  HIP_SUCCEED_FATAL(res);
 }
 
 static void gpu_free_kernel(struct futhark_context *ctx,
@@ -776,9 +945,29 @@ static int gpu_scalar_to_device(struct futhark_context* ctx,
   return FUTHARK_SUCCESS;
 }
 
-static int gpu_scalar_from_device(struct futhark_context* ctx,
-                                  void *dst,
-                                  gpu_mem src, size_t offset, size_t size) {
+// Wait for the stream and deliver all pending scalar reads.
+static int gpu_scalar_sync(struct futhark_context* ctx) {
+  int n = ctx->num_scalar_reads;
+  ctx->num_scalar_reads = 0;
+  HIP_SUCCEED_OR_RETURN(hipStreamSynchronize(ctx->stream));
+  ctx->num_syncs++;
+  for (int i = 0; i < n; i++) {
+    memcpy(ctx->scalar_reads[i].dst,
+           ctx->scalar_staging + i * HIP_SCALAR_SLOT_SIZE,
+           ctx->scalar_reads[i].size);
+  }
+  return FUTHARK_SUCCESS;
+}
+
+static int hip_scalar_from_device_async(struct futhark_context* ctx,
+                                        void *dst,
+                                        gpu_mem src, size_t offset, size_t size) {
+  if (ctx->num_scalar_reads == HIP_SCALAR_SLOTS) {
+    int err = gpu_scalar_sync(ctx);
+    if (err != FUTHARK_SUCCESS) {
+      return err;
+    }
+  }
   struct hip_event *event = hip_event_new(ctx);
   if (event != NULL) {
     add_event(ctx,
@@ -788,13 +977,45 @@ static int gpu_scalar_from_device(struct futhark_context* ctx,
               (event_report_fn)hip_event_report);
     HIP_SUCCEED_FATAL(hipEventRecord(event->start, ctx->stream));
   }
-  HIP_SUCCEED_OR_RETURN(hipMemcpyDtoH(dst, (unsigned char*)src + offset, size));
+  if (size <= HIP_SCALAR_SLOT_SIZE && hip_scalar_staging_setup(ctx)) {
+    int i = ctx->num_scalar_reads++;
+    ctx->scalar_reads[i].dst = dst;
+    ctx->scalar_reads[i].size = size;
+    HIP_SUCCEED_OR_RETURN(hipMemcpyDtoHAsync(ctx->scalar_staging + i * HIP_SCALAR_SLOT_SIZE,
+                                             (unsigned char*)src + offset, size, ctx->stream));
+  } else {
+    HIP_SUCCEED_OR_RETURN(hipMemcpyDtoH(dst, (unsigned char*)src + offset, size));
+  }
   if (event != NULL) {
     HIP_SUCCEED_FATAL(hipEventRecord(event->end, ctx->stream));
   }
   return FUTHARK_SUCCESS;
 }
 
+// Enqueue a scalar read.  'dst' is not written until the next
+// gpu_scalar_sync().
+static int gpu_scalar_from_device_async(struct futhark_context* ctx,
+                                        void *dst,
+                                        gpu_mem src, size_t offset, size_t size) {
+  int err = hip_scalar_from_device_async(ctx, dst, src, offset, size);
+  if (err != FUTHARK_SUCCESS) {
+    // The caller will not wait for the pending reads, and their
+    // destinations may not outlive it.
+    ctx->num_scalar_reads = 0;
+  }
+  return err;
+}
+
+static int gpu_scalar_from_device(struct futhark_context* ctx,
+                                  void *dst,
+                                  gpu_mem src, size_t offset, size_t size) {
+  int err = gpu_scalar_from_device_async(ctx, dst, src, offset, size);
+  if (err == FUTHARK_SUCCESS) {
+    err = gpu_scalar_sync(ctx);
+  }
+  return err;
+}
+
 static int gpu_memcpy(struct futhark_context* ctx,
                       gpu_mem dst, int64_t dst_offset,
                       gpu_mem src, int64_t src_offset,
@@ -831,6 +1052,7 @@ static int memcpy_host2gpu(struct futhark_context* ctx, bool sync,
       HIP_SUCCEED_FATAL(hipEventRecord(event->start, ctx->stream));
     }
     if (sync) {
+      ctx->num_syncs++;
       HIP_SUCCEED_OR_RETURN
         (hipMemcpyHtoD((unsigned char*)dst + dst_offset,
                        (unsigned char*)src + src_offset, nbytes));
@@ -862,6 +1084,7 @@ static int memcpy_gpu2host(struct futhark_context* ctx, bool sync,
       HIP_SUCCEED_FATAL(hipEventRecord(event->start, ctx->stream));
     }
     if (sync) {
+      ctx->num_syncs++;
       HIP_SUCCEED_OR_RETURN
         (hipMemcpyDtoH(dst + dst_offset,
                        (unsigned char*)src + src_offset,
@@ -937,7 +1160,12 @@ static int gpu_launch_kernel(struct futhark_context* ctx,
   return FUTHARK_SUCCESS;
 }
 
-static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, gpu_mem *mem_out) {
+static void gpu_unify_actual(struct futhark_context *ctx, const char *ltag, const char *rtag) {
+  (void)ctx; (void)ltag; (void)rtag;
+}
+
+static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, const char *tag, gpu_mem *mem_out) {
+  (void)tag;
   hipError_t res = hipMalloc(mem_out, size);
   if (res == hipErrorOutOfMemory) {
     return FUTHARK_OUT_OF_MEMORY;
@@ -946,8 +1174,8 @@ static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, gpu_mem *m
   return FUTHARK_SUCCESS;
 }
 
-static int gpu_free_actual(struct futhark_context *ctx, gpu_mem mem) {
-  (void)ctx;
+static int gpu_free_actual(struct futhark_context *ctx, gpu_mem mem, size_t size, const char *tag) {
+  (void)ctx; (void)size; (void)tag;
   HIP_SUCCEED_OR_RETURN(hipFree(mem));
   return FUTHARK_SUCCESS;
 }
@@ -17,14 +17,20 @@ struct futhark_context_config {
   int (*mem_alloc)(void **, size_t, const char *);
   int (*mem_free)(void *);
   void (*mem_unify)(const char *, const char *);
+  // Flat copies of at least this many bytes use non-temporal stores.
+  // Zero means to pick a threshold based on the cache size.
+  int64_t nt_copy_threshold;
 
   // Uniform fields above.
 
   int num_threads;
+  // Copies of at least this many bytes are done in parallel.
+  int64_t copy_threshold;
 };
 
 static void backend_context_config_setup(struct futhark_context_config* cfg) {
   cfg->num_threads = 0;
+  cfg->copy_threshold = 1 << 20;
 }
 
 static void backend_context_config_teardown(struct futhark_context_config* cfg) {
@@ -36,7 +42,14 @@ void futhark_context_config_set_num_threads(struct futhark_context_config *cfg,
 }
 
 int futhark_context_config_set_tuning_param(struct futhark_context_config* cfg, const char *param_name, size_t param_value) {
-  (void)cfg; (void)param_name; (void)param_value;
+  if (strcmp(param_name, "copy_threshold") == 0) {
+    cfg->copy_threshold = param_value;
+    return 0;
+  }
+  if (strcmp(param_name, "nt_copy_threshold") == 0) {
+    cfg->nt_copy_threshold = param_value;
+    return 0;
+  }
   return 1;
 }
 
@@ -56,6 +69,8 @@ struct futhark_context {
   struct event_list event_list;
   int64_t peak_mem_usage_default;
   int64_t cur_mem_usage_default;
+  // Number of times the host has waited for the device.
+  int64_t num_syncs;
   struct program* program;
   // Uniform fields above.
 
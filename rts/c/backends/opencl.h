@@ -134,6 +134,9 @@ struct futhark_context_config {
   int (*mem_alloc)(void **, size_t, const char *);
   int (*mem_free)(void *);
   void (*mem_unify)(const char *, const char *);
+  // Flat copies of at least this many bytes use non-temporal stores.
+  // Zero means to pick a threshold based on the cache size.
+  int64_t nt_copy_threshold;
 
   // Uniform fields above.
 
@@ -157,6 +160,10 @@ struct futhark_context_config {
   int num_build_opts;
   char* *build_opts;
 
+  // Maximum number of bytes of device memory kept in the free list.
+  // Zero disables it, so that every free releases the buffer.
+  size_t gpu_free_list_cap;
+
   cl_command_queue queue;
   int queue_set;
 };
@@ -185,6 +192,8 @@ static void backend_context_config_setup(struct futhark_context_config* cfg) {
   cfg->default_group_size_changed = 0;
   cfg->default_tile_size_changed = 0;
 
+  cfg->gpu_free_list_cap = 0;
+
   cfg->queue_set = 0;
 }
 
@@ -500,6 +509,10 @@ int futhark_context_config_set_tuning_param(struct futhark_context_config *cfg,
     cfg->default_reg_tile_size = new_value;
     return 0;
   }
+  if (strcmp(param_name, "nt_copy_threshold") == 0) {
+    cfg->nt_copy_threshold = new_value;
+    return 0;
+  }
   return 1;
 }
 
@@ -519,6 +532,8 @@ struct futhark_context {
   struct event_list event_list;
   int64_t peak_mem_usage_default;
   int64_t cur_mem_usage_default;
+  // Number of times the host has waited for the device.
+  int64_t num_syncs;
   struct program* program;
 
   // Common fields above.
@@ -538,7 +553,8 @@ struct futhark_context {
   cl_command_queue queue;
   cl_program clprogram;
 
-  //struct free_list gpu_free_list;
+  struct free_list gpu_free_list;
+  size_t gpu_free_list_size;
 
   size_t max_thread_block_size;
   size_t max_num_groups;
@@ -699,6 +715,7 @@ static int opencl_event_report(struct str_builder* sb, cl_event* e) {
 }
 
 int futhark_context_sync(struct futhark_context* ctx) {
+  ctx->num_syncs++;
   // Check for any delayed error.
   cl_int failure_idx = -1;
   if (ctx->failure_is_an_option) {
@@ -737,6 +754,58 @@ int futhark_context_sync(struct futhark_context* ctx) {
   return 0;
 }
 
+// The cache key for a program binary.  A binary is only valid for
+// the exact device and driver that produced it, so we hash their
+// identifying strings along with the source and build options.
+static void opencl_cache_hash(struct cache_hash *h,
+                              const struct opencl_device_option *device_option,
+                              const char *src, const char *compile_opts) {
+  cache_hash_init(h);
+  char *driver_version = opencl_device_info(device_option->device, CL_DRIVER_VERSION);
+  char *device_version = opencl_device_info(device_option->device, CL_DEVICE_VERSION);
+  const char *key_parts[] = { device_option->platform_name,
+                              device_option->device_name,
+                              driver_version,
+                              device_version,
+                              compile_opts };
+  for (size_t i = 0; i < sizeof(key_parts)/sizeof(key_parts[0]); i++) {
+    // Include the terminator so that adjacent parts cannot run
+    // together.
+    cache_hash(h, key_parts[i], strlen(key_parts[i])+1);
+  }
+  cache_hash(h, src, strlen(src));
+  free(driver_version);
+  free(device_version);
+}
+
+// Create and build a program from a cached binary.  Unlike
+// build_gpu_program(), failure is not fatal and prints no build log,
+// as a stale or rejected binary just means we fall back to building
+// from source.
+static cl_int opencl_load_cached_binary(struct futhark_context *ctx,
+                                        cl_device_id device,
+                                        const char *compile_opts,
+                                        const unsigned char *buf, size_t bufsize,
+                                        cl_program *prog_out) {
+  cl_int status = CL_SUCCESS, error = CL_SUCCESS;
+  cl_program prog = clCreateProgramWithBinary(ctx->ctx, 1, &device,
+                                              &bufsize, &buf,
+                                              &status, &error);
+  if (error != CL_SUCCESS) {
+    return error;
+  }
+  if (status != CL_SUCCESS) {
+    clReleaseProgram(prog);
+    return status;
+  }
+  error = clBuildProgram(prog, 1, &device, compile_opts, NULL, NULL);
+  if (error != CL_SUCCESS) {
+    clReleaseProgram(prog);
+    return error;
+  }
+  *prog_out = prog;
+  return CL_SUCCESS;
+}
 
 // We take as input several strings representing the program, because
 // C does not guarantee that the compiler supports particularly large
@@ -748,7 +817,8 @@ static void setup_opencl_with_command_queue(struct futhark_context *ctx,
                                             const char* cache_fname) {
   int error;
 
-  //free_list_init(&ctx->gpu_free_list);
+  free_list_init(&ctx->gpu_free_list);
+  ctx->gpu_free_list_size = 0;
   ctx->queue = queue;
 
   OPENCL_SUCCEED_FATAL(clGetCommandQueueInfo(ctx->queue, CL_QUEUE_CONTEXT, sizeof(cl_context), &ctx->ctx, NULL));
@@ -918,11 +988,9 @@ static void setup_opencl_with_command_queue(struct futhark_context *ctx,
 
     if (cache_fname != NULL) {
       if (ctx->cfg->logging) {
-        fprintf(stderr, "Restoring cache from from %s...\n", cache_fname);
+        fprintf(stderr, "Restoring cache from %s...\n", cache_fname);
       }
-      cache_hash_init(&h);
-      cache_hash(&h, opencl_src, strlen(opencl_src));
-      cache_hash(&h, compile_opts, strlen(compile_opts));
+      opencl_cache_hash(&h, &device_option, opencl_src, compile_opts);
 
       unsigned char *buf;
       size_t bufsize;
@@ -935,20 +1003,12 @@ static void setup_opencl_with_command_queue(struct futhark_context *ctx,
         if (ctx->cfg->logging) {
           fprintf(stderr, "Cache restored; loading OpenCL binary...\n");
         }
-
-        cl_int status = 0;
-        prog = clCreateProgramWithBinary(ctx->ctx, 1, &device_option.device,
-                                         &bufsize, (const unsigned char**)&buf,
-                                         &status, &error);
-        if (status == CL_SUCCESS) {
-          loaded_from_cache = 1;
-          if (ctx->cfg->logging) {
-            fprintf(stderr, "Loading succeeded.\n");
-          }
-        } else {
-          if (ctx->cfg->logging) {
-            fprintf(stderr, "Loading failed.\n");
-          }
+        loaded_from_cache =
+          opencl_load_cached_binary(ctx, device_option.device, compile_opts,
+                                    buf, bufsize, &prog) == CL_SUCCESS;
+        cache_release(buf, bufsize);
+        if (ctx->cfg->logging) {
+          fprintf(stderr, loaded_from_cache ? "Loading succeeded.\n" : "Loading failed.\n");
         }
       }
     }
@@ -979,12 +1039,15 @@ static void setup_opencl_with_command_queue(struct futhark_context *ctx,
 
     OPENCL_SUCCEED_FATAL(status);
     OPENCL_SUCCEED_FATAL(error);
+    free(fut_opencl_bin);
   }
 
-  if (ctx->cfg->logging) {
-    fprintf(stderr, "Building OpenCL program...\n");
+  if (!loaded_from_cache) {
+    if (ctx->cfg->logging) {
+      fprintf(stderr, "Building OpenCL program...\n");
+    }
+    OPENCL_SUCCEED_FATAL(build_gpu_program(prog, device_option.device, compile_opts));
   }
-  OPENCL_SUCCEED_FATAL(build_gpu_program(prog, device_option.device, compile_opts));
 
   free(compile_opts);
 
@@ -1004,7 +1067,7 @@ static void setup_opencl_with_command_queue(struct futhark_context *ctx,
       fprintf(stderr, "Caching OpenCL binary in %s...\n", cache_fname);
     }
     if (cache_store(cache_fname, &h, binary, binary_size) != 0) {
-      printf("Failed to cache binary: %s\n", strerror(errno));
+      fprintf(stderr, "Failed to cache binary: %s\n", strerror(errno));
     }
   }
 
@@ -1015,6 +1078,10 @@ static void setup_opencl_with_command_queue(struct futhark_context *ctx,
     dump_file(ctx->cfg->dump_binary_to, binary, binary_size);
   }
 
+  free(binary);
+  free(device_option.platform_name);
+  free(device_option.device_name);
+
   ctx->clprogram = prog;
 }
 
@@ -1092,11 +1159,16 @@ int backend_context_setup(struct futhark_context* ctx) {
   ctx->peak_mem_usage_device = 0;
   ctx->cur_mem_usage_device = 0;
 
+  int64_t t_start = get_wall_time();
   if (ctx->cfg->queue_set) {
     setup_opencl_with_command_queue(ctx, ctx->cfg->queue, (const char**)ctx->cfg->build_opts, ctx->cfg->cache_fname);
   } else {
     setup_opencl(ctx, (const char**)ctx->cfg->build_opts, ctx->cfg->cache_fname);
   }
+  if (ctx->logging) {
+    fprintf(ctx->log, "OpenCL setup: device and program %ldus.\n",
+            (long)(get_wall_time() - t_start));
+  }
 
   cl_int error;
   cl_int no_error = -1;
@@ -1124,15 +1196,15 @@ void backend_context_teardown(struct futhark_context* ctx) {
   free_builtin_kernels(ctx, ctx->kernels);
   OPENCL_SUCCEED_FATAL(clReleaseMemObject(ctx->global_failure));
   OPENCL_SUCCEED_FATAL(clReleaseMemObject(ctx->global_failure_args));
-  //(void)gpu_free_all(ctx);
-  //free_list_destroy(&ctx->gpu_free_list);
+  (void)gpu_free_all(ctx);
+  free_list_destroy(&ctx->gpu_free_list);
   (void)clReleaseProgram(ctx->clprogram);
   (void)clReleaseCommandQueue(ctx->queue);
   (void)clReleaseContext(ctx->ctx);
 }
 
 void backend_context_release(struct futhark_context* ctx) {
-  (void)ctx;
+  (void)gpu_free_all(ctx);
 }
 
 cl_command_queue futhark_context_get_command_queue(struct futhark_context* ctx) {
@@ -1160,7 +1232,9 @@ static void gpu_create_kernel(struct futhark_context *ctx,
 static void gpu_free_kernel(struct futhark_context *ctx,
                             gpu_kernel kernel) {
   (void)ctx;
-  clReleaseKernel(kernel);
+  if (kernel != NULL) {
+    clReleaseKernel(kernel);
+  }
 }
 
 static int gpu_scalar_to_device(struct futhark_context* ctx,
@@ -1192,6 +1266,9 @@ static int gpu_scalar_from_device(struct futhark_context* ctx,
               event,
               (event_report_fn)opencl_event_report);
   }
+  if (!ctx->failure_is_an_option) {
+    ctx->num_syncs++;
+  }
   OPENCL_SUCCEED_OR_RETURN
     (clEnqueueReadBuffer
      (ctx->queue, src, ctx->failure_is_an_option ? CL_FALSE : CL_TRUE,
@@ -1199,6 +1276,36 @@ static int gpu_scalar_from_device(struct futhark_context* ctx,
   return 0;
 }
 
+// Enqueue a scalar read.  'dst' is not written until the next
+// gpu_scalar_sync().
+static int gpu_scalar_from_device_async(struct futhark_context* ctx,
+                                        void *dst,
+                                        gpu_mem src, size_t offset, size_t size) {
+  cl_event* event = opencl_event_new(ctx);
+  if (event != NULL) {
+    add_event(ctx,
+              "copy_scalar_from_dev",
+              strdup(""),
+              event,
+              (event_report_fn)opencl_event_report);
+  }
+  cl_int err = clEnqueueReadBuffer
+    (ctx->queue, src, CL_FALSE, offset, size, dst, 0, NULL, event);
+  if (err != CL_SUCCESS) {
+    // The caller will not wait for the pending reads, and their
+    // destinations may not outlive it.
+    (void)clFinish(ctx->queue);
+  }
+  OPENCL_SUCCEED_OR_RETURN(err);
+  return 0;
+}
+
+static int gpu_scalar_sync(struct futhark_context* ctx) {
+  ctx->num_syncs++;
+  OPENCL_SUCCEED_OR_RETURN(clFinish(ctx->queue));
+  return 0;
+}
+
 static int gpu_memcpy(struct futhark_context* ctx,
                       gpu_mem dst, int64_t dst_offset,
                       gpu_mem src, int64_t src_offset,
@@ -1238,6 +1345,9 @@ static int memcpy_host2gpu(struct futhark_context* ctx, bool sync,
                 event,
                 (event_report_fn)opencl_event_report);
     }
+    if (sync) {
+      ctx->num_syncs++;
+    }
     OPENCL_SUCCEED_OR_RETURN
       (clEnqueueWriteBuffer(ctx->queue,
                             dst,
@@ -1265,6 +1375,9 @@ static int memcpy_gpu2host(struct futhark_context* ctx, bool sync,
                 event,
                 (event_report_fn)opencl_event_report);
     }
+    if (sync && !ctx->failure_is_an_option) {
+      ctx->num_syncs++;
+    }
     OPENCL_SUCCEED_OR_RETURN
       (clEnqueueReadBuffer(ctx->queue, src,
                            ctx->failure_is_an_option ? CL_FALSE
@@ -1351,13 +1464,18 @@ static int gpu_launch_kernel(struct futhark_context* ctx,
   return FUTHARK_SUCCESS;
 }
 
+static void gpu_unify_actual(struct futhark_context *ctx, const char *ltag, const char *rtag) {
+  (void)ctx; (void)ltag; (void)rtag;
+}
+
 // Allocate memory from driver. The problem is that OpenCL may perform
 // lazy allocation, so we cannot know whether an allocation succeeded
 // until the first time we try to use it.  Hence we immediately
 // perform a write to see if the allocation succeeded.  This is slow,
 // but the assumption is that this operation will be rare (most things
 // will go through the free list).
-static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, gpu_mem *mem_out) {
+static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, const char *tag, gpu_mem *mem_out) {
+  (void)tag;
   int error;
   *mem_out = clCreateBuffer(ctx->ctx, CL_MEM_READ_WRITE, size, NULL, &error);
 
@@ -1381,8 +1499,8 @@ static int gpu_alloc_actual(struct futhark_context *ctx, size_t size, gpu_mem *m
   return FUTHARK_SUCCESS;
 }
 
-static int gpu_free_actual(struct futhark_context *ctx, gpu_mem mem) {
-  (void)ctx;
+static int gpu_free_actual(struct futhark_context *ctx, gpu_mem mem, size_t size, const char *tag) {
+  (void)ctx; (void)size; (void)tag;
   OPENCL_SUCCEED_OR_RETURN(clReleaseMemObject(mem));
   return FUTHARK_SUCCESS;
 }
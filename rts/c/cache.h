@@ -1,9 +1,26 @@
 // Start of cache.h
 
-#define CACHE_HASH_SIZE 8 // In 32-bit words.
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The hash is BLAKE2s with a 256-bit digest.  The cache is shared
+// between processes and keyed on large inputs (the full program
+// source), so we want collisions to be out of the question, but we
+// also do not want hashing to be noticeable during initialisation.
+#define CACHE_DIGEST_SIZE 32 // In bytes.
+#define CACHE_BLOCK_SIZE 64  // In bytes.
 
 struct cache_hash {
-  uint32_t hash[CACHE_HASH_SIZE];
+  uint32_t h[8];
+  uint64_t t;     // Bytes compressed so far.
+  unsigned char block[CACHE_BLOCK_SIZE];
+  size_t blocklen;
 };
 
 // Initialise a blank cache.
@@ -13,9 +30,10 @@ static void cache_hash_init(struct cache_hash *c);
 static void cache_hash(struct cache_hash *out, const char *in, size_t n);
 
 // Try to restore cache contents from a file with the given name.
-// Assumes the cache is invalid if it contains the given hash.
-// Allocates memory and reads the cache conents, which is returned in
-// *buf with size *buflen.  If the cache is successfully loaded, this
+// Assumes the cache is invalid if it does not contain the given hash.
+// Maps the file into memory, and returns a pointer to its contents in
+// *buf with size *buflen.  The contents must be released with
+// cache_release().  If the cache is successfully loaded, this
 // function returns 0.  Otherwise it returns nonzero.  Errno is set if
 // the failure to load the cache is due to anything except invalid
 // cache conents.  Note that failing to restore the cache is not
@@ -23,98 +41,259 @@ static void cache_hash(struct cache_hash *out, const char *in, size_t n);
 static int cache_restore(const char *fname, const struct cache_hash *hash,
                          unsigned char **buf, size_t *buflen);
 
-// Store cache contents in the given file, with the given hash.
+// Release cache contents returned by cache_restore().
+static void cache_release(unsigned char *buf, size_t buflen);
+
+// Store cache contents in the given file, with the given hash.  The
+// file is written under a temporary name and then renamed into
+// place, so concurrent readers see either the old or the new
+// contents, never a partial file.
 static int cache_store(const char *fname, const struct cache_hash *hash,
                        const unsigned char *buf, size_t buflen);
 
 // Now for the implementation.
 
+static const uint32_t cache_blake2s_iv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t cache_blake2s_sigma[10][16] = {
+  { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+  {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+  {11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+  { 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+  { 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+  { 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+  {12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+  {13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+  { 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+  {10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0}
+};
+
+static inline uint32_t cache_rotr32(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+#define CACHE_BLAKE2S_G(a, b, c, d, x, y) {     \
+    v[a] = v[a] + v[b] + (x);                   \
+    v[d] = cache_rotr32(v[d] ^ v[a], 16);       \
+    v[c] = v[c] + v[d];                         \
+    v[b] = cache_rotr32(v[b] ^ v[c], 12);       \
+    v[a] = v[a] + v[b] + (y);                   \
+    v[d] = cache_rotr32(v[d] ^ v[a], 8);        \
+    v[c] = v[c] + v[d];                         \
+    v[b] = cache_rotr32(v[b] ^ v[c], 7);        \
+  }
+
+static void cache_blake2s_compress(struct cache_hash *c, int last) {
+  uint32_t m[16], v[16];
+  for (int i = 0; i < 16; i++) {
+    const unsigned char *p = &c->block[i*4];
+    m[i] = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+      ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+  for (int i = 0; i < 8; i++) {
+    v[i] = c->h[i];
+    v[i+8] = cache_blake2s_iv[i];
+  }
+  v[12] ^= (uint32_t)c->t;
+  v[13] ^= (uint32_t)(c->t >> 32);
+  if (last) {
+    v[14] = ~v[14];
+  }
+  for (int r = 0; r < 10; r++) {
+    const uint8_t *s = cache_blake2s_sigma[r];
+    CACHE_BLAKE2S_G(0, 4,  8, 12, m[s[0]],  m[s[1]]);
+    CACHE_BLAKE2S_G(1, 5,  9, 13, m[s[2]],  m[s[3]]);
+    CACHE_BLAKE2S_G(2, 6, 10, 14, m[s[4]],  m[s[5]]);
+    CACHE_BLAKE2S_G(3, 7, 11, 15, m[s[6]],  m[s[7]]);
+    CACHE_BLAKE2S_G(0, 5, 10, 15, m[s[8]],  m[s[9]]);
+    CACHE_BLAKE2S_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+    CACHE_BLAKE2S_G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+    CACHE_BLAKE2S_G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+  }
+  for (int i = 0; i < 8; i++) {
+    c->h[i] ^= v[i] ^ v[i+8];
+  }
+}
+
+#undef CACHE_BLAKE2S_G
+
 static void cache_hash_init(struct cache_hash *c) {
-  memset(c->hash, 0, CACHE_HASH_SIZE * sizeof(uint32_t));
+  memcpy(c->h, cache_blake2s_iv, sizeof(c->h));
+  // Parameter block: digest length, no key, fanout and depth of 1.
+  c->h[0] ^= 0x01010000 ^ CACHE_DIGEST_SIZE;
+  c->t = 0;
+  c->blocklen = 0;
 }
 
 static void cache_hash(struct cache_hash *out, const char *in, size_t n) {
-  // Adaptation of djb2 for larger output size by storing intermediate
-  // states.
-  uint32_t hash = 5381;
-  for (size_t i = 0; i < n; i++) {
-    hash = ((hash << 5) + hash) + in[i];
-    out->hash[i % CACHE_HASH_SIZE] ^= hash;
+  while (n > 0) {
+    // The final block must be compressed with the finalisation flag,
+    // so a full block is only compressed once more input arrives.
+    if (out->blocklen == CACHE_BLOCK_SIZE) {
+      out->t += CACHE_BLOCK_SIZE;
+      cache_blake2s_compress(out, 0);
+      out->blocklen = 0;
+    }
+    size_t k = CACHE_BLOCK_SIZE - out->blocklen;
+    if (k > n) {
+      k = n;
+    }
+    memcpy(&out->block[out->blocklen], in, k);
+    out->blocklen += k;
+    in += k;
+    n -= k;
+  }
+}
+
+// Finalise a copy of the hash state, such that further input can
+// still be added to the original.
+static void cache_hash_digest(const struct cache_hash *c,
+                              unsigned char digest[CACHE_DIGEST_SIZE]) {
+  struct cache_hash f = *c;
+  f.t += f.blocklen;
+  memset(&f.block[f.blocklen], 0, CACHE_BLOCK_SIZE - f.blocklen);
+  cache_blake2s_compress(&f, 1);
+  for (int i = 0; i < 8; i++) {
+    digest[i*4+0] = (unsigned char)(f.h[i]);
+    digest[i*4+1] = (unsigned char)(f.h[i] >> 8);
+    digest[i*4+2] = (unsigned char)(f.h[i] >> 16);
+    digest[i*4+3] = (unsigned char)(f.h[i] >> 24);
   }
 }
 
+// The last byte is a format version, such that caches written by
+// older versions of this code are rejected.
 #define CACHE_HEADER_SIZE 8
-static const char cache_header[CACHE_HEADER_SIZE] = "FUTHARK\0";
+static const char cache_header[CACHE_HEADER_SIZE] = {'F','U','T','H','A','R','K','\2'};
 
-static int cache_restore(const char *fname, const struct cache_hash *hash,
-                         unsigned char **buf, size_t *buflen) {
-  FILE *f = fopen(fname, "rb");
+// Header, total file size, digest.
+#define CACHE_CONTENTS_OFFSET (CACHE_HEADER_SIZE + sizeof(int64_t) + CACHE_DIGEST_SIZE)
 
-  if (f == NULL) {
+// Check the header, size, and digest of a complete cache file.
+static int cache_check(const unsigned char *f, size_t f_size,
+                       const struct cache_hash *hash) {
+  if (f_size < CACHE_CONTENTS_OFFSET) {
     return 1;
   }
 
-  char f_header[CACHE_HEADER_SIZE];
-
-  if (fread(f_header, sizeof(char), CACHE_HEADER_SIZE, f) != CACHE_HEADER_SIZE) {
-    goto error;
+  if (memcmp(f, cache_header, CACHE_HEADER_SIZE) != 0) {
+    return 1;
   }
 
-  if (memcmp(f_header, cache_header, CACHE_HEADER_SIZE) != 0) {
-    goto error;
+  int64_t expected_size;
+  memcpy(&expected_size, f + CACHE_HEADER_SIZE, sizeof(int64_t));
+  if ((int64_t)f_size != expected_size) {
+    return 1;
   }
 
-  if (fseek(f, 0, SEEK_END) != 0) {
-    goto error;
-  }
-  int64_t f_size = (int64_t)ftell(f);
-  if (fseek(f, CACHE_HEADER_SIZE, SEEK_SET) != 0) {
-    goto error;
+  unsigned char digest[CACHE_DIGEST_SIZE];
+  cache_hash_digest(hash, digest);
+  if (memcmp(f + CACHE_HEADER_SIZE + sizeof(int64_t), digest, CACHE_DIGEST_SIZE) != 0) {
+    return 1;
   }
 
-  int64_t expected_size;
+  return 0;
+}
 
-  if (fread(&expected_size, sizeof(int64_t), 1, f) != 1) {
-    goto error;
+#ifndef _WIN32
+
+static int cache_restore(const char *fname, const struct cache_hash *hash,
+                         unsigned char **buf, size_t *buflen) {
+  int fd = open(fname, O_RDONLY);
+
+  if (fd < 0) {
+    return 1;
   }
 
-  if (f_size != expected_size) {
-    errno = 0;
-    goto error;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return 1;
   }
 
-  int32_t f_hash[CACHE_HASH_SIZE];
+  size_t f_size = st.st_size;
+  if (f_size < CACHE_CONTENTS_OFFSET) {
+    close(fd);
+    errno = 0;
+    return 1;
+  }
 
-  if (fread(f_hash, sizeof(int32_t), CACHE_HASH_SIZE, f) != CACHE_HASH_SIZE) {
-    goto error;
+  // The file is never modified in place (see cache_store()), so the
+  // mapping stays valid even if another process replaces it.
+  void *m = mmap(NULL, f_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    return 1;
   }
+  unsigned char *f = (unsigned char*)m;
 
-  if (memcmp(f_hash, hash->hash, CACHE_HASH_SIZE) != 0) {
+  if (cache_check(f, f_size, hash) != 0) {
+    munmap(f, f_size);
     errno = 0;
-    goto error;
+    return 1;
   }
 
-  *buflen = f_size - CACHE_HEADER_SIZE - sizeof(int64_t) - CACHE_HASH_SIZE*sizeof(int32_t);
-  *buf = malloc(*buflen);
-  if (fread(*buf, sizeof(char), *buflen, f) != *buflen) {
-    free(*buf);
-    goto error;
+  *buf = f + CACHE_CONTENTS_OFFSET;
+  *buflen = f_size - CACHE_CONTENTS_OFFSET;
+  return 0;
+}
+
+static void cache_release(unsigned char *buf, size_t buflen) {
+  munmap(buf - CACHE_CONTENTS_OFFSET, buflen + CACHE_CONTENTS_OFFSET);
+}
+
+#else
+
+static int cache_restore(const char *fname, const struct cache_hash *hash,
+                         unsigned char **buf, size_t *buflen) {
+  size_t f_size;
+  unsigned char *f = (unsigned char*)slurp_file(fname, &f_size);
+
+  if (f == NULL) {
+    return 1;
   }
 
-  fclose(f);
+  if (cache_check(f, f_size, hash) != 0) {
+    free(f);
+    errno = 0;
+    return 1;
+  }
 
+  *buf = f + CACHE_CONTENTS_OFFSET;
+  *buflen = f_size - CACHE_CONTENTS_OFFSET;
   return 0;
+}
 
- error:
-  fclose(f);
-  return 1;
+static void cache_release(unsigned char *buf, size_t buflen) {
+  (void)buflen;
+  free(buf - CACHE_CONTENTS_OFFSET);
 }
 
+#endif
+
 static int cache_store(const char *fname, const struct cache_hash *hash,
                        const unsigned char *buf, size_t buflen) {
-  FILE *f = fopen(fname, "wb");
+  // Unique per process and per call, as multiple contexts in one
+  // process may store to the same file, even from different threads.
+  static int counter = 0;
+  int n = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+#ifdef _WIN32
+  long pid = (long)GetCurrentProcessId();
+#else
+  long pid = (long)getpid();
+#endif
+  char *tmp_fname = msgprintf("%s.%ld.%d.tmp", fname, pid, n);
+  int64_t size = CACHE_CONTENTS_OFFSET + buflen;
+  unsigned char digest[CACHE_DIGEST_SIZE];
+  cache_hash_digest(hash, digest);
+
+  FILE *f = fopen(tmp_fname, "wb");
 
   if (f == NULL) {
+    free(tmp_fname);
     return 1;
   }
 
@@ -122,13 +301,11 @@ static int cache_store(const char *fname, const struct cache_hash *hash,
     goto error;
   }
 
-  int64_t size = CACHE_HEADER_SIZE + sizeof(int64_t) + CACHE_HASH_SIZE*sizeof(int32_t) + buflen;
-
   if (fwrite(&size, sizeof(size), 1, f) != 1) {
     goto error;
   }
 
-  if (fwrite(hash->hash, sizeof(int32_t), CACHE_HASH_SIZE, f) != CACHE_HASH_SIZE) {
+  if (fwrite(digest, CACHE_DIGEST_SIZE, 1, f) != 1) {
     goto error;
   }
 
@@ -136,12 +313,33 @@ static int cache_store(const char *fname, const struct cache_hash *hash,
     goto error;
   }
 
-  fclose(f);
+  if (fclose(f) != 0) {
+    f = NULL;
+    goto error;
+  }
+  f = NULL;
+
+#ifdef _WIN32
+  if (!MoveFileExA(tmp_fname, fname, MOVEFILE_REPLACE_EXISTING)) {
+    goto error;
+  }
+#else
+  if (rename(tmp_fname, fname) != 0) {
+    goto error;
+  }
+#endif
 
+  free(tmp_fname);
   return 0;
 
  error:
-  fclose(f);
+  if (f != NULL) {
+    fclose(f);
+  }
+  int saved_errno = errno;
+  remove(tmp_fname);
+  errno = saved_errno;
+  free(tmp_fname);
   return 1;
 }
 
@@ -114,6 +114,7 @@ struct futhark_context_config* futhark_context_config_new(void) {
   cfg->tuning_param_names = tuning_param_names;
   cfg->tuning_param_vars = tuning_param_vars;
   cfg->tuning_param_classes = tuning_param_classes;
+  cfg->nt_copy_threshold = 0;
   backend_context_config_setup(cfg);
   return cfg;
 }
@@ -157,6 +158,7 @@ struct futhark_context* futhark_context_new(struct futhark_context_config* cfg)
   event_list_init(&ctx->event_list);
   ctx->peak_mem_usage_default = 0;
   ctx->cur_mem_usage_default = 0;
+  ctx->num_syncs = 0;
   ctx->constants = malloc(sizeof(struct constants));
   ctx->debugging = cfg->debugging;
   ctx->logging = cfg->logging;
@@ -168,11 +170,23 @@ struct futhark_context* futhark_context_new(struct futhark_context_config* cfg)
   if (cfg->tracing) printf("TRACE: rts: futhark_context_new: set tuning params...\n");
   set_tuning_params(ctx);
   if (cfg->tracing) printf("TRACE: rts: futhark_context_new: setup backend...\n");
+  int64_t t_backend = get_wall_time();
   if (backend_context_setup(ctx) == 0) {
+    int64_t t_program = get_wall_time();
     if (cfg->tracing) printf("TRACE: rts: futhark_context_new: setup program...\n");
     setup_program(ctx);
+    int64_t t_constants = get_wall_time();
     if (cfg->tracing) printf("TRACE: rts: futhark_context_new: init constants...\n");
     init_constants(ctx);
+    if (ctx->logging) {
+      int64_t t_end = get_wall_time();
+      fprintf(ctx->log,
+              "Context setup took %ldus: backend %ldus, program %ldus, constants %ldus.\n",
+              (long)(t_end - t_backend),
+              (long)(t_program - t_backend),
+              (long)(t_constants - t_program),
+              (long)(t_end - t_constants));
+    }
     if (cfg->tracing) printf("TRACE: rts: futhark_context_new: clear caches...\n");
     (void)futhark_context_clear_caches(ctx);
     //if (cfg->tracing) printf("TRACE: rts: futhark_context_new: sync...\n");
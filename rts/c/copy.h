@@ -1,5 +1,207 @@
 // Start of copy.h
 
+// There is no primitive type of 16 bytes, but arrays of 16-byte
+// elements can still be copied; see lmad_as_16b().
+typedef struct { uint64_t x, y; } elem_16b_t;
+
+// Transposition of the small blocks at which the cache-oblivious
+// recursion in map_transpose bottoms out.  On x86-64, square tiles of
+// the block are transposed in SIMD registers, and the remaining
+// elements with a plain loop.  SSE2 is always available there, while
+// AVX is used only if the CPU supports it.  Elsewhere, or with
+// compilers that lack the necessary intrinsics and function
+// attributes, only the plain loop is used.
+//
+// A tile function transposes the tile at 'src', whose rows are 'm'
+// elements apart, into 'dst', whose rows are 'n' elements apart.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define COPY_X86_SIMD
+#include <immintrin.h>
+
+static int cpu_has_avx(void) {
+  static int has_avx = -1;
+  if (has_avx < 0) {
+    __builtin_cpu_init();
+    has_avx = __builtin_cpu_supports("avx") != 0;
+  }
+  return has_avx;
+}
+
+// Transposing a square of 2^k registers by k rounds of interleaving
+// leaves column j of the tile in the register whose index is j with
+// its bits reversed.
+static const int map_transpose_bitrev3[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+static const int map_transpose_bitrev4[16] =
+  {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
+
+static void map_transpose_tile_1b_sse2(uint8_t *dst, const uint8_t *src,
+                                       int64_t n, int64_t m) {
+  __m128i a[16], b[16];
+  for (int i = 0; i < 16; i++) {
+    a[i] = _mm_loadu_si128((const __m128i*)(src + i * m));
+  }
+  for (int i = 0; i < 8; i++) {
+    b[i] = _mm_unpacklo_epi8(a[2*i], a[2*i+1]);
+    b[i+8] = _mm_unpackhi_epi8(a[2*i], a[2*i+1]);
+  }
+  for (int i = 0; i < 8; i++) {
+    a[i] = _mm_unpacklo_epi16(b[2*i], b[2*i+1]);
+    a[i+8] = _mm_unpackhi_epi16(b[2*i], b[2*i+1]);
+  }
+  for (int i = 0; i < 8; i++) {
+    b[i] = _mm_unpacklo_epi32(a[2*i], a[2*i+1]);
+    b[i+8] = _mm_unpackhi_epi32(a[2*i], a[2*i+1]);
+  }
+  for (int i = 0; i < 8; i++) {
+    a[i] = _mm_unpacklo_epi64(b[2*i], b[2*i+1]);
+    a[i+8] = _mm_unpackhi_epi64(b[2*i], b[2*i+1]);
+  }
+  for (int j = 0; j < 16; j++) {
+    _mm_storeu_si128((__m128i*)(dst + j * n), a[map_transpose_bitrev4[j]]);
+  }
+}
+
+static void map_transpose_tile_2b_sse2(uint16_t *dst, const uint16_t *src,
+                                       int64_t n, int64_t m) {
+  __m128i a[8], b[8];
+  for (int i = 0; i < 8; i++) {
+    a[i] = _mm_loadu_si128((const __m128i*)(src + i * m));
+  }
+  for (int i = 0; i < 4; i++) {
+    b[i] = _mm_unpacklo_epi16(a[2*i], a[2*i+1]);
+    b[i+4] = _mm_unpackhi_epi16(a[2*i], a[2*i+1]);
+  }
+  for (int i = 0; i < 4; i++) {
+    a[i] = _mm_unpacklo_epi32(b[2*i], b[2*i+1]);
+    a[i+4] = _mm_unpackhi_epi32(b[2*i], b[2*i+1]);
+  }
+  for (int i = 0; i < 4; i++) {
+    b[i] = _mm_unpacklo_epi64(a[2*i], a[2*i+1]);
+    b[i+4] = _mm_unpackhi_epi64(a[2*i], a[2*i+1]);
+  }
+  for (int j = 0; j < 8; j++) {
+    _mm_storeu_si128((__m128i*)(dst + j * n), b[map_transpose_bitrev3[j]]);
+  }
+}
+
+// The floating-point shuffles below move bits without inspecting
+// them, so they are also fine for integers.
+static void map_transpose_tile_4b_sse2(uint32_t *dst, const uint32_t *src,
+                                       int64_t n, int64_t m) {
+  __m128 r0 = _mm_loadu_ps((const float*)(src + 0 * m));
+  __m128 r1 = _mm_loadu_ps((const float*)(src + 1 * m));
+  __m128 r2 = _mm_loadu_ps((const float*)(src + 2 * m));
+  __m128 r3 = _mm_loadu_ps((const float*)(src + 3 * m));
+  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+  _mm_storeu_ps((float*)(dst + 0 * n), r0);
+  _mm_storeu_ps((float*)(dst + 1 * n), r1);
+  _mm_storeu_ps((float*)(dst + 2 * n), r2);
+  _mm_storeu_ps((float*)(dst + 3 * n), r3);
+}
+
+__attribute__((target("avx")))
+static void map_transpose_tile_4b_avx(uint32_t *dst, const uint32_t *src,
+                                      int64_t n, int64_t m) {
+  __m256 r[8], t[8];
+  for (int i = 0; i < 8; i++) {
+    r[i] = _mm256_loadu_ps((const float*)(src + i * m));
+  }
+  for (int i = 0; i < 4; i++) {
+    t[2*i] = _mm256_unpacklo_ps(r[2*i], r[2*i+1]);
+    t[2*i+1] = _mm256_unpackhi_ps(r[2*i], r[2*i+1]);
+  }
+  for (int i = 0; i < 2; i++) {
+    r[4*i+0] = _mm256_shuffle_ps(t[4*i+0], t[4*i+2], _MM_SHUFFLE(1,0,1,0));
+    r[4*i+1] = _mm256_shuffle_ps(t[4*i+0], t[4*i+2], _MM_SHUFFLE(3,2,3,2));
+    r[4*i+2] = _mm256_shuffle_ps(t[4*i+1], t[4*i+3], _MM_SHUFFLE(1,0,1,0));
+    r[4*i+3] = _mm256_shuffle_ps(t[4*i+1], t[4*i+3], _MM_SHUFFLE(3,2,3,2));
+  }
+  for (int j = 0; j < 4; j++) {
+    _mm256_storeu_ps((float*)(dst + j * n), _mm256_permute2f128_ps(r[j], r[j+4], 0x20));
+    _mm256_storeu_ps((float*)(dst + (j+4) * n), _mm256_permute2f128_ps(r[j], r[j+4], 0x31));
+  }
+}
+#endif
+
+// Pick the tile function for the given element type, and return the
+// tile size, or 0 if there is none.
+static int map_transpose_tile_1b(void (**f)(uint8_t*, const uint8_t*, int64_t, int64_t)) {
+#ifdef COPY_X86_SIMD
+  *f = map_transpose_tile_1b_sse2;
+  return 16;
+#else
+  (void)f;
+  return 0;
+#endif
+}
+
+static int map_transpose_tile_2b(void (**f)(uint16_t*, const uint16_t*, int64_t, int64_t)) {
+#ifdef COPY_X86_SIMD
+  *f = map_transpose_tile_2b_sse2;
+  return 8;
+#else
+  (void)f;
+  return 0;
+#endif
+}
+
+static int map_transpose_tile_4b(void (**f)(uint32_t*, const uint32_t*, int64_t, int64_t)) {
+#ifdef COPY_X86_SIMD
+  if (cpu_has_avx()) {
+    *f = map_transpose_tile_4b_avx;
+    return 8;
+  }
+  *f = map_transpose_tile_4b_sse2;
+  return 4;
+#else
+  (void)f;
+  return 0;
+#endif
+}
+
+// Eight-byte elements are moved whole by the plain loop, and in
+// measurements the shuffles were not faster.
+static int map_transpose_tile_8b(void (**f)(uint64_t*, const uint64_t*, int64_t, int64_t)) {
+  (void)f;
+  return 0;
+}
+
+static int map_transpose_tile_16b(void (**f)(elem_16b_t*, const elem_16b_t*, int64_t, int64_t)) {
+  (void)f;
+  return 0;
+}
+
+// Transpose the r*c block at 'src' into 'dst', with row sizes as for
+// the tile functions.
+#define GEN_MAP_TRANSPOSE_BLOCK(NAME, ELEM_TYPE)                        \
+  static void map_transpose_block_##NAME                                \
+  (ELEM_TYPE* dst, const ELEM_TYPE* src,                                \
+   int64_t n, int64_t m, int64_t r, int64_t c) {                        \
+    void (*tile)(ELEM_TYPE*, const ELEM_TYPE*, int64_t, int64_t) = NULL; \
+    int64_t t = map_transpose_tile_##NAME(&tile);                       \
+    int64_t rt = 0, ct = 0;                                             \
+    if (t > 0) {                                                        \
+      rt = r - r % t;                                                   \
+      ct = c - c % t;                                                   \
+      for (int64_t j = 0; j < ct; j += t) {                             \
+        for (int64_t i = 0; i < rt; i += t) {                           \
+          tile(dst + j * n + i, src + i * m + j, n, m);                 \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+    for (int64_t j = ct; j < c; j++) {                                  \
+      for (int64_t i = 0; i < rt; i++) {                                \
+        dst[j * n + i] = src[i * m + j];                                \
+      }                                                                 \
+    }                                                                   \
+    for (int64_t j = 0; j < c; j++) {                                   \
+      for (int64_t i = rt; i < r; i++) {                                \
+        dst[j * n + i] = src[i * m + j];                                \
+      }                                                                 \
+    }                                                                   \
+  }
+
 // Cache-oblivious map-transpose function.
 #define GEN_MAP_TRANSPOSE(NAME, ELEM_TYPE)                              \
   static void map_transpose_##NAME                                      \
@@ -11,11 +213,8 @@
   int32_t c = ce - cb;                                                  \
   if (k == 1) {                                                         \
     if (r <= 64 && c <= 64) {                                           \
-      for (int64_t j = 0; j < c; j++) {                                 \
-        for (int64_t i = 0; i < r; i++) {                               \
-          dst[(j + cb) * n + (i + rb)] = src[(i + rb) * m + (j + cb)];  \
-        }                                                               \
-      }                                                                 \
+      map_transpose_block_##NAME(dst + cb * n + rb, src + rb * m + cb,  \
+                                 n, m, r, c);                           \
     } else if (c <= r) {                                                \
       map_transpose_##NAME(dst, src, k, m, n, cb, ce, rb, rb + r/2);    \
       map_transpose_##NAME(dst, src, k, m, n, cb, ce, rb + r/2, re);    \
@@ -30,18 +229,60 @@
 } \
 }
 
-// Straightforward LMAD copy function.
+// Copy a single row of 'n' elements.  Contiguous rows are copied
+// with memcpy(), and small constant strides get their own loops, such
+// that the compiler can unroll and vectorise them.
+#define GEN_LMAD_COPY_ROW(NAME, ELEM_TYPE)                              \
+  static void lmad_copy_row_##NAME(ELEM_TYPE* dst, int64_t ds,          \
+                                   const ELEM_TYPE* src, int64_t ss,    \
+                                   int64_t n) {                         \
+    if (ds == 1 && ss == 1) {                                           \
+      memcpy(dst, src, n * sizeof(ELEM_TYPE));                          \
+    } else if (ds == 1 && ss == 0) {                                    \
+      ELEM_TYPE x = *src;                                               \
+      for (int64_t i = 0; i < n; i++) { dst[i] = x; }                   \
+    } else if (ds == 1 && ss == 2) {                                    \
+      for (int64_t i = 0; i < n; i++) { dst[i] = src[i*2]; }            \
+    } else if (ds == 1 && ss == 3) {                                    \
+      for (int64_t i = 0; i < n; i++) { dst[i] = src[i*3]; }            \
+    } else if (ds == 1 && ss == 4) {                                    \
+      for (int64_t i = 0; i < n; i++) { dst[i] = src[i*4]; }            \
+    } else if (ds == 2 && ss == 1) {                                    \
+      for (int64_t i = 0; i < n; i++) { dst[i*2] = src[i]; }            \
+    } else if (ds == 3 && ss == 1) {                                    \
+      for (int64_t i = 0; i < n; i++) { dst[i*3] = src[i]; }            \
+    } else if (ds == 4 && ss == 1) {                                    \
+      for (int64_t i = 0; i < n; i++) { dst[i*4] = src[i]; }            \
+    } else {                                                            \
+      int64_t i = 0;                                                    \
+      for (; i + 4 <= n; i += 4) {                                      \
+        ELEM_TYPE x0 = src[(i+0)*ss];                                   \
+        ELEM_TYPE x1 = src[(i+1)*ss];                                   \
+        ELEM_TYPE x2 = src[(i+2)*ss];                                   \
+        ELEM_TYPE x3 = src[(i+3)*ss];                                   \
+        dst[(i+0)*ds] = x0;                                             \
+        dst[(i+1)*ds] = x1;                                             \
+        dst[(i+2)*ds] = x2;                                             \
+        dst[(i+3)*ds] = x3;                                             \
+      }                                                                 \
+      for (; i < n; i++) {                                              \
+        dst[i*ds] = src[i*ss];                                          \
+      }                                                                 \
+    }                                                                   \
+  }
+
+// Straightforward LMAD copy function.  Works best when the LMADs have
+// first been simplified with lmad_collapse().
 #define GEN_LMAD_COPY_ELEMENTS(NAME, ELEM_TYPE)                         \
   static void lmad_copy_elements_##NAME(int r,                          \
                                         ELEM_TYPE* dst, int64_t dst_strides[r], \
                                         ELEM_TYPE *src, int64_t src_strides[r], \
                                         int64_t shape[r]) {             \
     if (r == 1) {                                                       \
-      for (int i = 0; i < shape[0]; i++) {                              \
-        dst[i*dst_strides[0]] = src[i*src_strides[0]];                  \
-      }                                                                 \
+      lmad_copy_row_##NAME(dst, dst_strides[0], src, src_strides[0],    \
+                           shape[0]);                                   \
     } else if (r > 1) {                                                 \
-      for (int i = 0; i < shape[0]; i++) {                              \
+      for (int64_t i = 0; i < shape[0]; i++) {                          \
         lmad_copy_elements_##NAME(r-1,                                  \
                                   dst+i*dst_strides[0], dst_strides+1,  \
                                   src+i*src_strides[0], src_strides+1,  \
@@ -50,6 +291,40 @@
     }                                                                   \
   }                                                                     \
 
+// Simplify a copy in place by removing dimensions of size 1 and
+// merging every dimension into the one outside it when both LMADs
+// traverse the pair as a single dimension, i.e. when the outer stride
+// is the inner stride times the inner size.  Returns the new rank,
+// which is at least 1.  A slice of a row-major array thus turns into
+// a copy of rows, and a copy of contiguous arrays into a single row.
+static int lmad_collapse(int r,
+                         int64_t dst_strides[r], int64_t src_strides[r],
+                         int64_t shape[r]) {
+  int out = 0;
+  for (int i = 0; i < r; i++) {
+    if (shape[i] == 1) {
+      continue;
+    }
+    if (out > 0
+        && dst_strides[out-1] == dst_strides[i] * shape[i]
+        && src_strides[out-1] == src_strides[i] * shape[i]) {
+      shape[out-1] *= shape[i];
+      dst_strides[out-1] = dst_strides[i];
+      src_strides[out-1] = src_strides[i];
+    } else {
+      dst_strides[out] = dst_strides[i];
+      src_strides[out] = src_strides[i];
+      shape[out] = shape[i];
+      out++;
+    }
+  }
+  if (out == 0) {
+    shape[0] = 1;
+    out = 1;
+  }
+  return out;
+}
+
 // Check whether this LMAD can be seen as a transposed 2D array.  This
 // is done by checking every possible splitting point.
 static bool lmad_is_tr(int64_t *n_out, int64_t *m_out,
@@ -182,6 +457,44 @@ static bool lmad_memcpyable(int r,
   return true;
 }
 
+// Can this copy be seen as a copy of 16-byte elements of rank one
+// less?  This is the case when the innermost dimension spans exactly
+// 16 bytes and is contiguous in both LMADs, as for complex numbers
+// stored as [...][2]f64, and all other strides and the offsets are
+// multiples of its size.  A transposition of such arrays can then use
+// the transposition routines rather than the general copy.  Writes the
+// offsets (destination first) and the LMADs of the wider view to the
+// output parameters.
+static bool lmad_as_16b(size_t elem_size, int r,
+                        int64_t dst_offset, const int64_t *dst_strides,
+                        int64_t src_offset, const int64_t *src_strides,
+                        const int64_t *shape,
+                        int64_t offsets_out[2],
+                        int64_t *dst_strides_out, int64_t *src_strides_out,
+                        int64_t *shape_out) {
+  if (r < 2 || elem_size >= 16 || shape[r-1] * (int64_t)elem_size != 16
+      || dst_strides[r-1] != 1 || src_strides[r-1] != 1) {
+    return false;
+  }
+  int64_t w = shape[r-1];
+  if (dst_offset % w != 0 || src_offset % w != 0) {
+    return false;
+  }
+  for (int i = 0; i < r-1; i++) {
+    if (dst_strides[i] % w != 0 || src_strides[i] % w != 0) {
+      return false;
+    }
+  }
+  offsets_out[0] = dst_offset / w;
+  offsets_out[1] = src_offset / w;
+  for (int i = 0; i < r-1; i++) {
+    dst_strides_out[i] = dst_strides[i] / w;
+    src_strides_out[i] = src_strides[i] / w;
+    shape_out[i] = shape[i];
+  }
+  return true;
+}
+
 
 static void log_copy(struct futhark_context* ctx,
                      const char *kind, int r,
@@ -215,6 +528,234 @@ static void log_transpose(struct futhark_context* ctx,
   }
 }
 
+// Very large flat copies are done with non-temporal stores, which
+// bypass the cache.  Otherwise, a copy much larger than the last-level
+// cache evicts everything else from it, to no benefit as the start of
+// the destination has itself been evicted by the time the copy is
+// done.  The nt_copy_threshold tuning parameter (in bytes) decides
+// what is "very large"; if it is 0, which is the default, the
+// threshold is four times the size of the last-level cache.
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static int64_t llc_size(void) {
+  static int64_t size = -1;
+  if (size < 0) {
+    long n = -1;
+#if defined(_SC_LEVEL3_CACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+    n = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (n <= 0) {
+      n = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+    // A guess for when we cannot ask.
+    size = n > 0 ? n : 32 << 20;
+  }
+  return size;
+}
+
+static bool copy_nontemporal(struct futhark_context *ctx, int64_t bytes) {
+  int64_t threshold = ctx->cfg->nt_copy_threshold;
+  if (threshold == 0) {
+    threshold = 4 * llc_size();
+  }
+  return bytes >= threshold;
+}
+
+#ifdef COPY_X86_SIMD
+// Both of these first copy enough bytes with memcpy() to align 'dst',
+// as streaming stores must be aligned.
+static void memcpy_nt_sse2(unsigned char *dst, const unsigned char *src, size_t n) {
+  size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+  head = head < n ? head : n;
+  memcpy(dst, src, head);
+  dst += head; src += head; n -= head;
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + 0));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(src + 48));
+    _mm_stream_si128((__m128i*)(dst + 0), x0);
+    _mm_stream_si128((__m128i*)(dst + 16), x1);
+    _mm_stream_si128((__m128i*)(dst + 32), x2);
+    _mm_stream_si128((__m128i*)(dst + 48), x3);
+  }
+  _mm_sfence();
+  memcpy(dst, src, n);
+}
+
+__attribute__((target("avx")))
+static void memcpy_nt_avx(unsigned char *dst, const unsigned char *src, size_t n) {
+  size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+  head = head < n ? head : n;
+  memcpy(dst, src, head);
+  dst += head; src += head; n -= head;
+  for (; n >= 128; n -= 128, dst += 128, src += 128) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)(src + 0));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i x2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+    __m256i x3 = _mm256_loadu_si256((const __m256i*)(src + 96));
+    _mm256_stream_si256((__m256i*)(dst + 0), x0);
+    _mm256_stream_si256((__m256i*)(dst + 32), x1);
+    _mm256_stream_si256((__m256i*)(dst + 64), x2);
+    _mm256_stream_si256((__m256i*)(dst + 96), x3);
+  }
+  _mm_sfence();
+  memcpy(dst, src, n);
+}
+#endif
+
+static void memcpy_nt(void *dst, const void *src, size_t n) {
+#ifdef COPY_X86_SIMD
+  if (cpu_has_avx()) {
+    memcpy_nt_avx((unsigned char*)dst, (const unsigned char*)src, n);
+  } else {
+    memcpy_nt_sse2((unsigned char*)dst, (const unsigned char*)src, n);
+  }
+#else
+  memcpy(dst, src, n);
+#endif
+}
+
+// Large copies are split into chunks that are handed to the
+// scheduler on the multicore backends, which have threads to spare.
+// Copies made from inside a parallel task, or smaller than the
+// copy_threshold tuning parameter (in bytes), run on the calling
+// thread, as do all copies on other backends.  A chunk function copies
+// the iterations from 'start' to 'end'; its signature is that of a
+// scheduler parloop function.
+
+typedef int (*copy_chunk_fn)(void* args, int64_t start, int64_t end,
+                             int subtask_id, int tid);
+
+#if defined(FUTHARK_BACKEND_multicore) || defined(FUTHARK_BACKEND_ispc) \
+  || defined(FUTHARK_BACKEND_wasm_multicore)
+static bool copy_in_parallel(struct futhark_context *ctx, int64_t bytes) {
+  return bytes >= ctx->cfg->copy_threshold
+    && ctx->scheduler.num_threads > 1
+    && worker_local != NULL
+    && worker_local->nested == 0;
+}
+
+static int copy_parallel_for(struct futhark_context *ctx, const char *name,
+                             int64_t iterations, copy_chunk_fn f, void *args) {
+  int64_t task_time = 0, task_iter = 0;
+  int nsubtasks = iterations < ctx->scheduler.num_threads
+    ? (int)iterations : ctx->scheduler.num_threads;
+  struct scheduler_parloop task;
+  task.name = name;
+  task.fn = f;
+  task.args = args;
+  task.iterations = iterations;
+  task.info.iter_pr_subtask = iterations / nsubtasks;
+  task.info.remainder = iterations % nsubtasks;
+  task.info.nsubtasks = nsubtasks;
+  task.info.sched = STATIC;
+  task.info.wake_up_threads = 0;
+  task.info.task_time = &task_time;
+  task.info.task_iter = &task_iter;
+  return scheduler_execute_task(&ctx->scheduler, &task);
+}
+#else
+static bool copy_in_parallel(struct futhark_context *ctx, int64_t bytes) {
+  (void)ctx; (void)bytes;
+  return false;
+}
+
+static int copy_parallel_for(struct futhark_context *ctx, const char *name,
+                             int64_t iterations, copy_chunk_fn f, void *args) {
+  (void)ctx; (void)name;
+  return f(args, 0, iterations, 0, 0);
+}
+#endif
+
+// The arguments to the chunk functions.  Not every field is used by
+// every kind of copy.
+struct copy_chunk_args {
+  void *dst;
+  void *src;
+  // Flat copies: the number of bytes.  Transpositions: as for
+  // map_transpose, plus the number of blocks per array and whether
+  // the blocks split the columns rather than the rows.
+  int64_t k, m, n;
+  int64_t num_blocks;
+  bool split_columns;
+  // Flat copies: whether to use non-temporal stores.
+  bool nt;
+  // General copies.
+  int r;
+  const int64_t *dst_strides;
+  const int64_t *src_strides;
+  const int64_t *shape;
+};
+
+// Flat copies are split into chunks of this many bytes.
+#define COPY_CHUNK_BYTES (1 << 16)
+
+// Transpositions are split into blocks of this many rows or columns.
+#define COPY_CHUNK_BLOCK 64
+
+static int memcpy_chunk(void *args, int64_t start, int64_t end,
+                        int subtask_id, int tid) {
+  (void)subtask_id; (void)tid;
+  struct copy_chunk_args *a = (struct copy_chunk_args*) args;
+  int64_t from = start * COPY_CHUNK_BYTES;
+  int64_t to = end * COPY_CHUNK_BYTES;
+  if (to > a->k) {
+    to = a->k;
+  }
+  if (a->nt) {
+    memcpy_nt((unsigned char*)a->dst + from, (unsigned char*)a->src + from, to - from);
+  } else {
+    memcpy((unsigned char*)a->dst + from, (unsigned char*)a->src + from, to - from);
+  }
+  return 0;
+}
+
+#define GEN_COPY_CHUNKS(NAME, ELEM_TYPE)                                \
+  static int map_transpose_chunk_##NAME(void *args,                     \
+                                        int64_t start, int64_t end,     \
+                                        int subtask_id, int tid) {      \
+    (void)subtask_id; (void)tid;                                        \
+    struct copy_chunk_args *a = (struct copy_chunk_args*) args;         \
+    ELEM_TYPE *dst = (ELEM_TYPE*) a->dst;                               \
+    ELEM_TYPE *src = (ELEM_TYPE*) a->src;                               \
+    for (int64_t it = start; it < end; it++) {                          \
+      int64_t i = it / a->num_blocks;                                   \
+      int64_t b = (it % a->num_blocks) * COPY_CHUNK_BLOCK;              \
+      int64_t lim = a->split_columns ? a->m : a->n;                     \
+      int64_t e = b + COPY_CHUNK_BLOCK < lim ? b + COPY_CHUNK_BLOCK : lim; \
+      if (a->split_columns) {                                           \
+        map_transpose_##NAME(dst + i * a->m * a->n, src + i * a->m * a->n, \
+                             1, a->m, a->n, b, e, 0, a->n);             \
+      } else {                                                          \
+        map_transpose_##NAME(dst + i * a->m * a->n, src + i * a->m * a->n, \
+                             1, a->m, a->n, 0, a->m, b, e);             \
+      }                                                                 \
+    }                                                                   \
+    return 0;                                                           \
+  }                                                                     \
+                                                                        \
+  static int lmad_copy_elements_chunk_##NAME(void *args,                \
+                                             int64_t start, int64_t end, \
+                                             int subtask_id, int tid) { \
+    (void)subtask_id; (void)tid;                                        \
+    struct copy_chunk_args *a = (struct copy_chunk_args*) args;         \
+    int64_t dst_strides[a->r], src_strides[a->r], shape[a->r];          \
+    memcpy(dst_strides, a->dst_strides, a->r * sizeof(int64_t));        \
+    memcpy(src_strides, a->src_strides, a->r * sizeof(int64_t));        \
+    memcpy(shape, a->shape, a->r * sizeof(int64_t));                    \
+    shape[0] = end - start;                                             \
+    lmad_copy_elements_##NAME(a->r,                                     \
+                              (ELEM_TYPE*)a->dst + start * dst_strides[0], \
+                              dst_strides,                              \
+                              (ELEM_TYPE*)a->src + start * src_strides[0], \
+                              src_strides, shape);                      \
+    return 0;                                                           \
+  }
+
 #define GEN_LMAD_COPY(NAME, ELEM_TYPE)                                  \
   static void lmad_copy_##NAME                                          \
   (struct futhark_context *ctx, int r,                                  \
@@ -226,33 +767,118 @@ static void log_transpose(struct futhark_context* ctx,
     int64_t size = 1;                                                   \
     for (int i = 0; i < r; i++) { size *= shape[i]; }                   \
     if (size == 0) { return; }                                          \
+    int64_t wide_offsets[2];                                            \
+    int64_t wide_dst_strides[r], wide_src_strides[r], wide_shape[r];    \
+    if (!lmad_memcpyable(r, dst_strides, src_strides, shape)            \
+        && lmad_as_16b(sizeof(ELEM_TYPE), r,                            \
+                       dst_offset, dst_strides, src_offset, src_strides, \
+                       shape, wide_offsets,                             \
+                       wide_dst_strides, wide_src_strides, wide_shape)) { \
+      if (ctx->logging) {fprintf(ctx->log, "## As 16-byte elements\n");} \
+      lmad_copy_16b(ctx, r-1,                                           \
+                    (elem_16b_t*)dst, wide_offsets[0], wide_dst_strides, \
+                    (elem_16b_t*)src, wide_offsets[1], wide_src_strides, \
+                    wide_shape);                                        \
+      return;                                                           \
+    }                                                                   \
+    bool par = copy_in_parallel(ctx, size * sizeof(*dst));              \
+    if (par && ctx->logging) {fprintf(ctx->log, "## Parallel\n");}      \
+    struct copy_chunk_args args;                                        \
+    args.dst = dst + dst_offset;                                        \
+    args.src = src + src_offset;                                        \
     int64_t k, n, m;                                                    \
     if (lmad_map_tr(&k, &n, &m,                                         \
                     r, dst_strides, src_strides, shape)) {              \
       log_transpose(ctx, k, n, m);                                      \
-      map_transpose_##NAME                                              \
-        (dst+dst_offset, src+src_offset, k, n, m, 0, n, 0, m);          \
+      if (par) {                                                        \
+        args.k = k;                                                     \
+        args.m = n;                                                     \
+        args.n = m;                                                     \
+        args.split_columns = n > m;                                     \
+        args.num_blocks = ((n > m ? n : m) + COPY_CHUNK_BLOCK - 1)      \
+          / COPY_CHUNK_BLOCK;                                           \
+        (void)copy_parallel_for(ctx, "copy_transpose",                  \
+                                k * args.num_blocks,                    \
+                                map_transpose_chunk_##NAME, &args);     \
+      } else {                                                          \
+        map_transpose_##NAME                                            \
+          (dst+dst_offset, src+src_offset, k, n, m, 0, n, 0, m);        \
+      }                                                                 \
     } else if (lmad_memcpyable(r, dst_strides, src_strides, shape)) {   \
-      if (ctx->logging) {fprintf(ctx->log, "## Flat copy\n\n");}          \
-      memcpy(dst+dst_offset, src+src_offset, size*sizeof(*dst));        \
+      bool nt = copy_nontemporal(ctx, size * sizeof(*dst));             \
+      if (ctx->logging) {                                               \
+        fprintf(ctx->log, "## Flat copy%s\n\n", nt ? " (non-temporal)" : ""); \
+      }                                                                 \
+      if (par) {                                                        \
+        args.k = size * sizeof(*dst);                                   \
+        args.nt = nt;                                                   \
+        (void)copy_parallel_for(ctx, "copy_flat",                       \
+                                (args.k + COPY_CHUNK_BYTES - 1)         \
+                                / COPY_CHUNK_BYTES,                     \
+                                memcpy_chunk, &args);                   \
+      } else if (nt) {                                                  \
+        memcpy_nt(dst+dst_offset, src+src_offset, size*sizeof(*dst));   \
+      } else {                                                          \
+        memcpy(dst+dst_offset, src+src_offset, size*sizeof(*dst));      \
+      }                                                                 \
     } else {                                                            \
-      if (ctx->logging) {fprintf(ctx->log, "## General copy\n\n");}       \
-      lmad_copy_elements_##NAME                                         \
-        (r,                                                             \
-         dst+dst_offset, dst_strides,                                   \
-         src+src_offset, src_strides, shape);                           \
+      int64_t cdst_strides[r], csrc_strides[r], cshape[r];              \
+      memcpy(cdst_strides, dst_strides, r * sizeof(int64_t));           \
+      memcpy(csrc_strides, src_strides, r * sizeof(int64_t));           \
+      memcpy(cshape, shape, r * sizeof(int64_t));                       \
+      int cr = lmad_collapse(r, cdst_strides, csrc_strides, cshape);    \
+      if (ctx->logging) {                                               \
+        fprintf(ctx->log, "## General copy (rank %d, rows of %ld)\n\n",  \
+                cr, (long int)cshape[cr-1]);                            \
+      }                                                                 \
+      if (par) {                                                        \
+        args.r = cr;                                                    \
+        args.dst_strides = cdst_strides;                                \
+        args.src_strides = csrc_strides;                                \
+        args.shape = cshape;                                            \
+        (void)copy_parallel_for(ctx, "copy_general", cshape[0],         \
+                                lmad_copy_elements_chunk_##NAME, &args); \
+      } else {                                                          \
+        lmad_copy_elements_##NAME                                       \
+          (cr,                                                          \
+           dst+dst_offset, cdst_strides,                                \
+           src+src_offset, csrc_strides, cshape);                       \
+      }                                                                 \
     }                                                                   \
   }
 
+GEN_MAP_TRANSPOSE_BLOCK(1b, uint8_t)
+GEN_MAP_TRANSPOSE_BLOCK(2b, uint16_t)
+GEN_MAP_TRANSPOSE_BLOCK(4b, uint32_t)
+GEN_MAP_TRANSPOSE_BLOCK(8b, uint64_t)
+GEN_MAP_TRANSPOSE_BLOCK(16b, elem_16b_t)
+
 GEN_MAP_TRANSPOSE(1b, uint8_t)
 GEN_MAP_TRANSPOSE(2b, uint16_t)
 GEN_MAP_TRANSPOSE(4b, uint32_t)
 GEN_MAP_TRANSPOSE(8b, uint64_t)
+GEN_MAP_TRANSPOSE(16b, elem_16b_t)
+
+GEN_LMAD_COPY_ROW(1b, uint8_t)
+GEN_LMAD_COPY_ROW(2b, uint16_t)
+GEN_LMAD_COPY_ROW(4b, uint32_t)
+GEN_LMAD_COPY_ROW(8b, uint64_t)
+GEN_LMAD_COPY_ROW(16b, elem_16b_t)
 
 GEN_LMAD_COPY_ELEMENTS(1b, uint8_t)
 GEN_LMAD_COPY_ELEMENTS(2b, uint16_t)
 GEN_LMAD_COPY_ELEMENTS(4b, uint32_t)
 GEN_LMAD_COPY_ELEMENTS(8b, uint64_t)
+GEN_LMAD_COPY_ELEMENTS(16b, elem_16b_t)
+
+GEN_COPY_CHUNKS(1b, uint8_t)
+GEN_COPY_CHUNKS(2b, uint16_t)
+GEN_COPY_CHUNKS(4b, uint32_t)
+GEN_COPY_CHUNKS(8b, uint64_t)
+GEN_COPY_CHUNKS(16b, elem_16b_t)
+
+// The other instantiations may delegate to this one.
+GEN_LMAD_COPY(16b, elem_16b_t)
 
 GEN_LMAD_COPY(1b, uint8_t)
 GEN_LMAD_COPY(2b, uint16_t)
@@ -10,18 +10,21 @@ struct free_list_entry {
   fl_mem mem;
   const char *tag;
   unsigned char valid;
+  uint64_t seq; // Insertion order.
 };
 
 struct free_list {
   struct free_list_entry *entries; // Pointer to entries.
   int capacity;                    // Number of entries.
   int used;                        // Number of valid entries.
+  uint64_t next_seq;               // Sequence number of next insertion.
   //lock_t lock;                     // Thread safety.
 };
 
 static void free_list_init(struct free_list *l) {
   l->capacity = 30; // Picked arbitrarily.
   l->used = 0;
+  l->next_seq = 0;
   l->entries = (struct free_list_entry*) malloc(sizeof(struct free_list_entry) * l->capacity);
   for (int i = 0; i < l->capacity; i++) {
     l->entries[i].valid = 0;
@@ -90,6 +93,7 @@ static void free_list_insert(struct free_list *l, size_t size, fl_mem mem, const
   l->entries[i].size = size;
   l->entries[i].mem = mem;
   l->entries[i].tag = tag;
+  l->entries[i].seq = l->next_seq++;
 
   l->used++;
   //lock_unlock(&l->lock);
@@ -184,4 +188,28 @@ static int free_list_first(struct free_list *l, fl_mem *mem_out) {
   return ret;
 }
 
+// Remove the block that was inserted first among those still in the
+// free list.  Returns 0 if a block was removed, and nonzero if the
+// free list was already empty.
+static int free_list_oldest(struct free_list *l, size_t *size_out,
+                            fl_mem *mem_out, const char **tag_out) {
+  //lock_lock(&l->lock);
+  int oldest = -1;
+  for (int i = 0; i < l->capacity; i++) {
+    if (l->entries[i].valid &&
+        (oldest < 0 || l->entries[i].seq < l->entries[oldest].seq)) {
+      oldest = i;
+    }
+  }
+  if (oldest >= 0) {
+    l->entries[oldest].valid = 0;
+    *size_out = l->entries[oldest].size;
+    *mem_out = l->entries[oldest].mem;
+    *tag_out = l->entries[oldest].tag;
+    l->used--;
+  }
+  //lock_unlock(&l->lock);
+  return oldest < 0;
+}
+
 // End of free_list.h.
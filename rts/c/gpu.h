@@ -22,6 +22,10 @@ int gpu_memcpy(struct futhark_context* ctx,
 int gpu_scalar_from_device(struct futhark_context* ctx,
                            void *dst,
                            gpu_mem src, size_t offset, size_t size);
+int gpu_scalar_from_device_async(struct futhark_context* ctx,
+                                 void *dst,
+                                 gpu_mem src, size_t offset, size_t size);
+int gpu_scalar_sync(struct futhark_context* ctx);
 int gpu_scalar_to_device(struct futhark_context* ctx,
                          gpu_mem dst, size_t offset, size_t size,
                          void *src);
@@ -29,6 +33,23 @@ void gpu_create_kernel(struct futhark_context *ctx,
                        gpu_kernel* kernel,
                        const char* name);
 
+// Kernels are created on first use, as most programs only use a few
+// of the builtin kernels, and creating them all would dominate the
+// startup time of short-lived programs.  Until then, the handle is
+// NULL, which gpu_free_kernel() must accept.
+static gpu_kernel gpu_get_kernel(struct futhark_context *ctx,
+                                 gpu_kernel *kernel, const char *name) {
+  if (*kernel == NULL) {
+    int64_t t_start = get_wall_time();
+    gpu_create_kernel(ctx, kernel, name);
+    if (ctx->logging) {
+      fprintf(ctx->log, "Created kernel %s on first use in %ldus.\n",
+              name, (long)(get_wall_time() - t_start));
+    }
+  }
+  return *kernel;
+}
+
 // Max number of thead blocks we allow along the second or third
 // dimension for transpositions.
 #define MAX_TR_THREAD_BLOCKS 65535
@@ -55,46 +76,24 @@ struct builtin_kernels {
   gpu_kernel map_transpose_8b_low_width;
   gpu_kernel map_transpose_8b_small;
   gpu_kernel map_transpose_8b_large;
+  gpu_kernel map_transpose_16b;
+  gpu_kernel map_transpose_16b_low_height;
+  gpu_kernel map_transpose_16b_low_width;
+  gpu_kernel map_transpose_16b_small;
+  gpu_kernel map_transpose_16b_large;
 
   // And a few ways of copying.
   gpu_kernel lmad_copy_1b;
   gpu_kernel lmad_copy_2b;
   gpu_kernel lmad_copy_4b;
   gpu_kernel lmad_copy_8b;
+  gpu_kernel lmad_copy_16b;
 };
 
 struct builtin_kernels* init_builtin_kernels(struct futhark_context* ctx) {
-  struct builtin_kernels *kernels = malloc(sizeof(struct builtin_kernels));
-  gpu_create_kernel(ctx, &kernels->map_transpose_1b, "map_transpose_1b");
-  gpu_create_kernel(ctx, &kernels->map_transpose_1b_large, "map_transpose_1b_large");
-  gpu_create_kernel(ctx, &kernels->map_transpose_1b_low_height, "map_transpose_1b_low_height");
-  gpu_create_kernel(ctx, &kernels->map_transpose_1b_low_width, "map_transpose_1b_low_width");
-  gpu_create_kernel(ctx, &kernels->map_transpose_1b_small, "map_transpose_1b_small");
-
-  gpu_create_kernel(ctx, &kernels->map_transpose_2b, "map_transpose_2b");
-  gpu_create_kernel(ctx, &kernels->map_transpose_2b_large, "map_transpose_2b_large");
-  gpu_create_kernel(ctx, &kernels->map_transpose_2b_low_height, "map_transpose_2b_low_height");
-  gpu_create_kernel(ctx, &kernels->map_transpose_2b_low_width, "map_transpose_2b_low_width");
-  gpu_create_kernel(ctx, &kernels->map_transpose_2b_small, "map_transpose_2b_small");
-
-  gpu_create_kernel(ctx, &kernels->map_transpose_4b, "map_transpose_4b");
-  gpu_create_kernel(ctx, &kernels->map_transpose_4b_large, "map_transpose_4b_large");
-  gpu_create_kernel(ctx, &kernels->map_transpose_4b_low_height, "map_transpose_4b_low_height");
-  gpu_create_kernel(ctx, &kernels->map_transpose_4b_low_width, "map_transpose_4b_low_width");
-  gpu_create_kernel(ctx, &kernels->map_transpose_4b_small, "map_transpose_4b_small");
-
-  gpu_create_kernel(ctx, &kernels->map_transpose_8b, "map_transpose_8b");
-  gpu_create_kernel(ctx, &kernels->map_transpose_8b_large, "map_transpose_8b_large");
-  gpu_create_kernel(ctx, &kernels->map_transpose_8b_low_height, "map_transpose_8b_low_height");
-  gpu_create_kernel(ctx, &kernels->map_transpose_8b_low_width, "map_transpose_8b_low_width");
-  gpu_create_kernel(ctx, &kernels->map_transpose_8b_small, "map_transpose_8b_small");
-
-  gpu_create_kernel(ctx, &kernels->lmad_copy_1b, "lmad_copy_1b");
-  gpu_create_kernel(ctx, &kernels->lmad_copy_2b, "lmad_copy_2b");
-  gpu_create_kernel(ctx, &kernels->lmad_copy_4b, "lmad_copy_4b");
-  gpu_create_kernel(ctx, &kernels->lmad_copy_8b, "lmad_copy_8b");
-
-  return kernels;
+  (void)ctx;
+  // All handles start out NULL; see gpu_get_kernel().
+  return calloc(1, sizeof(struct builtin_kernels));
 }
 
 void free_builtin_kernels(struct futhark_context* ctx, struct builtin_kernels* kernels) {
@@ -122,10 +121,17 @@ void free_builtin_kernels(struct futhark_context* ctx, struct builtin_kernels* k
   gpu_free_kernel(ctx, kernels->map_transpose_8b_low_width);
   gpu_free_kernel(ctx, kernels->map_transpose_8b_small);
 
+  gpu_free_kernel(ctx, kernels->map_transpose_16b);
+  gpu_free_kernel(ctx, kernels->map_transpose_16b_large);
+  gpu_free_kernel(ctx, kernels->map_transpose_16b_low_height);
+  gpu_free_kernel(ctx, kernels->map_transpose_16b_low_width);
+  gpu_free_kernel(ctx, kernels->map_transpose_16b_small);
+
   gpu_free_kernel(ctx, kernels->lmad_copy_1b);
   gpu_free_kernel(ctx, kernels->lmad_copy_2b);
   gpu_free_kernel(ctx, kernels->lmad_copy_4b);
   gpu_free_kernel(ctx, kernels->lmad_copy_8b);
+  gpu_free_kernel(ctx, kernels->lmad_copy_16b);
 
   free(kernels);
 }
@@ -135,33 +141,111 @@ static void gpu_unify(struct futhark_context *ctx,
   gpu_unify_actual(ctx, ltag, rtag);
 }
 
+void futhark_context_config_set_gpu_free_list_cap(struct futhark_context_config *cfg, size_t bytes) {
+  cfg->gpu_free_list_cap = bytes;
+}
+
+// Release the oldest block of the free list back to the driver.
+// Returns 1 if the free list was empty.
+static int gpu_free_list_evict(struct futhark_context *ctx, int *error) {
+  size_t size;
+  fl_mem mem;
+  const char *tag;
+  if (free_list_oldest(&ctx->gpu_free_list, &size, &mem, &tag) != 0) {
+    return 1;
+  }
+  ctx->gpu_free_list_size -= size;
+  *error = gpu_free_actual(ctx, (gpu_mem)mem, size, tag);
+  return 0;
+}
+
 static int gpu_alloc(struct futhark_context *ctx,
                      size_t min_size, const char *tag,
                      gpu_mem *mem_out, size_t *size_out) {
-  int error = gpu_alloc_actual(ctx, min_size, tag, mem_out);
-  if (error != FUTHARK_SUCCESS) {
-    return error;
+  if (min_size < sizeof(int)) {
+    min_size = sizeof(int);
   }
+
+  // The free list uses the same best-fit and waste policy as for host
+  // memory (see free_list_acceptable()).
+  fl_mem mem;
+  const char *tag_out = NULL;
+  if (free_list_find(&ctx->gpu_free_list, min_size, tag,
+                     size_out, &mem, &tag_out) == 0) {
+    if (ctx->debugging) {
+      fprintf(ctx->log, "No need to allocate: Found a block in the free list.\n");
+    }
+    ctx->gpu_free_list_size -= *size_out;
+    *mem_out = (gpu_mem)mem;
+    if (tag_out != tag) {
+      gpu_unify(ctx, tag, tag_out);
+    }
+    return FUTHARK_SUCCESS;
+  }
+
   *size_out = min_size;
+
+  // If the allocation does not succeed, we may be out of memory
+  // because of blocks held in the free list.  Release them one at a
+  // time until the allocation succeeds or the free list is empty.
+  int error = gpu_alloc_actual(ctx, min_size, tag, mem_out);
+  while (error == FUTHARK_OUT_OF_MEMORY) {
+    if (ctx->debugging) {
+      fprintf(ctx->log, "Out of GPU memory: releasing entry from the free list...\n");
+    }
+    int free_error = FUTHARK_SUCCESS;
+    if (gpu_free_list_evict(ctx, &free_error) != 0) {
+      break;
+    }
+    if (free_error != FUTHARK_SUCCESS) {
+      return free_error;
+    }
+    error = gpu_alloc_actual(ctx, min_size, tag, mem_out);
+  }
+
   return error;
 }
 
 static int gpu_free(struct futhark_context *ctx,
                     gpu_mem mem, size_t size, const char *tag) {
-  int error = gpu_free_actual(ctx, mem, size, tag);
-  return error;
+  size_t cap = ctx->cfg->gpu_free_list_cap;
+  if (size > cap) {
+    return gpu_free_actual(ctx, mem, size, tag);
+  }
+
+  // Make room for the block by evicting older ones.
+  while (ctx->gpu_free_list_size + size > cap) {
+    int error = FUTHARK_SUCCESS;
+    if (gpu_free_list_evict(ctx, &error) != 0) {
+      break;
+    }
+    if (error != FUTHARK_SUCCESS) {
+      return error;
+    }
+  }
+
+  free_list_insert(&ctx->gpu_free_list, size, (fl_mem)mem, tag);
+  ctx->gpu_free_list_size += size;
+  return FUTHARK_SUCCESS;
 }
 
 static int gpu_free_all(struct futhark_context *ctx) {
+  free_list_pack(&ctx->gpu_free_list);
+  int error = FUTHARK_SUCCESS;
+  while (gpu_free_list_evict(ctx, &error) == 0) {
+    if (error != FUTHARK_SUCCESS) {
+      return error;
+    }
+  }
   return FUTHARK_SUCCESS;
 }
 
 static int gpu_map_transpose(struct futhark_context* ctx,
-                             gpu_kernel kernel_default,
-                             gpu_kernel kernel_low_height,
-                             gpu_kernel kernel_low_width,
-                             gpu_kernel kernel_small,
-                             gpu_kernel kernel_large,
+                             gpu_kernel *kernel_default,
+                             gpu_kernel *kernel_low_height,
+                             gpu_kernel *kernel_low_width,
+                             gpu_kernel *kernel_small,
+                             gpu_kernel *kernel_large,
                              const char *name, size_t elem_size,
                              gpu_mem dst, int64_t dst_offset,
                              gpu_mem src, int64_t src_offset,
@@ -174,7 +258,8 @@ static int gpu_map_transpose(struct futhark_context* ctx,
   int32_t n32 = n;
   int32_t m32 = m;
 
-  gpu_kernel kernel = kernel_default;
+  gpu_kernel *kernel = kernel_default;
+  const char *variant = "";
   int32_t grid[3];
   int32_t block[3];
 
@@ -201,6 +286,7 @@ static int gpu_map_transpose(struct futhark_context* ctx,
     if (m <= TR_BLOCK_DIM/2 && n <= TR_BLOCK_DIM/2) {
       if (ctx->logging) { fprintf(ctx->log, "Using small kernel\n"); }
       kernel = kernel_small;
+      variant = "_small";
       grid[0] = ((k * n * m) + (TR_BLOCK_DIM*TR_BLOCK_DIM) - 1) / (TR_BLOCK_DIM*TR_BLOCK_DIM);
       grid[1] = 1;
       grid[2] = 1;
@@ -210,6 +296,7 @@ static int gpu_map_transpose(struct futhark_context* ctx,
     } else if (m <= TR_BLOCK_DIM/2 && TR_BLOCK_DIM < n) {
       if (ctx->logging) { fprintf(ctx->log, "Using low-width kernel\n"); }
       kernel = kernel_low_width;
+      variant = "_low_width";
       int64_t x_elems = m;
       int64_t y_elems = (n + muly - 1) / muly;
       grid[0] = (x_elems + TR_BLOCK_DIM - 1) / TR_BLOCK_DIM;
@@ -221,6 +308,7 @@ static int gpu_map_transpose(struct futhark_context* ctx,
     } else if (n <= TR_BLOCK_DIM/2 && TR_BLOCK_DIM < m) {
       if (ctx->logging) { fprintf(ctx->log, "Using low-height kernel\n"); }
       kernel = kernel_low_height;
+      variant = "_low_height";
       int64_t x_elems = (m + mulx - 1) / mulx;
       int64_t y_elems = n;
       grid[0] = (x_elems + TR_BLOCK_DIM - 1) / TR_BLOCK_DIM;
@@ -247,6 +335,7 @@ static int gpu_map_transpose(struct futhark_context* ctx,
   } else {
     if (ctx->logging) { fprintf(ctx->log, "Using large kernel\n"); }
     kernel = kernel_large;
+    variant = "_large";
     grid[0] = (m+TR_TILE_DIM-1)/TR_TILE_DIM;
     grid[1] = (n+TR_TILE_DIM-1)/TR_TILE_DIM;
     grid[2] = k;
@@ -280,7 +369,11 @@ static int gpu_map_transpose(struct futhark_context* ctx,
     fprintf(ctx->log, "\n");
   }
 
-  return gpu_launch_kernel(ctx, kernel, name, grid, block,
+  char kernel_name[64];
+  snprintf(kernel_name, sizeof(kernel_name), "%s%s", name, variant);
+
+  return gpu_launch_kernel(ctx, gpu_get_kernel(ctx, kernel, kernel_name),
+                           name, grid, block,
                            TR_TILE_DIM*(TR_TILE_DIM+1)*elem_size,
                            sizeof(args)/sizeof(args[0]), args, args_sizes);
 }
@@ -295,11 +388,11 @@ static int gpu_map_transpose(struct futhark_context* ctx,
     return                                                              \
       gpu_map_transpose                                                 \
       (ctx,                                                             \
-       ctx->kernels->map_transpose_##NAME,                              \
-       ctx->kernels->map_transpose_##NAME##_low_height,                 \
-       ctx->kernels->map_transpose_##NAME##_low_width,                  \
-       ctx->kernels->map_transpose_##NAME##_small,                      \
-       ctx->kernels->map_transpose_##NAME##_large,                      \
+       &ctx->kernels->map_transpose_##NAME,                             \
+       &ctx->kernels->map_transpose_##NAME##_low_height,                \
+       &ctx->kernels->map_transpose_##NAME##_low_width,                 \
+       &ctx->kernels->map_transpose_##NAME##_small,                     \
+       &ctx->kernels->map_transpose_##NAME##_large,                     \
        "map_transpose_" #NAME, sizeof(ELEM_TYPE),                       \
        dst, dst_offset, src, src_offset,                                \
        k, n, m);                                                        \
@@ -365,7 +458,10 @@ static int gpu_lmad_copy(struct futhark_context* ctx,
    gpu_mem dst, int64_t dst_offset, int64_t dst_strides[r],             \
    gpu_mem src, int64_t src_offset, int64_t src_strides[r],             \
    int64_t shape[r]) {                                                  \
-    return gpu_lmad_copy(ctx, ctx->kernels->lmad_copy_##NAME, r,        \
+    gpu_kernel kernel =                                                 \
+      gpu_get_kernel(ctx, &ctx->kernels->lmad_copy_##NAME,              \
+                     "lmad_copy_" #NAME);                               \
+    return gpu_lmad_copy(ctx, kernel, r,                                \
                          dst, dst_offset, dst_strides,                  \
                          src, src_offset, src_strides,                  \
                          shape);                                        \
@@ -383,6 +479,20 @@ static int gpu_lmad_copy(struct futhark_context* ctx,
     int64_t size = 1;                                                   \
     for (int i = 0; i < r; i++) { size *= shape[i]; }                   \
     if (size == 0) { return FUTHARK_SUCCESS; }                          \
+    int64_t wide_offsets[2];                                            \
+    int64_t wide_dst_strides[r], wide_src_strides[r], wide_shape[r];    \
+    if (!lmad_memcpyable(r, dst_strides, src_strides, shape)            \
+        && lmad_as_16b(sizeof(ELEM_TYPE), r,                            \
+                       dst_offset, dst_strides, src_offset, src_strides, \
+                       shape, wide_offsets,                             \
+                       wide_dst_strides, wide_src_strides, wide_shape)) { \
+      if (ctx->logging) {fprintf(ctx->log, "## As 16-byte elements\n");} \
+      return lmad_copy_gpu2gpu_16b                                      \
+        (ctx, r-1,                                                      \
+         dst, wide_offsets[0], wide_dst_strides,                        \
+         src, wide_offsets[1], wide_src_strides,                        \
+         wide_shape);                                                   \
+    }                                                                   \
     int64_t k, n, m;                                                    \
     if (lmad_map_tr(&k, &n, &m,                                         \
                        r, dst_strides, src_strides, shape)) {           \
@@ -515,11 +625,16 @@ GEN_MAP_TRANSPOSE_GPU2GPU(1b, uint8_t)
 GEN_MAP_TRANSPOSE_GPU2GPU(2b, uint16_t)
 GEN_MAP_TRANSPOSE_GPU2GPU(4b, uint32_t)
 GEN_MAP_TRANSPOSE_GPU2GPU(8b, uint64_t)
+GEN_MAP_TRANSPOSE_GPU2GPU(16b, elem_16b_t)
 
 GEN_LMAD_COPY_ELEMENTS_GPU2GPU(1b, uint8_t)
 GEN_LMAD_COPY_ELEMENTS_GPU2GPU(2b, uint16_t)
 GEN_LMAD_COPY_ELEMENTS_GPU2GPU(4b, uint32_t)
 GEN_LMAD_COPY_ELEMENTS_GPU2GPU(8b, uint64_t)
+GEN_LMAD_COPY_ELEMENTS_GPU2GPU(16b, elem_16b_t)
+
+// The other instantiations may delegate to this one.
+GEN_LMAD_COPY_GPU2GPU(16b, elem_16b_t)
 
 GEN_LMAD_COPY_GPU2GPU(1b, uint8_t)
 GEN_LMAD_COPY_GPU2GPU(2b, uint16_t)
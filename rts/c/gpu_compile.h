@@ -0,0 +1,280 @@
+// Start of gpu_compile.h.
+
+// Splitting the GPU program into independently compilable modules,
+// and compiling those in parallel.  This is used by the backends that
+// compile kernels at runtime with NVRTC or HIPRTC, where compiling a
+// large program as a single translation unit can take a long time.
+//
+// The code generator emits the program as a prelude (types, macros,
+// and device functions) followed by units that each contain one or
+// more kernels, with every unit preceded by a line consisting of
+// GPU_MODULE_SPLIT_MARKER.  A module is the prelude followed by some
+// of the units.  Kernels never call each other, so any partitioning
+// of the units is valid.
+
+#define GPU_MODULE_SPLIT_MARKER "// FUTHARK_MODULE_SPLIT\n"
+
+struct gpu_module {
+  char *src;         // Prelude followed by the units in this module.
+  char *code;        // Compiled code, or NULL if not compiled.
+  size_t code_size;
+  char *error;       // Compilation error message, or NULL.
+};
+
+// A function that compiles a module.  Must be safe to call from
+// multiple threads at once.  On success, returns NULL and stores
+// malloc()ed code in *code.  On failure, returns an error message.
+typedef char* (*gpu_compile_fn)(void *arg, const char *src,
+                                char **code, size_t *code_size);
+
+// Split the program into at most max_modules modules, balancing the
+// amount of source text in each.  Stores a malloc()ed array of
+// modules in *modules_out and returns their number.  A program
+// without markers always yields a single module with the original
+// source.
+static int gpu_split_program(const char *src, int max_modules,
+                             struct gpu_module **modules_out) {
+  size_t marker_len = strlen(GPU_MODULE_SPLIT_MARKER);
+  const char *first = strstr(src, GPU_MODULE_SPLIT_MARKER);
+
+  int num_units = 0;
+  for (const char *p = first; p != NULL;
+       p = strstr(p + marker_len, GPU_MODULE_SPLIT_MARKER)) {
+    num_units++;
+  }
+
+  int num_modules = max_modules < num_units ? max_modules : num_units;
+  if (num_modules < 1) {
+    num_modules = 1;
+  }
+
+  struct gpu_module *modules =
+    (struct gpu_module*) calloc(num_modules, sizeof(struct gpu_module));
+  *modules_out = modules;
+
+  if (num_modules == 1) {
+    modules[0].src = strdup(src);
+    return 1;
+  }
+
+  const char **unit_start = (const char**) malloc(num_units * sizeof(const char*));
+  size_t *unit_len = (size_t*) malloc(num_units * sizeof(size_t));
+  int *unit_module = (int*) malloc(num_units * sizeof(int));
+  size_t *module_len = (size_t*) calloc(num_modules, sizeof(size_t));
+
+  const char *p = first;
+  for (int i = 0; i < num_units; i++) {
+    const char *next = strstr(p + marker_len, GPU_MODULE_SPLIT_MARKER);
+    unit_start[i] = p;
+    unit_len[i] = next != NULL ? (size_t)(next - p) : strlen(p);
+    p = next;
+  }
+
+  // Assign units to modules largest-first, each to the currently
+  // smallest module.  Source size is only a rough proxy for
+  // compilation time, but it is what we have.
+  for (int i = 0; i < num_units; i++) {
+    unit_module[i] = -1;
+  }
+  for (int n = 0; n < num_units; n++) {
+    int largest = -1;
+    for (int i = 0; i < num_units; i++) {
+      if (unit_module[i] < 0 && (largest < 0 || unit_len[i] > unit_len[largest])) {
+        largest = i;
+      }
+    }
+    int smallest = 0;
+    for (int m = 1; m < num_modules; m++) {
+      if (module_len[m] < module_len[smallest]) {
+        smallest = m;
+      }
+    }
+    unit_module[largest] = smallest;
+    module_len[smallest] += unit_len[largest];
+  }
+
+  // Units keep their relative order within each module, such that
+  // the split is deterministic and compiler messages are readable.
+  size_t prelude_len = first - src;
+  for (int m = 0; m < num_modules; m++) {
+    char *s = (char*) malloc(prelude_len + module_len[m] + 1);
+    memcpy(s, src, prelude_len);
+    size_t off = prelude_len;
+    for (int i = 0; i < num_units; i++) {
+      if (unit_module[i] == m) {
+        memcpy(s + off, unit_start[i], unit_len[i]);
+        off += unit_len[i];
+      }
+    }
+    s[off] = 0;
+    modules[m].src = s;
+  }
+
+  free(unit_start);
+  free(unit_len);
+  free(unit_module);
+  free(module_len);
+  return num_modules;
+}
+
+struct gpu_compile_job {
+  struct gpu_module *modules;
+  int num_modules;
+  int next;
+  lock_t lock;
+  gpu_compile_fn f;
+  void *arg;
+};
+
+static void gpu_compile_worker(struct gpu_compile_job *job) {
+  while (1) {
+    lock_lock(&job->lock);
+    int i = job->next++;
+    lock_unlock(&job->lock);
+    if (i >= job->num_modules) {
+      break;
+    }
+    struct gpu_module *m = &job->modules[i];
+    m->error = job->f(job->arg, m->src, &m->code, &m->code_size);
+  }
+}
+
+#ifndef _WIN32
+static void* gpu_compile_thread(void *arg) {
+  gpu_compile_worker((struct gpu_compile_job*)arg);
+  return NULL;
+}
+#endif
+
+// Compile all modules using up to num_threads threads, including the
+// calling thread.  Returns NULL on success, or a copy of the error of
+// the first module that failed.
+static char* gpu_compile_modules(struct gpu_module *modules, int num_modules,
+                                 int num_threads, gpu_compile_fn f, void *arg) {
+  struct gpu_compile_job job;
+  job.modules = modules;
+  job.num_modules = num_modules;
+  job.next = 0;
+  job.f = f;
+  job.arg = arg;
+  create_lock(&job.lock);
+
+  if (num_threads > num_modules) {
+    num_threads = num_modules;
+  }
+
+#ifndef _WIN32
+  pthread_t *threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+  int num_started = 0;
+  for (int i = 1; i < num_threads; i++) {
+    // If we cannot create a thread, the remaining work is just done
+    // by fewer threads.
+    if (pthread_create(&threads[num_started], NULL, gpu_compile_thread, &job) == 0) {
+      num_started++;
+    }
+  }
+#endif
+
+  gpu_compile_worker(&job);
+
+#ifndef _WIN32
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+#endif
+
+  free_lock(&job.lock);
+
+  for (int i = 0; i < num_modules; i++) {
+    if (modules[i].error != NULL) {
+      return strdup(modules[i].error);
+    }
+  }
+  return NULL;
+}
+
+static void gpu_free_modules(struct gpu_module *modules, int num_modules) {
+  for (int i = 0; i < num_modules; i++) {
+    free(modules[i].src);
+    free(modules[i].code);
+    free(modules[i].error);
+  }
+  free(modules);
+}
+
+// The compiled modules are cached as a single blob: the number of
+// modules, the size of each, and then the code of each, padded to
+// eight bytes such that code read from a mapped cache file is
+// aligned.
+#define GPU_MODULE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+static void gpu_pack_modules(const struct gpu_module *modules, int num_modules,
+                             unsigned char **buf_out, size_t *len_out) {
+  size_t len = sizeof(int64_t) * (1 + num_modules);
+  for (int i = 0; i < num_modules; i++) {
+    len += GPU_MODULE_ALIGN(modules[i].code_size);
+  }
+  unsigned char *buf = (unsigned char*) calloc(len, 1);
+  int64_t n = num_modules;
+  memcpy(buf, &n, sizeof(int64_t));
+  size_t off = sizeof(int64_t) * (1 + num_modules);
+  for (int i = 0; i < num_modules; i++) {
+    int64_t size = modules[i].code_size;
+    memcpy(buf + sizeof(int64_t) * (1 + i), &size, sizeof(int64_t));
+    memcpy(buf + off, modules[i].code, modules[i].code_size);
+    off += GPU_MODULE_ALIGN(modules[i].code_size);
+  }
+  *buf_out = buf;
+  *len_out = len;
+}
+
+// Find the code of each module in a blob produced by
+// gpu_pack_modules().  The pointers stored in codes[] point into buf.
+// Returns the number of modules, or -1 if the blob is malformed.
+static int gpu_unpack_modules(const unsigned char *buf, size_t len,
+                              const unsigned char ***codes_out,
+                              size_t **sizes_out) {
+  int64_t n;
+  if (len < sizeof(int64_t)) {
+    return -1;
+  }
+  memcpy(&n, buf, sizeof(int64_t));
+  if (n < 1 || (uint64_t)n > len / sizeof(int64_t) - 1) {
+    return -1;
+  }
+  const unsigned char **codes =
+    (const unsigned char**) malloc(n * sizeof(const unsigned char*));
+  size_t *sizes = (size_t*) malloc(n * sizeof(size_t));
+  size_t off = sizeof(int64_t) * (1 + n);
+  for (int64_t i = 0; i < n; i++) {
+    int64_t size;
+    memcpy(&size, buf + sizeof(int64_t) * (1 + i), sizeof(int64_t));
+    if (size < 0 || (uint64_t)size > len - off) {
+      free(codes);
+      free(sizes);
+      return -1;
+    }
+    codes[i] = buf + off;
+    sizes[i] = size;
+    off += GPU_MODULE_ALIGN((size_t)size);
+    if (off > len) {
+      off = len;
+    }
+  }
+  *codes_out = codes;
+  *sizes_out = sizes;
+  return (int)n;
+}
+
+// The default number of compilation threads.
+static int gpu_num_compile_threads(void) {
+#ifdef _WIN32
+  return 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+// End of gpu_compile.h.
@@ -7,6 +7,7 @@ struct futhark_context;
 char *futhark_context_get_error(struct futhark_context *ctx);
 int futhark_context_sync(struct futhark_context *ctx);
 int futhark_context_clear_caches(struct futhark_context *ctx);
+void futhark_context_set_logging_file(struct futhark_context *ctx, FILE *f);
 int futhark_context_config_set_tuning_param(struct futhark_context_config *cfg,
                                             const char *param_name,
                                             size_t new_value);
@@ -15,7 +16,8 @@ const char* futhark_get_tuning_param_name(int i);
 const char* futhark_get_tuning_param_class(int i);
 
 typedef int (*restore_fn)(const void*, FILE *, struct futhark_context*, void*);
-typedef void (*store_fn)(const void*, FILE *, struct futhark_context*, void*);
+// The int is the write_binary argument of write_array().
+typedef void (*store_fn)(const void*, FILE *, struct futhark_context*, void*, int);
 typedef int (*free_fn)(const void*, struct futhark_context*, void*);
 typedef int (*project_fn)(struct futhark_context*, void*, const void*);
 typedef int (*new_fn)(struct futhark_context*, void**, const void*[]);
@@ -58,10 +60,11 @@ int free_scalar(const void *aux, struct futhark_context *ctx, void *p) {
   }                                                             \
                                                                 \
   void store_##T(const void *aux, FILE *f,                      \
-                 struct futhark_context *ctx, void *p) {        \
+                 struct futhark_context *ctx, void *p,          \
+                 int write_binary) {                            \
     (void)aux;                                                  \
     (void)ctx;                                                  \
-    write_scalar(f, 1, &T##_info, p);                           \
+    write_scalar(f, write_binary, &T##_info, p);                \
   }                                                             \
                                                                 \
   struct type type_##T =                                        \
@@ -147,7 +150,7 @@ void* value_ptr(struct value *v) {
 }
 
 struct variable {
-  // NULL name indicates free slot.  Name is owned by this struct.
+  // Owned by this struct.
   char *name;
   struct value value;
 };
@@ -187,65 +190,145 @@ struct futhark_prog {
   const struct type **types;
 };
 
-struct server_state {
-  struct futhark_prog prog;
-  struct futhark_context_config *cfg;
-  struct futhark_context *ctx;
-  int variables_capacity;
-  struct variable *variables;
+// A hash table from names to pointers, using open addressing with
+// linear probing.  The table does not own the names, which must stay
+// alive while they are in the table.
+struct name_table {
+  size_t capacity; // Always a power of two.
+  size_t used;
+  const char **names; // NULL for empty slots.
+  void **values;
 };
 
-struct variable* get_variable(struct server_state *s,
-                              const char *name) {
-  for (int i = 0; i < s->variables_capacity; i++) {
-    if (s->variables[i].name != NULL &&
-        strcmp(s->variables[i].name, name) == 0) {
-      return &s->variables[i];
-    }
+// 64-bit FNV-1a.
+uint64_t name_hash(const char *name) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *name; name++) {
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
   }
+  return h;
+}
 
-  return NULL;
+void name_table_init(struct name_table *t, size_t capacity) {
+  t->capacity = capacity;
+  t->used = 0;
+  t->names = calloc(capacity, sizeof(const char*));
+  t->values = calloc(capacity, sizeof(void*));
 }
 
-struct variable* create_variable(struct server_state *s,
-                                 const char *name,
-                                 const struct type *type) {
-  int found = -1;
-  for (int i = 0; i < s->variables_capacity; i++) {
-    if (found == -1 && s->variables[i].name == NULL) {
-      found = i;
-    } else if (s->variables[i].name != NULL &&
-               strcmp(s->variables[i].name, name) == 0) {
-      return NULL;
+void name_table_free(struct name_table *t) {
+  free(t->names);
+  free(t->values);
+}
+
+// The slot holding the name, or the empty slot where it would go.
+size_t name_table_slot(const struct name_table *t, const char *name) {
+  size_t mask = t->capacity - 1;
+  size_t i = (size_t)name_hash(name) & mask;
+  while (t->names[i] != NULL && strcmp(t->names[i], name) != 0) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void* name_table_get(const struct name_table *t, const char *name) {
+  return t->values[name_table_slot(t, name)];
+}
+
+// The name must not already be in the table.
+void name_table_put(struct name_table *t, const char *name, void *value) {
+  // Keep the table at most half full, such that probe sequences stay
+  // short.
+  if (2 * (t->used + 1) > t->capacity) {
+    struct name_table bigger;
+    name_table_init(&bigger, 2 * t->capacity);
+    for (size_t i = 0; i < t->capacity; i++) {
+      if (t->names[i] != NULL) {
+        name_table_put(&bigger, t->names[i], t->values[i]);
+      }
     }
+    name_table_free(t);
+    *t = bigger;
   }
+  size_t i = name_table_slot(t, name);
+  t->names[i] = name;
+  t->values[i] = value;
+  t->used++;
+}
 
-  if (found != -1) {
-    // Found a free spot.
-    s->variables[found].name = strdup(name);
-    s->variables[found].value.type = type;
-    return &s->variables[found];
+void name_table_remove(struct name_table *t, const char *name) {
+  size_t mask = t->capacity - 1;
+  size_t i = name_table_slot(t, name);
+  if (t->names[i] == NULL) {
+    return;
+  }
+  t->names[i] = NULL;
+  t->values[i] = NULL;
+  t->used--;
+  // Move later entries of the probe sequence back into the hole if
+  // their home slot is not between the hole and where they are now,
+  // as they would otherwise no longer be found.
+  for (size_t j = (i + 1) & mask; t->names[j] != NULL; j = (j + 1) & mask) {
+    size_t home = (size_t)name_hash(t->names[j]) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->names[i] = t->names[j];
+      t->values[i] = t->values[j];
+      t->names[j] = NULL;
+      t->values[j] = NULL;
+      i = j;
+    }
   }
+}
 
-  // Need to grow the buffer.
-  found = s->variables_capacity;
-  s->variables_capacity *= 2;
-  s->variables = realloc(s->variables,
-                         s->variables_capacity * sizeof(struct variable));
+struct server_state {
+  struct futhark_prog prog;
+  struct futhark_context_config *cfg;
+  struct futhark_context *ctx;
+  // Maps names to the struct variable, type, or entry point of that
+  // name.  Variables are allocated individually, such that pointers
+  // to them stay valid when other variables are created.
+  struct name_table variables;
+  struct name_table types;
+  struct name_table entry_points;
+  // Where responses are written.  With the binary protocol, this is
+  // a buffer that becomes the text of the reply frame.
+  FILE *out;
+  bool binary_protocol;
+  // The rest is only used with the binary protocol.
+  char *out_buf;
+  size_t out_size;
+  bool failed;
+  // The payload of the current request.
+  char *payload;
+  size_t payload_size;
+  // The payload of the reply, or NULL.
+  char *reply_payload;
+  size_t reply_payload_size;
+};
 
-  s->variables[found].name = strdup(name);
-  s->variables[found].value.type = type;
+struct variable* get_variable(struct server_state *s,
+                              const char *name) {
+  return name_table_get(&s->variables, name);
+}
 
-  for (int i = found+1; i < s->variables_capacity; i++) {
-    s->variables[i].name = NULL;
+struct variable* create_variable(struct server_state *s,
+                                 const char *name,
+                                 const struct type *type) {
+  if (get_variable(s, name) != NULL) {
+    return NULL;
   }
 
-  return &s->variables[found];
+  struct variable *v = malloc(sizeof(struct variable));
+  v->name = strdup(name);
+  v->value.type = type;
+  name_table_put(&s->variables, v->name, v);
+  return v;
 }
 
-void drop_variable(struct variable *v) {
+void drop_variable(struct server_state *s, struct variable *v) {
+  name_table_remove(&s->variables, v->name);
   free(v->name);
-  v->name = NULL;
+  free(v);
 }
 
 int arg_exists(const char *args[], int i) {
@@ -260,45 +343,80 @@ const char* get_arg(const char *args[], int i) {
 }
 
 const struct type* get_type(struct server_state *s, const char *name) {
-  for (int i = 0; s->prog.types[i]; i++) {
-    if (strcmp(s->prog.types[i]->name, name) == 0) {
-      return s->prog.types[i];
-    }
+  const struct type *t = name_table_get(&s->types, name);
+  if (t == NULL) {
+    futhark_panic(1, "Unknown type %s\n", name);
   }
-
-  futhark_panic(1, "Unknown type %s\n", name);
-  return NULL;
+  return t;
 }
 
 struct entry_point* get_entry_point(struct server_state *s, const char *name) {
-  for (int i = 0; s->prog.entry_points[i].name; i++) {
-    if (strcmp(s->prog.entry_points[i].name, name) == 0) {
-      return &s->prog.entry_points[i];
-    }
-  }
-
-  return NULL;
+  return name_table_get(&s->entry_points, name);
 }
 
 // Print the command-done marker, indicating that we are ready for
-// more input.
-void ok(void) {
-  printf("%%%%%% OK\n");
+// more input.  With the binary protocol, send the reply frame instead.
+void ok(struct server_state *s) {
+  if (!s->binary_protocol) {
+    fprintf(s->out, "%%%%%% OK\n");
+    fflush(s->out);
+    return;
+  }
+
+  fflush(s->out);
+  fputc(s->failed ? 1 : 0, stdout);
+  write_le_u64(stdout, s->out_size);
+  fwrite(s->out_buf, 1, s->out_size, stdout);
+  write_le_u64(stdout, s->reply_payload_size);
+  if (s->reply_payload != NULL) {
+    fwrite(s->reply_payload, 1, s->reply_payload_size, stdout);
+  }
   fflush(stdout);
+
+  fseek(s->out, 0, SEEK_SET);
+  s->failed = false;
+  free(s->reply_payload);
+  s->reply_payload = NULL;
+  s->reply_payload_size = 0;
 }
 
 // Print the failure marker.  Output is now an error message until the
 // next ok().
-void failure(void) {
-  printf("%%%%%% FAILURE\n");
+void failure(struct server_state *s) {
+  if (s->binary_protocol) {
+    s->failed = true;
+  } else {
+    fprintf(s->out, "%%%%%% FAILURE\n");
+  }
+}
+
+// With the binary protocol, the file name "-" refers to the payload
+// of the request (for reading) or of the reply (for writing).
+FILE* open_value_file(struct server_state *s, const char *fname,
+                      const char *mode) {
+  if (!s->binary_protocol || strcmp(fname, "-") != 0) {
+    return fopen(fname, mode);
+  }
+#ifdef _WIN32
+  errno = ENOSYS;
+  return NULL;
+#else
+  if (mode[0] == 'r') {
+    return fmemopen(s->payload, s->payload_size, mode);
+  }
+  free(s->reply_payload);
+  s->reply_payload = NULL;
+  s->reply_payload_size = 0;
+  return open_memstream(&s->reply_payload, &s->reply_payload_size);
+#endif
 }
 
 void error_check(struct server_state *s, int err) {
   if (err != 0) {
-    failure();
+    failure(s);
     char *error = futhark_context_get_error(s->ctx);
     if (error != NULL) {
-      puts(error);
+      fprintf(s->out, "%s\n", error);
     }
     free(error);
   }
@@ -310,8 +428,8 @@ void cmd_call(struct server_state *s, const char *args[]) {
   struct entry_point *e = get_entry_point(s, name);
 
   if (e == NULL) {
-    failure();
-    printf("Unknown entry point: %s\n", name);
+    failure(s);
+    fprintf(s->out, "Unknown entry point: %s\n", name);
     return;
   }
 
@@ -325,14 +443,14 @@ void cmd_call(struct server_state *s, const char *args[]) {
     const char *in_name = get_arg(args, 1+num_outs+i);
     struct variable *v = get_variable(s, in_name);
     if (v == NULL) {
-      failure();
-      printf("Unknown variable: %s\n", in_name);
+      failure(s);
+      fprintf(s->out, "Unknown variable: %s\n", in_name);
       return;
     }
     if (v->value.type != e->in_types[i]) {
-      failure();
-      printf("Wrong input type.  Expected %s, got %s.\n",
-             e->in_types[i]->name, v->value.type->name);
+      failure(s);
+      fprintf(s->out, "Wrong input type.  Expected %s, got %s.\n",
+              e->in_types[i]->name, v->value.type->name);
       return;
     }
     ins[i] = value_ptr(&v->value);
@@ -342,8 +460,8 @@ void cmd_call(struct server_state *s, const char *args[]) {
     const char *out_name = get_arg(args, 1+i);
     struct variable *v = create_variable(s, out_name, e->out_types[i]);
     if (v == NULL) {
-      failure();
-      printf("Variable already exists: %s\n", out_name);
+      failure(s);
+      fprintf(s->out, "Variable already exists: %s\n", out_name);
       return;
     }
     outs[i] = value_ptr(&v->value);
@@ -354,7 +472,7 @@ void cmd_call(struct server_state *s, const char *args[]) {
   err |= futhark_context_sync(s->ctx);
   int64_t t_end = get_wall_time();
   long long int elapsed_usec = t_end - t_start;
-  printf("runtime: %lld\n", elapsed_usec);
+  fprintf(s->out, "runtime: %lld\n", elapsed_usec);
 
   error_check(s, err);
   if (err != 0) {
@@ -364,25 +482,19 @@ void cmd_call(struct server_state *s, const char *args[]) {
       const char *out_name = get_arg(args, 1+i);
       struct variable *v = get_variable(s, out_name);
       if (v) {
-        drop_variable(v);
+        drop_variable(s, v);
       }
     }
   }
 }
 
-void cmd_restore(struct server_state *s, const char *args[]) {
-  const char *fname = get_arg(args, 0);
-
-  FILE *f = fopen(fname, "rb");
-  if (f == NULL) {
-    failure();
-    printf("Failed to open %s: %s\n", fname, strerror(errno));
-    return;
-  }
-
+// Restore the variables named in args from f, which is described as
+// 'where' in error messages.
+void restore_variables(struct server_state *s, FILE *f, const char *where,
+                       const char *args[]) {
   int bad = 0;
   int values = 0;
-  for (int i = 1; arg_exists(args, i); i+=2, values++) {
+  for (int i = 0; arg_exists(args, i); i+=2, values++) {
     const char *vname = get_arg(args, i);
     const char *type = get_arg(args, i+1);
 
@@ -391,29 +503,165 @@ void cmd_restore(struct server_state *s, const char *args[]) {
 
     if (v == NULL) {
       bad = 1;
-      failure();
-      printf("Variable already exists: %s\n", vname);
+      failure(s);
+      fprintf(s->out, "Variable already exists: %s\n", vname);
       break;
     }
 
     errno = 0;
     if (t->restore(t->aux, f, s->ctx, value_ptr(&v->value)) != 0) {
       bad = 1;
-      failure();
-      printf("Failed to restore variable %s.\n"
-             "Possibly malformed data in %s (errno: %s)\n",
-             vname, fname, strerror(errno));
-      drop_variable(v);
+      failure(s);
+      fprintf(s->out, "Failed to restore variable %s.\n"
+              "Possibly malformed data in %s (errno: %s)\n",
+              vname, where, strerror(errno));
+      drop_variable(s, v);
       break;
     }
   }
 
   if (!bad && end_of_input(f) != 0) {
-    failure();
-    printf("Expected EOF after reading %d values from %s\n",
-           values, fname);
+    failure(s);
+    fprintf(s->out, "Expected EOF after reading %d values from %s\n",
+            values, where);
   }
 
+  if (!bad) {
+    int err = futhark_context_sync(s->ctx);
+    error_check(s, err);
+  }
+}
+
+void cmd_restore(struct server_state *s, const char *args[]) {
+  const char *fname = get_arg(args, 0);
+
+  FILE *f = open_value_file(s, fname, "rb");
+  if (f == NULL) {
+    failure(s);
+    fprintf(s->out, "Failed to open %s: %s\n", fname, strerror(errno));
+    return;
+  }
+
+  restore_variables(s, f, fname, args+1);
+  fclose(f);
+}
+
+// Open a file descriptor inherited from the client, such as a memfd,
+// without closing it afterwards.  Reading and writing starts at the
+// beginning of the file, and writing first truncates it.  Since the
+// file is not a pipe, arrays are restored from a mapping of it.
+FILE* open_client_fd(const char *fd_s, const char *mode) {
+#ifdef _WIN32
+  (void)fd_s;
+  (void)mode;
+  errno = ENOSYS;
+  return NULL;
+#else
+  char *end;
+  errno = 0;
+  long fd = strtol(fd_s, &end, 10);
+  if (errno != 0 || *fd_s == 0 || *end != 0 || fd < 0 || fd != (int)fd) {
+    errno = EBADF;
+    return NULL;
+  }
+  int copy = dup((int)fd);
+  if (copy < 0) {
+    return NULL;
+  }
+  if (lseek(copy, 0, SEEK_SET) < 0
+      || (mode[0] == 'w' && ftruncate(copy, 0) != 0)) {
+    int saved = errno;
+    close(copy);
+    errno = saved;
+    return NULL;
+  }
+  FILE *f = fdopen(copy, mode);
+  if (f == NULL) {
+    close(copy);
+  }
+  return f;
+#endif
+}
+
+void cmd_restore_fd(struct server_state *s, const char *args[]) {
+  const char *fd_s = get_arg(args, 0);
+
+  FILE *f = open_client_fd(fd_s, "rb");
+  if (f == NULL) {
+    failure(s);
+    fprintf(s->out, "Failed to use file descriptor %s: %s\n", fd_s, strerror(errno));
+    return;
+  }
+
+  char where[64];
+  snprintf(where, sizeof(where), "file descriptor %s", fd_s);
+  restore_variables(s, f, where, args+1);
+  fclose(f);
+}
+
+void cmd_restore_entry(struct server_state *s, const char *args[]) {
+  const char *fname = get_arg(args, 0);
+
+  FILE *f = open_value_file(s, fname, "rb");
+  if (f == NULL) {
+    failure(s);
+    fprintf(s->out, "Failed to open %s: %s\n", fname, strerror(errno));
+    return;
+  }
+
+  struct value_index idx;
+  if (read_value_index(f, &idx) != 0) {
+    failure(s);
+    fprintf(s->out, "%s is not an indexed file.\n", fname);
+    fclose(f);
+    return;
+  }
+
+  int bad = 0;
+  for (int i = 1; arg_exists(args, i); i+=3) {
+    const char *key = get_arg(args, i);
+    const char *vname = get_arg(args, i+1);
+    const char *type = get_arg(args, i+2);
+
+    const struct indexed_value *iv = find_indexed_value(&idx, key);
+    if (iv == NULL) {
+      bad = 1;
+      failure(s);
+      fprintf(s->out, "No entry %s in %s\n", key, fname);
+      break;
+    }
+
+    if (check_indexed_value(f, iv) != 0) {
+      bad = 1;
+      failure(s);
+      fprintf(s->out, "Checksum mismatch for entry %s in %s\n", key, fname);
+      break;
+    }
+
+    const struct type *t = get_type(s, type);
+    struct variable *v = create_variable(s, vname, t);
+
+    if (v == NULL) {
+      bad = 1;
+      failure(s);
+      fprintf(s->out, "Variable already exists: %s\n", vname);
+      break;
+    }
+
+    errno = 0;
+    if (fseek(f, (long)iv->header_offset, SEEK_SET) != 0
+        || t->restore(t->aux, f, s->ctx, value_ptr(&v->value)) != 0) {
+      bad = 1;
+      failure(s);
+      fprintf(s->out, "Failed to restore variable %s.\n"
+              "Possibly malformed data in %s (errno: %s)\n",
+              vname, fname, strerror(errno));
+      drop_variable(s, v);
+      break;
+    }
+  }
+
+  free_value_index(&idx);
   fclose(f);
 
   if (!bad) {
@@ -422,29 +670,59 @@ void cmd_restore(struct server_state *s, const char *args[]) {
   }
 }
 
-void cmd_store(struct server_state *s, const char *args[]) {
+// Store the variables named in args in f.
+void store_variables(struct server_state *s, FILE *f, const char *args[],
+                     int write_binary) {
+  for (int i = 0; arg_exists(args, i); i++) {
+    const char *vname = get_arg(args, i);
+    struct variable *v = get_variable(s, vname);
+
+    if (v == NULL) {
+      failure(s);
+      fprintf(s->out, "Unknown variable: %s\n", vname);
+      return;
+    }
+
+    const struct type *t = v->value.type;
+    t->store(t->aux, f, s->ctx, value_ptr(&v->value), write_binary);
+  }
+}
+
+void store_in_file(struct server_state *s, const char *args[],
+                   int write_binary) {
   const char *fname = get_arg(args, 0);
 
-  FILE *f = fopen(fname, "wb");
+  FILE *f = open_value_file(s, fname, "wb");
   if (f == NULL) {
-    failure();
-    printf("Failed to open %s: %s\n", fname, strerror(errno));
-  } else {
-    for (int i = 1; arg_exists(args, i); i++) {
-      const char *vname = get_arg(args, i);
-      struct variable *v = get_variable(s, vname);
-
-      if (v == NULL) {
-        failure();
-        printf("Unknown variable: %s\n", vname);
-        return;
-      }
+    failure(s);
+    fprintf(s->out, "Failed to open %s: %s\n", fname, strerror(errno));
+    return;
+  }
 
-      const struct type *t = v->value.type;
-      t->store(t->aux, f, s->ctx, value_ptr(&v->value));
-    }
-    fclose(f);
+  store_variables(s, f, args+1, write_binary);
+  fclose(f);
+}
+
+void cmd_store(struct server_state *s, const char *args[]) {
+  store_in_file(s, args, 1);
+}
+
+void cmd_store_compressed(struct server_state *s, const char *args[]) {
+  store_in_file(s, args, WRITE_BINARY_COMPRESSED);
+}
+
+void cmd_store_fd(struct server_state *s, const char *args[]) {
+  const char *fd_s = get_arg(args, 0);
+
+  FILE *f = open_client_fd(fd_s, "wb");
+  if (f == NULL) {
+    failure(s);
+    fprintf(s->out, "Failed to use file descriptor %s: %s\n", fd_s, strerror(errno));
+    return;
   }
+
+  store_variables(s, f, args+1, 1);
+  fclose(f);
 }
 
 void cmd_free(struct server_state *s, const char *args[]) {
@@ -453,8 +731,8 @@ void cmd_free(struct server_state *s, const char *args[]) {
     struct variable *v = get_variable(s, name);
 
     if (v == NULL) {
-      failure();
-      printf("Unknown variable: %s\n", name);
+      failure(s);
+      fprintf(s->out, "Unknown variable: %s\n", name);
       return;
     }
 
@@ -462,7 +740,7 @@ void cmd_free(struct server_state *s, const char *args[]) {
 
     int err = t->free(t->aux, s->ctx, value_ptr(&v->value));
     error_check(s, err);
-    drop_variable(v);
+    drop_variable(s, v);
   }
 }
 
@@ -473,19 +751,21 @@ void cmd_rename(struct server_state *s, const char *args[]) {
   struct variable *new = get_variable(s, newname);
 
   if (old == NULL) {
-    failure();
-    printf("Unknown variable: %s\n", oldname);
+    failure(s);
+    fprintf(s->out, "Unknown variable: %s\n", oldname);
     return;
   }
 
   if (new != NULL) {
-    failure();
-    printf("Variable already exists: %s\n", newname);
+    failure(s);
+    fprintf(s->out, "Variable already exists: %s\n", newname);
     return;
   }
 
+  name_table_remove(&s->variables, old->name);
   free(old->name);
   old->name = strdup(newname);
+  name_table_put(&s->variables, old->name, old);
 }
 
 void cmd_inputs(struct server_state *s, const char *args[]) {
@@ -493,17 +773,17 @@ void cmd_inputs(struct server_state *s, const char *args[]) {
   struct entry_point *e = get_entry_point(s, name);
 
   if (e == NULL) {
-    failure();
-    printf("Unknown entry point: %s\n", name);
+    failure(s);
+    fprintf(s->out, "Unknown entry point: %s\n", name);
     return;
   }
 
   int num_ins = entry_num_ins(e);
   for (int i = 0; i < num_ins; i++) {
     if (e->in_unique[i]) {
-      putchar('*');
+      fputc('*', s->out);
     }
-    puts(e->in_types[i]->name);
+    fprintf(s->out, "%s\n", e->in_types[i]->name);
   }
 }
 
@@ -512,30 +792,35 @@ void cmd_outputs(struct server_state *s, const char *args[]) {
   struct entry_point *e = get_entry_point(s, name);
 
   if (e == NULL) {
-    failure();
-    printf("Unknown entry point: %s\n", name);
+    failure(s);
+    fprintf(s->out, "Unknown entry point: %s\n", name);
     return;
   }
 
   int num_outs = entry_num_outs(e);
   for (int i = 0; i < num_outs; i++) {
     if (e->out_unique[i]) {
-      putchar('*');
+      fputc('*', s->out);
     }
-    puts(e->out_types[i]->name);
+    fprintf(s->out, "%s\n", e->out_types[i]->name);
   }
 }
 
 void cmd_clear(struct server_state *s, const char *args[]) {
   (void)args;
   int err = 0;
-  for (int i = 0; i < s->variables_capacity; i++) {
-    struct variable *v = &s->variables[i];
-    if (v->name != NULL) {
+  // Empty the table as we go, rather than removing each variable.
+  for (size_t i = 0; i < s->variables.capacity; i++) {
+    struct variable *v = s->variables.values[i];
+    if (v != NULL) {
       err |= v->value.type->free(v->value.type->aux, s->ctx, value_ptr(&v->value));
-      drop_variable(v);
+      free(v->name);
+      free(v);
+      s->variables.names[i] = NULL;
+      s->variables.values[i] = NULL;
     }
   }
+  s->variables.used = 0;
   err |= futhark_context_clear_caches(s->ctx);
   error_check(s, err);
 }
@@ -553,7 +838,7 @@ void cmd_unpause_profiling(struct server_state *s, const char *args[]) {
 void cmd_report(struct server_state *s, const char *args[]) {
   (void)args;
   char *report = futhark_context_report(s->ctx);
-  puts(report);
+  fprintf(s->out, "%s\n", report);
   free(report);
 }
 
@@ -566,7 +851,7 @@ void cmd_set_tuning_param(struct server_state *s, const char *args[]) {
   error_check(s, err);
 
   if (err != 0) {
-    printf("Failed to set tuning parameter %s to %ld\n", param, (long)val);
+    fprintf(s->out, "Failed to set tuning parameter %s to %ld\n", param, (long)val);
   }
 }
 
@@ -575,32 +860,31 @@ void cmd_tuning_params(struct server_state *s, const char *args[]) {
   struct entry_point *e = get_entry_point(s, name);
 
   if (e == NULL) {
-    failure();
-    printf("Unknown entry point: %s\n", name);
+    failure(s);
+    fprintf(s->out, "Unknown entry point: %s\n", name);
     return;
   }
 
   const char **params = e->tuning_params;
   for (int i = 0; params[i] != NULL; i++) {
-    printf("%s\n", params[i]);
+    fprintf(s->out, "%s\n", params[i]);
   }
 }
 
 void cmd_tuning_param_class(struct server_state *s, const char *args[]) {
-  (void)s;
   const char *param = get_arg(args, 0);
 
   int n = futhark_get_tuning_param_count();
 
   for (int i = 0; i < n; i++) {
     if (strcmp(futhark_get_tuning_param_name(i), param) == 0) {
-      printf("%s\n", futhark_get_tuning_param_class(i));
+      fprintf(s->out, "%s\n", futhark_get_tuning_param_class(i));
       return;
     }
   }
 
-  failure();
-  printf("Unknown tuning parameter: %s\n", param);
+  failure(s);
+  fprintf(s->out, "Unknown tuning parameter: %s\n", param);
 }
 
 void cmd_fields(struct server_state *s, const char *args[]) {
@@ -609,14 +893,14 @@ void cmd_fields(struct server_state *s, const char *args[]) {
   const struct record *r = t->record;
 
   if (r == NULL) {
-    failure();
-    printf("Not a record type\n");
+    failure(s);
+    fprintf(s->out, "Not a record type\n");
     return;
   }
 
   for (int i = 0; i < r->num_fields; i++) {
     const struct field f = r->fields[i];
-    printf("%s %s\n", f.name, f.type->name);
+    fprintf(s->out, "%s %s\n", f.name, f.type->name);
   }
 }
 
@@ -628,8 +912,8 @@ void cmd_project(struct server_state *s, const char *args[]) {
   struct variable *from = get_variable(s, from_name);
 
   if (from == NULL) {
-    failure();
-    printf("Unknown variable: %s\n", from_name);
+    failure(s);
+    fprintf(s->out, "Unknown variable: %s\n", from_name);
     return;
   }
 
@@ -637,8 +921,8 @@ void cmd_project(struct server_state *s, const char *args[]) {
   const struct record *r = from_type->record;
 
   if (r == NULL) {
-    failure();
-    printf("Not a record type\n");
+    failure(s);
+    fprintf(s->out, "Not a record type\n");
     return;
   }
 
@@ -651,15 +935,15 @@ void cmd_project(struct server_state *s, const char *args[]) {
   }
 
   if (field == NULL) {
-    failure();
-    printf("No such field\n");
+    failure(s);
+    fprintf(s->out, "No such field\n");
   }
 
   struct variable *to = create_variable(s, to_name, field->type);
 
   if (to == NULL) {
-    failure();
-    printf("Variable already exists: %s\n", to_name);
+    failure(s);
+    fprintf(s->out, "Variable already exists: %s\n", to_name);
     return;
   }
 
@@ -673,16 +957,16 @@ void cmd_new(struct server_state *s, const char *args[]) {
   struct variable *to = create_variable(s, to_name, type);
 
   if (to == NULL) {
-    failure();
-    printf("Variable already exists: %s\n", to_name);
+    failure(s);
+    fprintf(s->out, "Variable already exists: %s\n", to_name);
     return;
   }
 
   const struct record* r = type->record;
 
   if (r == NULL) {
-    failure();
-    printf("Not a record type\n");
+    failure(s);
+    fprintf(s->out, "Not a record type\n");
     return;
   }
 
@@ -692,8 +976,8 @@ void cmd_new(struct server_state *s, const char *args[]) {
   }
 
   if (num_args != r->num_fields) {
-    failure();
-    printf("%d fields expected byt %d values provided.\n", num_args, r->num_fields);
+    failure(s);
+    fprintf(s->out, "%d fields expected byt %d values provided.\n", num_args, r->num_fields);
     return;
   }
 
@@ -703,15 +987,15 @@ void cmd_new(struct server_state *s, const char *args[]) {
     struct variable* v = get_variable(s, args[2+i]);
 
     if (v == NULL) {
-      failure();
-      printf("Unknown variable: %s\n", args[2+i]);
+      failure(s);
+      fprintf(s->out, "Unknown variable: %s\n", args[2+i]);
       return;
     }
 
     if (strcmp(v->value.type->name, r->fields[i].type->name) != 0) {
-      failure();
-      printf("Field %s mismatch: expected type %s, got %s\n",
-             r->fields[i].name, r->fields[i].type->name, v->value.type->name);
+      failure(s);
+      fprintf(s->out, "Field %s mismatch: expected type %s, got %s\n",
+              r->fields[i].name, r->fields[i].type->name, v->value.type->name);
       return;
     }
 
@@ -724,14 +1008,14 @@ void cmd_new(struct server_state *s, const char *args[]) {
 void cmd_entry_points(struct server_state *s, const char *args[]) {
   (void)args;
   for (int i = 0; s->prog.entry_points[i].name; i++) {
-    puts(s->prog.entry_points[i].name);
+    fprintf(s->out, "%s\n", s->prog.entry_points[i].name);
   }
 }
 
 void cmd_types(struct server_state *s, const char *args[]) {
   (void)args;
   for (int i = 0; s->prog.types[i] != NULL; i++) {
-    puts(s->prog.types[i]->name);
+    fprintf(s->out, "%s\n", s->prog.types[i]->name);
   }
 }
 
@@ -781,28 +1065,35 @@ char *next_word(char **line) {
 }
 
 void process_line(struct server_state *s, char *line) {
-  int max_num_tokens = 1000;
-  const char* tokens[max_num_tokens];
+  // Every word but the last is followed by at least one separator, so
+  // this is enough room for the words and the terminating NULL.
+  size_t max_num_tokens = strlen(line) / 2 + 2;
+  const char** tokens = malloc(max_num_tokens * sizeof(const char*));
   int num_tokens = 0;
 
   while ((tokens[num_tokens] = next_word(&line)) != NULL) {
     num_tokens++;
-    if (num_tokens == max_num_tokens) {
-      futhark_panic(1, "Line too long.\n");
-    }
   }
 
   const char *command = tokens[0];
 
   if (command == NULL) {
-    failure();
-    printf("Empty line\n");
+    failure(s);
+    fprintf(s->out, "Empty line\n");
   } else if (strcmp(command, "call") == 0) {
     cmd_call(s, tokens+1);
   } else if (strcmp(command, "restore") == 0) {
     cmd_restore(s, tokens+1);
+  } else if (strcmp(command, "restore_fd") == 0) {
+    cmd_restore_fd(s, tokens+1);
+  } else if (strcmp(command, "restore_entry") == 0) {
+    cmd_restore_entry(s, tokens+1);
   } else if (strcmp(command, "store") == 0) {
     cmd_store(s, tokens+1);
+  } else if (strcmp(command, "store_compressed") == 0) {
+    cmd_store_compressed(s, tokens+1);
+  } else if (strcmp(command, "store_fd") == 0) {
+    cmd_store_fd(s, tokens+1);
   } else if (strcmp(command, "free") == 0) {
     cmd_free(s, tokens+1);
   } else if (strcmp(command, "rename") == 0) {
@@ -838,36 +1129,98 @@ void process_line(struct server_state *s, char *line) {
   } else {
     futhark_panic(1, "Unknown command: %s\n", command);
   }
+
+  free(tokens);
+}
+
+// Read a length-prefixed field of a request frame.  The result is
+// always NUL-terminated.
+char* read_frame_field(FILE *f, size_t *size) {
+  uint64_t n;
+  if (read_le_u64(f, &n) != 0) {
+    return NULL;
+  }
+  char *bytes = n < SIZE_MAX ? malloc((size_t)n + 1) : NULL;
+  if (bytes == NULL) {
+    futhark_panic(1, "Cannot allocate %llu bytes for request.\n",
+                  (unsigned long long)n);
+  }
+  if (fread(bytes, 1, (size_t)n, f) != n) {
+    futhark_panic(1, "Truncated request.\n");
+  }
+  bytes[n] = 0;
+  *size = (size_t)n;
+  return bytes;
+}
+
+void run_binary_server(struct server_state *s) {
+#ifdef _WIN32
+  (void)s;
+  futhark_panic(1, "The binary server protocol is not supported on Windows.\n");
+#else
+  s->out = open_memstream(&s->out_buf, &s->out_size);
+  // Log messages must not end up between frames.
+  futhark_context_set_logging_file(s->ctx, s->out);
+
+  ok(s);
+  size_t command_size;
+  char *command;
+  while ((command = read_frame_field(stdin, &command_size)) != NULL) {
+    s->payload = read_frame_field(stdin, &s->payload_size);
+    if (s->payload == NULL) {
+      futhark_panic(1, "Truncated request.\n");
+    }
+    process_line(s, command);
+    ok(s);
+    free(command);
+    free(s->payload);
+    s->payload = NULL;
+  }
+
+  futhark_context_set_logging_file(s->ctx, stdout);
+  fclose(s->out);
+  free(s->out_buf);
+#endif
 }
 
 void run_server(struct futhark_prog *prog,
                 struct futhark_context_config *cfg,
-                struct futhark_context *ctx) {
-  char *line = NULL;
-  size_t buflen = 0;
-  ssize_t linelen;
-
+                struct futhark_context *ctx,
+                bool binary_protocol) {
   struct server_state s = {
     .cfg = cfg,
     .ctx = ctx,
-    .variables_capacity = 100,
-    .prog = *prog
+    .prog = *prog,
+    .out = stdout,
+    .binary_protocol = binary_protocol
   };
 
-  s.variables = malloc(s.variables_capacity * sizeof(struct variable));
-
-  for (int i = 0; i < s.variables_capacity; i++) {
-    s.variables[i].name = NULL;
+  name_table_init(&s.variables, 256);
+  name_table_init(&s.types, 64);
+  for (int i = 0; s.prog.types[i] != NULL; i++) {
+    name_table_put(&s.types, s.prog.types[i]->name, (void*)s.prog.types[i]);
+  }
+  name_table_init(&s.entry_points, 64);
+  for (int i = 0; s.prog.entry_points[i].name != NULL; i++) {
+    name_table_put(&s.entry_points, s.prog.entry_points[i].name, &s.prog.entry_points[i]);
   }
 
-  ok();
-  while ((linelen = getline(&line, &buflen, stdin)) > 0) {
-    process_line(&s, line);
-    ok();
+  if (binary_protocol) {
+    run_binary_server(&s);
+  } else {
+    char *line = NULL;
+    size_t buflen = 0;
+    ok(&s);
+    while (getline(&line, &buflen, stdin) > 0) {
+      process_line(&s, line);
+      ok(&s);
+    }
+    free(line);
   }
 
-  free(s.variables);
-  free(line);
+  name_table_free(&s.variables);
+  name_table_free(&s.types);
+  name_table_free(&s.entry_points);
 }
 
 // The aux struct lets us write generic method implementations without
@@ -875,7 +1228,8 @@ void run_server(struct futhark_prog *prog,
 
 typedef void* (*array_new_fn)(struct futhark_context *, const void*, const int64_t*);
 typedef const int64_t* (*array_shape_fn)(struct futhark_context*, void*);
-typedef int (*array_values_fn)(struct futhark_context*, void*, void*);
+typedef int (*array_values_slice_fn)(struct futhark_context*, void*, void*, int64_t, int64_t);
+typedef void* (*array_values_raw_fn)(struct futhark_context*, void*);
 typedef int (*array_free_fn)(struct futhark_context*, void*);
 
 struct array_aux {
@@ -884,41 +1238,88 @@ struct array_aux {
   const char *name;
   array_new_fn new;
   array_shape_fn shape;
-  array_values_fn values;
+  array_values_slice_fn values_slice;
+  array_values_raw_fn values_raw;
   array_free_fn free;
 };
 
 int restore_array(const struct array_aux *aux, FILE *f,
                   struct futhark_context *ctx, void *p) {
   void *data = NULL;
+  struct mapped_region m;
   int64_t shape[aux->rank];
-  if (read_array(f, aux->info, &data, shape, aux->rank) != 0) {
+  // Large arrays are copied by aux->new() straight from a mapping of
+  // the file, rather than first being read into a buffer.
+  if (read_array_mapped(f, aux->info, &data, shape, aux->rank, &m) != 0) {
     return 1;
   }
 
   void *arr = aux->new(ctx, data, shape);
   if (arr == NULL) {
+    free_array_data(data, &m);
     return 1;
   }
+  // The copy may be asynchronous, so we must synchronise before
+  // releasing the data.
   int err = futhark_context_sync(ctx);
   *(void**)p = arr;
-  free(data);
+  free_array_data(data, &m);
   return err;
 }
 
+// Arrays are stored in chunks of this many bytes, such that we never
+// need room for a copy of the whole array in host memory.  Must be a
+// multiple of COMPRESSED_BLOCK_SIZE.
+#define STORE_CHUNK_SIZE (8*COMPRESSED_BLOCK_SIZE)
+
 void store_array(const struct array_aux *aux, FILE *f,
-                 struct futhark_context *ctx, void *p) {
+                 struct futhark_context *ctx, void *p,
+                 int write_binary) {
   void *arr = *(void**)p;
   const int64_t *shape = aux->shape(ctx, arr);
-  int64_t size = sizeof(aux->info->size);
+  int64_t num_elems = 1;
   for (int i = 0; i < aux->rank; i++) {
-    size *= shape[i];
+    num_elems *= shape[i];
   }
-  int32_t *data = malloc(size);
-  assert(aux->values(ctx, arr, data) == 0);
+
+  int version = write_bin_header(f, write_binary, aux->info, shape, aux->rank);
+
+#if defined(FUTHARK_BACKEND_c) || defined(FUTHARK_BACKEND_multicore) \
+  || defined(FUTHARK_BACKEND_ispc) || defined(FUTHARK_BACKEND_wasm) \
+  || defined(FUTHARK_BACKEND_wasm_multicore)
+  // The array is in host memory already, so we write it from there.
   assert(futhark_context_sync(ctx) == 0);
-  assert(write_array(f, 1, aux->info, data, shape, aux->rank) == 0);
-  free(data);
+  const unsigned char *data = aux->values_raw(ctx, arr);
+  write_bin_payload(f, version, aux->info, data, num_elems);
+#else
+  // Copy the array through two staging buffers, such that writing one
+  // chunk overlaps with copying the next.
+  int64_t chunk_elems = STORE_CHUNK_SIZE / aux->info->size;
+  if (chunk_elems > num_elems) {
+    chunk_elems = num_elems;
+  }
+  unsigned char *bufs[2];
+  bufs[0] = malloc(chunk_elems * aux->info->size);
+  bufs[1] = malloc(chunk_elems * aux->info->size);
+
+  if (num_elems > 0) {
+    assert(aux->values_slice(ctx, arr, bufs[0], 0, chunk_elems) == 0);
+    assert(futhark_context_sync(ctx) == 0);
+  }
+  for (int64_t i = 0, b = 0; i < num_elems; i += chunk_elems, b ^= 1) {
+    int64_t n = num_elems - i < chunk_elems ? num_elems - i : chunk_elems;
+    int64_t next = i + n;
+    if (next < num_elems) {
+      int64_t next_n = num_elems - next < chunk_elems ? num_elems - next : chunk_elems;
+      assert(aux->values_slice(ctx, arr, bufs[b^1], next, next_n) == 0);
+    }
+    write_bin_payload(f, version, aux->info, bufs[b], n);
+    assert(futhark_context_sync(ctx) == 0);
+  }
+
+  free(bufs[0]);
+  free(bufs[1]);
+#endif
 }
 
 int free_array(const struct array_aux *aux,
@@ -937,8 +1338,18 @@ struct opaque_aux {
   opaque_free_fn free;
 };
 
-int restore_opaque(const struct opaque_aux *aux, FILE *f,
-                   struct futhark_context *ctx, void *p) {
+// The server stores an opaque value as OPAQUE_MAGIC, the size of its
+// serialisation as a 64-bit little-endian integer, and then the
+// serialisation itself.  This lets us read exactly the bytes of the
+// value, even though the serialisation is not otherwise specified.
+#define OPAQUE_MAGIC "FUTHOPAQ"
+#define OPAQUE_MAGIC_SIZE 8
+
+// Files stored by older servers contain only the serialisation.
+// Unless it is empty, it starts with a 'b', so it cannot be confused
+// with the magic.
+int restore_unprefixed_opaque(const struct opaque_aux *aux, FILE *f,
+                              struct futhark_context *ctx, void *p) {
   // We have a problem: we need to load data from 'f', since the
   // restore function takes a pointer, but we don't know how much we
   // need (and cannot possibly).  So we do something hacky: we read
@@ -963,13 +1374,49 @@ int restore_opaque(const struct opaque_aux *aux, FILE *f,
   }
 }
 
+int restore_opaque(const struct opaque_aux *aux, FILE *f,
+                   struct futhark_context *ctx, void *p) {
+  long start = ftell(f);
+  char magic[OPAQUE_MAGIC_SIZE];
+  if (fread(magic, 1, OPAQUE_MAGIC_SIZE, f) != OPAQUE_MAGIC_SIZE
+      || memcmp(magic, OPAQUE_MAGIC, OPAQUE_MAGIC_SIZE) != 0) {
+    fseek(f, start, SEEK_SET);
+    return restore_unprefixed_opaque(aux, f, ctx, p);
+  }
+
+  uint64_t size;
+  char *bytes = NULL;
+  if (read_le_u64(f, &size) != 0
+      || size > SIZE_MAX - 1
+      || (bytes = malloc((size_t)size + 1)) == NULL
+      || fread(bytes, 1, (size_t)size, f) != size) {
+    free(bytes);
+    fseek(f, start, SEEK_SET);
+    return 1;
+  }
+  void *obj = aux->restore(ctx, bytes);
+  free(bytes);
+  if (obj == NULL) {
+    fseek(f, start, SEEK_SET);
+    return 1;
+  }
+  *(void**)p = obj;
+  return 0;
+}
+
+// Opaque values have their own serialisation, so they are never
+// compressed.
 void store_opaque(const struct opaque_aux *aux, FILE *f,
-                  struct futhark_context *ctx, void *p) {
+                  struct futhark_context *ctx, void *p,
+                  int write_binary) {
+  (void)write_binary;
   void *obj = *(void**)p;
   size_t obj_size;
   void *data = NULL;
   (void)aux->store(ctx, obj, &data, &obj_size);
   assert(futhark_context_sync(ctx) == 0);
+  fwrite(OPAQUE_MAGIC, 1, OPAQUE_MAGIC_SIZE, f);
+  write_le_u64(f, obj_size);
   fwrite(data, sizeof(char), obj_size, f);
   free(data);
 }
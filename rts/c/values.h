@@ -2,7 +2,7 @@
 
 //// Text I/O
 
-typedef int (*writer)(FILE*, const void*);
+typedef int (*str_formatter)(char*, const void*);
 typedef int (*bin_reader)(void*);
 typedef int (*str_reader)(const char *, void*);
 
@@ -15,10 +15,18 @@ struct array_reader {
   str_reader elem_reader;
 };
 
+// getc() locks the stream for every character, which dominates the
+// cost of reading large textual values.
+#ifdef _WIN32
+#define values_getc(f) _getc_nolock(f)
+#else
+#define values_getc(f) getc_unlocked(f)
+#endif
+
 static void skipspaces(FILE *f) {
   int c;
   do {
-    c = getc(f);
+    c = values_getc(f);
   } while (isspace(c));
 
   if (c != EOF) {
@@ -26,18 +34,27 @@ static void skipspaces(FILE *f) {
   }
 }
 
+// Not using isalnum(), which is locale-dependent and much slower.
 static int constituent(char c) {
-  return isalnum(c) || c == '.' || c == '-' || c == '+' || c == '_';
+  return (c >= '0' && c <= '9') || ((c|32) >= 'a' && (c|32) <= 'z')
+    || c == '.' || c == '-' || c == '+' || c == '_';
 }
 
 // Produces an empty token only on EOF.
 static void next_token(FILE *f, char *buf, int bufsize) {
+  int c;
  start:
-  skipspaces(f);
+  // Like skipspaces(), but without putting back the first character,
+  // as ungetc() is relatively expensive.
+  do {
+    c = values_getc(f);
+  } while (isspace(c));
 
   int i = 0;
   while (i < bufsize) {
-    int c = getc(f);
+    if (i > 0) {
+      c = values_getc(f);
+    }
     buf[i] = (char)c;
 
     if (c == EOF) {
@@ -45,7 +62,7 @@ static void next_token(FILE *f, char *buf, int bufsize) {
       return;
     } else if (c == '-' && i == 1 && buf[0] == '-') {
       // Line comment, so skip to end of line and start over.
-      for (; c != '\n' && c != EOF; c = getc(f));
+      for (; c != '\n' && c != EOF; c = values_getc(f));
       goto start;
     } else if (!constituent((char)c)) {
       if (i == 0) {
@@ -110,10 +127,12 @@ static int read_str_array_elems(FILE *f,
   int cur_dim = (int)dims-1;
   int64_t *elems_read_in_dim = (int64_t*) calloc((size_t)dims, sizeof(int64_t));
 
+  // The tokens are compared by hand, as this loop runs for every
+  // element.
   while (1) {
     next_token(f, buf, bufsize);
 
-    if (strcmp(buf, "]") == 0) {
+    if (buf[0] == ']' && buf[1] == 0) {
       if (knows_dimsize[cur_dim]) {
         if (reader->shape[cur_dim] != elems_read_in_dim[cur_dim]) {
           ret = 1;
@@ -130,9 +149,9 @@ static int read_str_array_elems(FILE *f,
         cur_dim--;
         elems_read_in_dim[cur_dim]++;
       }
-    } else if (strcmp(buf, ",") == 0) {
+    } else if (buf[0] == ',' && buf[1] == 0) {
       next_token(f, buf, bufsize);
-      if (strcmp(buf, "[") == 0) {
+      if (buf[0] == '[' && buf[1] == 0) {
         if (cur_dim == dims - 1) {
           ret = 1;
           break;
@@ -150,12 +169,12 @@ static int read_str_array_elems(FILE *f,
         ret = 1;
         break;
       }
-    } else if (strlen(buf) == 0) {
+    } else if (buf[0] == 0) {
       // EOF
       ret = 1;
       break;
     } else if (first) {
-      if (strcmp(buf, "[") == 0) {
+      if (buf[0] == '[' && buf[1] == 0) {
         if (cur_dim == dims - 1) {
           ret = 1;
           break;
@@ -269,128 +288,356 @@ static int read_str_array(FILE *f,
   return ret;
 }
 
-#define READ_STR(MACRO, PTR, SUFFIX)                                   \
-  remove_underscores(buf);                                              \
-  int j;                                                                \
-  if (sscanf(buf, "%"MACRO"%n", (PTR*)dest, &j) == 1) {                 \
-    return !(strcmp(buf+j, "") == 0 || strcmp(buf+j, SUFFIX) == 0);     \
-  } else {                                                              \
-    return 1;                                                           \
+// The element readers below parse the literals themselves rather than
+// using sscanf(), which is many times slower.  Underscores are
+// permitted between digits, as in Futhark.
+
+// Parse an integer literal without its suffix: an optional sign
+// followed by decimal digits, or hexadecimal or binary digits with a
+// 0x or 0b prefix.  The result wraps around on overflow.  Returns a
+// pointer past the literal, or NULL if there is none.
+static const char* parse_int_literal(const char *p, uint64_t *out) {
+  int neg = 0;
+  if (*p == '-') {
+    neg = 1;
+    p++;
+  } else if (*p == '+') {
+    p++;
   }
 
-static int read_str_i8(char *buf, void* dest) {
-  // Some platforms (WINDOWS) does not support scanf %hhd or its
-  // cousin, %SCNi8.  Read into int first to avoid corrupting
-  // memory.
-  //
-  // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=63417
-  remove_underscores(buf);
-  int j, x;
-  if (sscanf(buf, "%i%n", &x, &j) == 1) {
-    *(int8_t*)dest = (int8_t)x;
-    return !(strcmp(buf+j, "") == 0 || strcmp(buf+j, "i8") == 0);
-  } else {
-    return 1;
+  unsigned base = 10;
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    base = 16;
+    p += 2;
+  } else if (p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+    base = 2;
+    p += 2;
+  }
+
+  uint64_t x = 0;
+  int any = 0;
+  for (;; p++) {
+    unsigned d;
+    char c = *p;
+    if (c >= '0' && c <= '9') {
+      d = (unsigned)(c - '0');
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      d = (unsigned)(c - 'a' + 10);
+    } else if (base == 16 && c >= 'A' && c <= 'F') {
+      d = (unsigned)(c - 'A' + 10);
+    } else if (c == '_' && any) {
+      continue;
+    } else {
+      break;
+    }
+    if (d >= base) {
+      return NULL;
+    }
+    x = x * base + d;
+    any = 1;
   }
+
+  if (!any) {
+    return NULL;
+  }
+  *out = neg ? (uint64_t)0 - x : x;
+  return p;
 }
 
-static int read_str_u8(char *buf, void* dest) {
-  // Some platforms (WINDOWS) does not support scanf %hhd or its
-  // cousin, %SCNu8.  Read into int first to avoid corrupting
-  // memory.
-  //
-  // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=63417
-  remove_underscores(buf);
-  int j, x;
-  if (sscanf(buf, "%i%n", &x, &j) == 1) {
-    *(uint8_t*)dest = (uint8_t)x;
-    return !(strcmp(buf+j, "") == 0 || strcmp(buf+j, "u8") == 0);
-  } else {
+static int read_str_int(const char *buf, void *dest, int size, const char *suffix) {
+  uint64_t x;
+  const char *p = parse_int_literal(buf, &x);
+  if (p == NULL || !(*p == 0 || strcmp(p, suffix) == 0)) {
     return 1;
   }
+  switch (size) {
+  case 1: *(uint8_t*)dest = (uint8_t)x; break;
+  case 2: *(uint16_t*)dest = (uint16_t)x; break;
+  case 4: *(uint32_t*)dest = (uint32_t)x; break;
+  default: *(uint64_t*)dest = x; break;
+  }
+  return 0;
+}
+
+static int read_str_i8(char *buf, void* dest) {
+  return read_str_int(buf, dest, 1, "i8");
+}
+
+static int read_str_u8(char *buf, void* dest) {
+  return read_str_int(buf, dest, 1, "u8");
 }
 
 static int read_str_i16(char *buf, void* dest) {
-  READ_STR(SCNi16, int16_t, "i16");
+  return read_str_int(buf, dest, 2, "i16");
 }
 
 static int read_str_u16(char *buf, void* dest) {
-  READ_STR(SCNi16, int16_t, "u16");
+  return read_str_int(buf, dest, 2, "u16");
 }
 
 static int read_str_i32(char *buf, void* dest) {
-  READ_STR(SCNi32, int32_t, "i32");
+  return read_str_int(buf, dest, 4, "i32");
 }
 
 static int read_str_u32(char *buf, void* dest) {
-  READ_STR(SCNi32, int32_t, "u32");
+  return read_str_int(buf, dest, 4, "u32");
 }
 
 static int read_str_i64(char *buf, void* dest) {
-  READ_STR(SCNi64, int64_t, "i64");
+  return read_str_int(buf, dest, 8, "i64");
 }
 
 static int read_str_u64(char *buf, void* dest) {
-  // FIXME: This is not correct, as SCNu64 only permits decimal
-  // literals.  However, SCNi64 does not handle very large numbers
-  // correctly (it's really for signed numbers, so that's fair).
-  READ_STR(SCNu64, uint64_t, "u64");
+  return read_str_int(buf, dest, 8, "u64");
 }
 
-static int read_str_f16(char *buf, void* dest) {
-  remove_underscores(buf);
-  if (strcmp(buf, "f16.nan") == 0) {
-    *(uint16_t*)dest = float2halfbits(NAN);
-    return 0;
-  } else if (strcmp(buf, "f16.inf") == 0) {
-    *(uint16_t*)dest = float2halfbits(INFINITY);
-    return 0;
-  } else if (strcmp(buf, "-f16.inf") == 0) {
-    *(uint16_t*)dest = float2halfbits(-INFINITY);
-    return 0;
-  } else {
-    int j;
-    float x;
-    if (sscanf(buf, "%f%n", &x, &j) == 1) {
-      if (strcmp(buf+j, "") == 0 || strcmp(buf+j, "f16") == 0) {
-        *(uint16_t*)dest = float2halfbits(x);
-        return 0;
+// Parse a decimal number with optional fraction and exponent into a
+// mantissa and a power of ten.  Returns a pointer past the number, or
+// NULL if the number is not of this form or has too many significant
+// digits, in which case the caller should use the C library instead.
+static const char* parse_decimal(const char *p, int *neg, uint64_t *m, int *e) {
+  *neg = 0;
+  if (*p == '-') {
+    *neg = 1;
+    p++;
+  } else if (*p == '+') {
+    p++;
+  }
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    return NULL;
+  }
+
+  uint64_t x = 0;
+  int digits = 0, exp = 0, any = 0, frac = 0;
+  for (;; p++) {
+    char c = *p;
+    if (c >= '0' && c <= '9') {
+      if (x != 0 || c != '0') {
+        if (++digits > 19) {
+          return NULL;
+        }
+        x = x * 10 + (uint64_t)(c - '0');
+      }
+      exp -= frac;
+      any = 1;
+    } else if (c == '.' && !frac) {
+      frac = 1;
+    } else if (c == '_' && any) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  if (!any) {
+    return NULL;
+  }
+
+  if (*p == 'e' || *p == 'E') {
+    p++;
+    int eneg = 0;
+    if (*p == '-') {
+      eneg = 1;
+      p++;
+    } else if (*p == '+') {
+      p++;
+    }
+    if (!(*p >= '0' && *p <= '9')) {
+      return NULL;
+    }
+    int ex = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+      if (ex < 10000) {
+        ex = ex * 10 + (*p - '0');
       }
     }
-    return 1;
+    exp += eneg ? -ex : ex;
   }
+
+  *m = x;
+  *e = exp;
+  return p;
 }
 
-static int read_str_f32(char *buf, void* dest) {
-  remove_underscores(buf);
-  if (strcmp(buf, "f32.nan") == 0) {
-    *(float*)dest = (float)NAN;
-    return 0;
-  } else if (strcmp(buf, "f32.inf") == 0) {
-    *(float*)dest = (float)INFINITY;
+// A number of at most 2^53 and a power of ten of at most 1e22 are
+// both exact in double precision, so a single correctly rounded
+// multiplication or division gives the correctly rounded result.
+// Everything else is left to strtod()/strtof().  This relies on the
+// arithmetic not being done in higher precision.
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define FAST_FLOAT_PARSING 1
+#else
+#define FAST_FLOAT_PARSING 0
+#endif
+
+static const double exact_powers_of_ten_f64[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Numbers printed with all significant digits have too many for the
+// above.  Where long double is x87 extended precision (and the FPU
+// is not configured to round to double precision, as it is on some
+// BSDs), every mantissa of parse_decimal() and powers of ten up to
+// 1e27 are exact, so we can do the same there.  Rounding twice is
+// then only wrong if the intermediate result lies exactly halfway
+// between two doubles, which we check for.
+#if FAST_FLOAT_PARSING && LDBL_MANT_DIG == 64 \
+  && (defined(__linux__) || defined(__APPLE__))
+#define FAST_FLOAT_PARSING_EXTENDED 1
+static const long double exact_powers_of_ten_extended[] = {
+  1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L,
+  1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+  1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+#else
+#define FAST_FLOAT_PARSING_EXTENDED 0
+#endif
+
+// Is the token "T.nan", "T.inf" or "-T.inf", where T is the name of a
+// floating-point type?
+static int read_str_float_special(const char *buf, const char *type_name, double *x) {
+  const char *p = buf[0] == '-' ? buf+1 : buf;
+  if (p[0] != 'f') {
     return 0;
-  } else if (strcmp(buf, "-f32.inf") == 0) {
-    *(float*)dest = (float)-INFINITY;
+  }
+  size_t n = strlen(type_name);
+  if (strncmp(p, type_name, n) != 0) {
     return 0;
-  } else {
-    READ_STR("f", float, "f32");
   }
+  if (p == buf && strcmp(p+n, ".nan") == 0) {
+    *x = (double)NAN;
+    return 1;
+  } else if (strcmp(p+n, ".inf") == 0) {
+    *x = p == buf ? (double)INFINITY : (double)-INFINITY;
+    return 1;
+  }
+  return 0;
+}
+
+// Check that 'p' is the end of the token, or the given suffix.
+static int read_str_suffix_ok(const char *p, const char *suffix) {
+  return *p == 0 || strcmp(p, suffix) == 0;
+}
+
+// Returns a pointer past the number if it could be parsed exactly,
+// and otherwise NULL.
+static const char* parse_decimal_f64(const char *buf, double *out) {
+  int neg, e;
+  uint64_t m;
+  const char *p = parse_decimal(buf, &neg, &m, &e);
+  if (!FAST_FLOAT_PARSING || p == NULL) {
+    return NULL;
+  }
+  if (m <= (1ULL<<53) && e >= -22 && e <= 22) {
+    double x = (double)m;
+    x = e < 0 ? x / exact_powers_of_ten_f64[-e] : x * exact_powers_of_ten_f64[e];
+    *out = neg ? -x : x;
+    return p;
+  }
+#if FAST_FLOAT_PARSING_EXTENDED
+  if (m != 0 && e >= -27 && e <= 27) {
+    long double x = (long double)m;
+    x = e < 0 ? x / exact_powers_of_ten_extended[-e] : x * exact_powers_of_ten_extended[e];
+    int ex;
+    uint64_t bits = (uint64_t)ldexpl(frexpl(x, &ex), 64);
+    if ((bits & 0x7FF) != 0x400) {
+      *out = (double)(neg ? -x : x);
+      return p;
+    }
+  }
+#endif
+  return NULL;
 }
 
 static int read_str_f64(char *buf, void* dest) {
-  remove_underscores(buf);
-  if (strcmp(buf, "f64.nan") == 0) {
-    *(double*)dest = (double)NAN;
+  double x;
+  if (read_str_float_special(buf, "f64", &x)) {
+    *(double*)dest = x;
     return 0;
-  } else if (strcmp(buf, "f64.inf") == 0) {
-    *(double*)dest = (double)INFINITY;
+  }
+
+  const char *p = parse_decimal_f64(buf, &x);
+  if (p != NULL) {
+    if (!read_str_suffix_ok(p, "f64")) {
+      return 1;
+    }
+    *(double*)dest = x;
     return 0;
-  } else if (strcmp(buf, "-f64.inf") == 0) {
-    *(double*)dest = (double)-INFINITY;
+  }
+
+  remove_underscores(buf);
+  char *end;
+  x = strtod(buf, &end);
+  if (end == buf || !read_str_suffix_ok(end, "f64")) {
+    return 1;
+  }
+  *(double*)dest = x;
+  return 0;
+}
+
+// Also used for f16, hence the type name and suffix as arguments.
+static int read_str_f32_like(char *buf, float *dest, const char *type_name) {
+  double special;
+  if (read_str_float_special(buf, type_name, &special)) {
+    *dest = (float)special;
     return 0;
-  } else {
-    READ_STR("lf", double, "f64");
   }
+
+  // Rounding first to double and then to single precision gives the
+  // correctly rounded result, unless the double lies exactly halfway
+  // between two floats.  All numbers parsed by parse_decimal_f64()
+  // are in the range of normal floats.
+  double d;
+  const char *p = parse_decimal_f64(buf, &d);
+  if (p != NULL) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if (d == 0 || (bits & ((1ULL<<29)-1)) != (1ULL<<28)) {
+      if (!read_str_suffix_ok(p, type_name)) {
+        return 1;
+      }
+      *dest = (float)d;
+      return 0;
+    }
+  }
+
+  remove_underscores(buf);
+  char *end;
+  float x = strtof(buf, &end);
+  if (end == buf || !read_str_suffix_ok(end, type_name)) {
+    return 1;
+  }
+  *dest = x;
+  return 0;
+}
+
+// float2halfbits() truncates, but reading a number should give the
+// nearest f16, as otherwise f16 values do not survive being printed
+// and read back.
+static uint16_t float2halfbits_nearest(float x) {
+  uint16_t h = float2halfbits(x);
+  if ((h & 0x7FFF) < 0x7C00) {
+    float ax = fabsf(x);
+    float below = fabsf(halfbits2float(h));
+    float above = (h & 0x7FFF) == 0x7BFF ? 65536.0f : fabsf(halfbits2float(h+1));
+    if (ax - below > above - ax || (ax - below == above - ax && (h & 1))) {
+      h++;
+    }
+  }
+  return h;
+}
+
+static int read_str_f16(char *buf, void* dest) {
+  float x;
+  if (read_str_f32_like(buf, &x, "f16") != 0) {
+    return 1;
+  }
+  *(uint16_t*)dest = float2halfbits_nearest(x);
+  return 0;
+}
+
+static int read_str_f32(char *buf, void* dest) {
+  return read_str_f32_like(buf, (float*)dest, "f32");
 }
 
 static int read_str_bool(char *buf, void* dest) {
@@ -405,84 +652,396 @@ static int read_str_bool(char *buf, void* dest) {
   }
 }
 
-static int write_str_i8(FILE *out, int8_t *src) {
-  return fprintf(out, "%hhdi8", *src);
+// Values are formatted into a buffer by hand, rather than with
+// fprintf(), which otherwise dominates the cost of writing large
+// arrays.
+
+// Room for any single formatted value.
+#define STR_VALUE_MAX_LEN 64
+
+static const char decimal_digit_pairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// Write the decimal digits of x to buf and return their number.
+static int format_digits(char *buf, uint64_t x) {
+  char tmp[20];
+  int i = 20;
+  while (x >= 100) {
+    uint64_t q = x / 100;
+    i -= 2;
+    memcpy(tmp+i, decimal_digit_pairs + 2 * (x - q * 100), 2);
+    x = q;
+  }
+  if (x >= 10) {
+    i -= 2;
+    memcpy(tmp+i, decimal_digit_pairs + 2 * x, 2);
+  } else {
+    tmp[--i] = (char)('0' + x);
+  }
+  memcpy(buf, tmp+i, (size_t)(20-i));
+  return 20-i;
+}
+
+static int format_suffix(char *buf, const char *suffix) {
+  int n = 0;
+  for (; suffix[n] != 0; n++) {
+    buf[n] = suffix[n];
+  }
+  return n;
 }
 
-static int write_str_u8(FILE *out, uint8_t *src) {
-  return fprintf(out, "%hhuu8", *src);
+static int format_int(char *buf, int64_t x, const char *suffix) {
+  int n = 0;
+  uint64_t u = (uint64_t)x;
+  if (x < 0) {
+    buf[n++] = '-';
+    u = 0 - u;
+  }
+  n += format_digits(buf+n, u);
+  return n + format_suffix(buf+n, suffix);
 }
 
-static int write_str_i16(FILE *out, int16_t *src) {
-  return fprintf(out, "%hdi16", *src);
+static int format_uint(char *buf, uint64_t x, const char *suffix) {
+  int n = format_digits(buf, x);
+  return n + format_suffix(buf+n, suffix);
 }
 
-static int write_str_u16(FILE *out, uint16_t *src) {
-  return fprintf(out, "%huu16", *src);
+static int format_str_i8(char *buf, const void *src) {
+  return format_int(buf, *(const int8_t*)src, "i8");
 }
 
-static int write_str_i32(FILE *out, int32_t *src) {
-  return fprintf(out, "%di32", *src);
+static int format_str_i16(char *buf, const void *src) {
+  return format_int(buf, *(const int16_t*)src, "i16");
 }
 
-static int write_str_u32(FILE *out, uint32_t *src) {
-  return fprintf(out, "%uu32", *src);
+static int format_str_i32(char *buf, const void *src) {
+  return format_int(buf, *(const int32_t*)src, "i32");
 }
 
-static int write_str_i64(FILE *out, int64_t *src) {
-  return fprintf(out, "%"PRIi64"i64", *src);
+static int format_str_i64(char *buf, const void *src) {
+  return format_int(buf, *(const int64_t*)src, "i64");
 }
 
-static int write_str_u64(FILE *out, uint64_t *src) {
-  return fprintf(out, "%"PRIu64"u64", *src);
+static int format_str_u8(char *buf, const void *src) {
+  return format_uint(buf, *(const uint8_t*)src, "u8");
 }
 
-static int write_str_f16(FILE *out, uint16_t *src) {
-  float x = halfbits2float(*src);
-  if (isnan(x)) {
-    return fprintf(out, "f16.nan");
-  } else if (isinf(x) && x >= 0) {
-    return fprintf(out, "f16.inf");
-  } else if (isinf(x)) {
-    return fprintf(out, "-f16.inf");
+static int format_str_u16(char *buf, const void *src) {
+  return format_uint(buf, *(const uint16_t*)src, "u16");
+}
+
+static int format_str_u32(char *buf, const void *src) {
+  return format_uint(buf, *(const uint32_t*)src, "u32");
+}
+
+static int format_str_u64(char *buf, const void *src) {
+  return format_uint(buf, *(const uint64_t*)src, "u64");
+}
+
+// Floats are printed with the fewest significant digits that read
+// back as the same value, found as in Ryu (Adams, PLDI 2018): the
+// float and the bounds of the interval of numbers that round to it
+// are scaled by a power of ten that makes the interval a few units
+// wide, and digits are then removed for as long as the interval
+// still contains a number with fewer digits.  Ryu uses tables of
+// powers of five to scale approximately with 64-bit arithmetic.
+// Here we scale exactly with 128-bit arithmetic, which works for all
+// f16 values, nearly all f32 values, and f64 values between roughly
+// 1e-15 and 1e46.  Other values are left to snprintf().
+
+static const uint64_t powers_of_five[] = {
+  1ULL, 5ULL, 25ULL, 125ULL, 625ULL, 3125ULL, 15625ULL, 78125ULL,
+  390625ULL, 1953125ULL, 9765625ULL, 48828125ULL, 244140625ULL,
+  1220703125ULL, 6103515625ULL, 30517578125ULL, 152587890625ULL,
+  762939453125ULL, 3814697265625ULL, 19073486328125ULL,
+  95367431640625ULL, 476837158203125ULL, 2384185791015625ULL,
+  11920928955078125ULL, 59604644775390625ULL, 298023223876953125ULL,
+  1490116119384765625ULL, 7450580596923828125ULL
+};
+
+// 5^k for k <= 54.
+static __uint128_t pow5_128(int k) {
+  if (k < 28) {
+    return powers_of_five[k];
   } else {
-    return fprintf(out, "%.*ff16", FLT_DIG, x);
+    return (__uint128_t)powers_of_five[27] * powers_of_five[k-27];
   }
 }
 
-static int write_str_f32(FILE *out, float *src) {
-  float x = *src;
-  if (isnan(x)) {
-    return fprintf(out, "f32.nan");
-  } else if (isinf(x) && x >= 0) {
-    return fprintf(out, "f32.inf");
-  } else if (isinf(x)) {
-    return fprintf(out, "-f32.inf");
+// Number of bits in 5^k, for 0 <= k <= 3528.
+static int pow5_bits(int k) {
+  return (int)(((uint32_t)k * 1217359) >> 19) + 1;
+}
+
+// floor(k * log10(2)), for 0 <= k <= 1650.
+static int log10_pow2(int k) {
+  return (int)(((uint32_t)k * 78913) >> 18);
+}
+
+// Store floor(x * 2^e / 10^q) in *out and return whether the
+// division was exact.  The caller checks that this fits.
+static int scale_exact(uint64_t x, int e, int q, uint64_t *out) {
+  __uint128_t r;
+  int exact;
+  if (e >= 0) {
+    __uint128_t n = (__uint128_t)x << (e - q);
+    __uint128_t d = pow5_128(q);
+    r = n / d;
+    exact = r * d == n;
   } else {
-    return fprintf(out, "%.*ff32", FLT_DIG, x);
+    __uint128_t n = (__uint128_t)x * pow5_128(-q);
+    int s = q - e;
+    if (s >= 0) {
+      r = n >> s;
+      exact = (r << s) == n;
+    } else {
+      r = n << -s;
+      exact = 1;
+    }
   }
+  *out = (uint64_t)r;
+  return exact;
 }
 
-static int write_str_f64(FILE *out, double *src) {
-  double x = *src;
-  if (isnan(x)) {
-    return fprintf(out, "f64.nan");
-  } else if (isinf(x) && x >= 0) {
-    return fprintf(out, "f64.inf");
-  } else if (isinf(x)) {
-    return fprintf(out, "-f64.inf");
+// Find the shortest digits*10^exp10 that rounds to m2*2^e2, where m2
+// has at most mant_bits+1 bits.  'tight_below' is set if the float
+// below is closer than the float above, which is the case for powers
+// of two.  Returns 0 if the float is out of range of scale_exact().
+static int shortest_decimal(uint64_t m2, int e2, int tight_below, int mant_bits,
+                            uint64_t *digits, int *exp10) {
+  // Work with four times the mantissa, such that the bounds of the
+  // interval are integers.  The bounds themselves are included only
+  // when the mantissa is even, as they round to it then.
+  int accept_bounds = m2 % 2 == 0;
+  uint64_t mv = 4 * m2, mp = mv + 2, mm = mv - (tight_below ? 1 : 2);
+  int e = e2 - 2;
+
+  // Choose q such that 2^e / 10^q is between 10 and 100.  The scaled
+  // interval is then wide enough that at least one digit is removed,
+  // which the rounding below relies on.  The exception is small
+  // integers, which are scaled exactly with q = 0.
+  int q;
+  if (e >= 0) {
+    q = log10_pow2(e) > 0 ? log10_pow2(e) - 1 : 0;
+    if (q > 54 || mant_bits + 3 + e - q > 128) {
+      return 0;
+    }
+  } else {
+    q = -log10_pow2(-e) - 2;
+    if (-q > 54 || mant_bits + 3 + pow5_bits(-q) + (e > q ? e - q : 0) > 128
+        || q - e >= 128) {
+      return 0;
+    }
+  }
+
+  uint64_t vr, vp, vm;
+  int vr_zeros = scale_exact(mv, e, q, &vr);
+  int vp_exact = scale_exact(mp, e, q, &vp);
+  int vm_zeros = scale_exact(mm, e, q, &vm) && accept_bounds;
+  if (vp_exact && !accept_bounds) {
+    vp--;
+  }
+
+  // vr_zeros: whether the digits removed from vr so far were all zero.
+  // vm_zeros: whether vm is exactly the lower bound and may be used.
+  int last = 0, removed = 0;
+  // Two digits at a time first, which is most of them.
+  while (vp / 100 > vm / 100) {
+    vm_zeros &= vm % 100 == 0;
+    vr_zeros &= last == 0 && vr % 10 == 0;
+    last = (int)(vr % 100 / 10);
+    vr /= 100;
+    vp /= 100;
+    vm /= 100;
+    removed += 2;
+  }
+  while (vp / 10 > vm / 10) {
+    vm_zeros &= vm % 10 == 0;
+    vr_zeros &= last == 0;
+    last = (int)(vr % 10);
+    vr /= 10;
+    vp /= 10;
+    vm /= 10;
+    removed++;
+  }
+  if (vm_zeros) {
+    while (vm % 10 == 0) {
+      vr_zeros &= last == 0;
+      last = (int)(vr % 10);
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+  }
+  if (vr_zeros && last == 5 && vr % 2 == 0) {
+    last = 4; // Round half to even.
+  }
+  *digits = vr + ((vr == vm && !vm_zeros) || last >= 5);
+  *exp10 = q + removed;
+  return 1;
+}
+
+static int reads_back_as(const char *s, double x, int is_f64) {
+  return is_f64 ? strtod(s, NULL) == x : strtof(s, NULL) == (float)x;
+}
+
+// The same for a positive x, by asking snprintf() for ever more
+// digits.  When the float below is closer than the float above, the
+// shortest decimal may not be the nearest one with as many digits,
+// but the one after it.
+static void shortest_decimal_slow(double x, int is_f64, uint64_t *digits, int *exp10) {
+  char tmp[48];
+  int neg;
+  for (int p = 1; p <= 17; p++) {
+    snprintf(tmp, sizeof(tmp), "%.*e", p-1, x);
+    (void)parse_decimal(tmp, &neg, digits, exp10);
+    if (reads_back_as(tmp, x, is_f64)) {
+      return;
+    }
+    snprintf(tmp, sizeof(tmp), "%"PRIu64"e%d", *digits + 1, *exp10);
+    if (reads_back_as(tmp, x, is_f64)) {
+      *digits += 1;
+      return;
+    }
+  }
+}
+
+// Format digits*10^exp10 in fixed notation if it is of moderate
+// magnitude, and otherwise in scientific notation.  Fixed notation
+// is padded with zeroes to at least frac_digits fractional digits, as
+// floats used to be printed with exactly that many, such that numbers
+// like 1.5 are printed as before.
+static int format_decimal(char *buf, uint64_t digits, int exp10, int frac_digits) {
+  char ds[20];
+  int n;
+  if (digits == 0) {
+    ds[0] = '0';
+    n = 1;
+    exp10 = 0;
   } else {
-    return fprintf(out, "%.*ff64", DBL_DIG, x);
+    while (digits % 10 == 0) {
+      digits /= 10;
+      exp10++;
+    }
+    n = format_digits(ds, digits);
+  }
+
+  // Number of digits before the decimal point.
+  int point = n + exp10;
+  int len = 0;
+  if (point >= -5 && point <= 21) {
+    int frac;
+    if (point <= 0) {
+      buf[len++] = '0';
+      buf[len++] = '.';
+      memset(buf+len, '0', (size_t)-point);
+      len += -point;
+      memcpy(buf+len, ds, (size_t)n);
+      len += n;
+      frac = n - point;
+    } else if (point >= n) {
+      memcpy(buf+len, ds, (size_t)n);
+      len += n;
+      memset(buf+len, '0', (size_t)(point-n));
+      len += point-n;
+      buf[len++] = '.';
+      frac = 0;
+    } else {
+      memcpy(buf+len, ds, (size_t)point);
+      len += point;
+      buf[len++] = '.';
+      memcpy(buf+len, ds+point, (size_t)(n-point));
+      len += n-point;
+      frac = n - point;
+    }
+    if (frac < frac_digits) {
+      memset(buf+len, '0', (size_t)(frac_digits-frac));
+      len += frac_digits-frac;
+    }
+  } else {
+    buf[len++] = ds[0];
+    buf[len++] = '.';
+    if (n == 1) {
+      buf[len++] = '0';
+    } else {
+      memcpy(buf+len, ds+1, (size_t)(n-1));
+      len += n-1;
+    }
+    buf[len++] = 'e';
+    len += format_int(buf+len, point-1, "");
+  }
+  return len;
+}
+
+// Format a float with the given encoding, which is also available
+// as the double x.
+static int format_float(char *buf, uint64_t bits, int mant_bits, int exp_bits,
+                        double x, const char *type_name, int frac_digits) {
+  int len = 0;
+  if (isnan(x)) {
+    len += format_suffix(buf, type_name);
+    return len + format_suffix(buf+len, ".nan");
+  }
+  if (bits >> (mant_bits + exp_bits)) {
+    buf[len++] = '-';
+  }
+  if (isinf(x)) {
+    len += format_suffix(buf+len, type_name);
+    return len + format_suffix(buf+len, ".inf");
   }
+
+  uint64_t ieee_mant = bits & ((1ULL << mant_bits) - 1);
+  int ieee_exp = (int)((bits >> mant_bits) & ((1ULL << exp_bits) - 1));
+  int bias = (1 << (exp_bits - 1)) - 1;
+  uint64_t digits = 0;
+  int exp10 = 0;
+  if (ieee_exp != 0 || ieee_mant != 0) {
+    uint64_t m2 = ieee_exp == 0 ? ieee_mant : ieee_mant | (1ULL << mant_bits);
+    int e2 = (ieee_exp == 0 ? 1 : ieee_exp) - bias - mant_bits;
+    if (!shortest_decimal(m2, e2, ieee_mant == 0 && ieee_exp > 1, mant_bits,
+                          &digits, &exp10)) {
+      shortest_decimal_slow(fabs(x), mant_bits == 52, &digits, &exp10);
+    }
+  }
+  len += format_decimal(buf+len, digits, exp10, frac_digits);
+  return len + format_suffix(buf+len, type_name);
 }
 
-static int write_str_bool(FILE *out, void *src) {
-  return fprintf(out, *(char*)src ? "true" : "false");
+static int format_str_f16(char *buf, const void *src) {
+  uint16_t bits = *(const uint16_t*)src;
+  return format_float(buf, bits, 10, 5, halfbits2float(bits), "f16", FLT_DIG);
+}
+
+static int format_str_f32(char *buf, const void *src) {
+  uint32_t bits;
+  memcpy(&bits, src, sizeof(bits));
+  return format_float(buf, bits, 23, 8, *(const float*)src, "f32", FLT_DIG);
+}
+
+static int format_str_f64(char *buf, const void *src) {
+  uint64_t bits;
+  memcpy(&bits, src, sizeof(bits));
+  return format_float(buf, bits, 52, 11, *(const double*)src, "f64", DBL_DIG);
+}
+
+static int format_str_bool(char *buf, const void *src) {
+  return format_suffix(buf, *(const char*)src ? "true" : "false");
 }
 
 //// Binary I/O
 
+// The version we write by default.  We can also read
+// INDEXED_FORMAT_VERSION and write and read COMPRESSED_FORMAT_VERSION;
+// see further below.
 #define BINARY_FORMAT_VERSION 2
+#define INDEXED_FORMAT_VERSION 3
+#define COMPRESSED_FORMAT_VERSION 4
+#define INDEXED_INDEX_MARKER 255 // In place of the rank.
 #define IS_BIG_ENDIAN (!*(unsigned char *)&(uint16_t){1})
 
 static void flip_bytes(size_t elem_size, unsigned char *elem) {
@@ -519,46 +1078,46 @@ struct primtype_info_t {
   const char binname[4]; // Used for parsing binary data.
   const char* type_name; // Same name as in Futhark.
   const int64_t size; // in bytes
-  const writer write_str; // Write in text format.
+  const str_formatter format_str; // Format as text.
   const str_reader read_str; // Read in text format.
 };
 
 static const struct primtype_info_t i8_info =
   {.binname = "  i8", .type_name = "i8",   .size = 1,
-   .write_str = (writer)write_str_i8, .read_str = (str_reader)read_str_i8};
+   .format_str = format_str_i8, .read_str = (str_reader)read_str_i8};
 static const struct primtype_info_t i16_info =
   {.binname = " i16", .type_name = "i16",  .size = 2,
-   .write_str = (writer)write_str_i16, .read_str = (str_reader)read_str_i16};
+   .format_str = format_str_i16, .read_str = (str_reader)read_str_i16};
 static const struct primtype_info_t i32_info =
   {.binname = " i32", .type_name = "i32",  .size = 4,
-   .write_str = (writer)write_str_i32, .read_str = (str_reader)read_str_i32};
+   .format_str = format_str_i32, .read_str = (str_reader)read_str_i32};
 static const struct primtype_info_t i64_info =
   {.binname = " i64", .type_name = "i64",  .size = 8,
-   .write_str = (writer)write_str_i64, .read_str = (str_reader)read_str_i64};
+   .format_str = format_str_i64, .read_str = (str_reader)read_str_i64};
 static const struct primtype_info_t u8_info =
   {.binname = "  u8", .type_name = "u8",   .size = 1,
-   .write_str = (writer)write_str_u8, .read_str = (str_reader)read_str_u8};
+   .format_str = format_str_u8, .read_str = (str_reader)read_str_u8};
 static const struct primtype_info_t u16_info =
   {.binname = " u16", .type_name = "u16",  .size = 2,
-   .write_str = (writer)write_str_u16, .read_str = (str_reader)read_str_u16};
+   .format_str = format_str_u16, .read_str = (str_reader)read_str_u16};
 static const struct primtype_info_t u32_info =
   {.binname = " u32", .type_name = "u32",  .size = 4,
-   .write_str = (writer)write_str_u32, .read_str = (str_reader)read_str_u32};
+   .format_str = format_str_u32, .read_str = (str_reader)read_str_u32};
 static const struct primtype_info_t u64_info =
   {.binname = " u64", .type_name = "u64",  .size = 8,
-   .write_str = (writer)write_str_u64, .read_str = (str_reader)read_str_u64};
+   .format_str = format_str_u64, .read_str = (str_reader)read_str_u64};
 static const struct primtype_info_t f16_info =
   {.binname = " f16", .type_name = "f16",  .size = 2,
-   .write_str = (writer)write_str_f16, .read_str = (str_reader)read_str_f16};
+   .format_str = format_str_f16, .read_str = (str_reader)read_str_f16};
 static const struct primtype_info_t f32_info =
   {.binname = " f32", .type_name = "f32",  .size = 4,
-   .write_str = (writer)write_str_f32, .read_str = (str_reader)read_str_f32};
+   .format_str = format_str_f32, .read_str = (str_reader)read_str_f32};
 static const struct primtype_info_t f64_info =
   {.binname = " f64", .type_name = "f64",  .size = 8,
-   .write_str = (writer)write_str_f64, .read_str = (str_reader)read_str_f64};
+   .format_str = format_str_f64, .read_str = (str_reader)read_str_f64};
 static const struct primtype_info_t bool_info =
   {.binname = "bool", .type_name = "bool", .size = 1,
-   .write_str = (writer)write_str_bool, .read_str = (str_reader)read_str_bool};
+   .format_str = format_str_bool, .read_str = (str_reader)read_str_bool};
 
 static const struct primtype_info_t* primtypes[] = {
   &i8_info, &i16_info, &i32_info, &i64_info,
@@ -571,6 +1130,8 @@ static const struct primtype_info_t* primtypes[] = {
 // General value interface.  All endian business taken care of at
 // lower layers.
 
+// Returns the version of the binary format if the next value is
+// binary, and otherwise 0.
 static int read_is_binary(FILE *f) {
   skipspaces(f);
   int c = getc(f);
@@ -580,12 +1141,14 @@ static int read_is_binary(FILE *f) {
 
     if (ret != 0) { futhark_panic(1, "binary-input: could not read version.\n"); }
 
-    if (bin_version != BINARY_FORMAT_VERSION) {
-      futhark_panic(1, "binary-input: File uses version %i, but I only understand version %i.\n",
-            bin_version, BINARY_FORMAT_VERSION);
+    if (bin_version != BINARY_FORMAT_VERSION
+        && bin_version != INDEXED_FORMAT_VERSION
+        && bin_version != COMPRESSED_FORMAT_VERSION) {
+      futhark_panic(1, "binary-input: File uses version %i, but I only understand versions %i, %i, and %i.\n",
+            bin_version, BINARY_FORMAT_VERSION, INDEXED_FORMAT_VERSION, COMPRESSED_FORMAT_VERSION);
     }
 
-    return 1;
+    return bin_version;
   }
   ungetc(c, f);
   return 0;
@@ -610,7 +1173,19 @@ static const struct primtype_info_t* read_bin_read_type_enum(FILE *f) {
   return NULL;
 }
 
-static void read_bin_ensure_scalar(FILE *f, const struct primtype_info_t *expected_type) {
+// In version 3, the header of a value is followed by padding that
+// aligns the payload.
+static void read_bin_skip_padding(FILE *f, int version) {
+  if (version == INDEXED_FORMAT_VERSION) {
+    uint8_t pad;
+    unsigned char buf[256];
+    if (read_byte(f, &pad) != 0 || fread(buf, 1, pad, f) != pad) {
+      futhark_panic(1, "binary-input: Couldn't read padding.\n");
+    }
+  }
+}
+
+static void read_bin_ensure_scalar(FILE *f, int version, const struct primtype_info_t *expected_type) {
   int8_t bin_dims;
   int ret = read_byte(f, &bin_dims);
   if (ret != 0) { futhark_panic(1, "binary-input: Couldn't get dims.\n"); }
@@ -626,12 +1201,348 @@ static void read_bin_ensure_scalar(FILE *f, const struct primtype_info_t *expect
           expected_type->type_name,
           bin_type->type_name);
   }
+
+  read_bin_skip_padding(f, version);
+}
+
+//// Compressed values
+
+// In binary format version 4, the header of an array (as in version
+// 2) is followed by a codec number and a block size, after which the
+// payload is stored as a sequence of blocks.  Each block holds the
+// next block size bytes of the payload (or fewer, for the last
+// block), with the bytes of the elements shuffled into planes: first
+// the least significant byte of every element, then the next, and so
+// on.  This puts the similar high bytes of floats and small integers
+// next to each other.  The planes are then compressed with LZ4, or
+// stored as they are if that does not make them smaller.  Blocks are
+// compressed independently, so values can be written and read a block
+// at a time.  See docs/binary-data-format.rst for the details.
+
+#define COMPRESSED_CODEC_SHUFFLE_LZ4 1
+#define COMPRESSED_BLOCK_SIZE (1<<20)     // The block size we write.
+#define COMPRESSED_MAX_BLOCK_SIZE (1<<26) // The largest we read.
+
+// Passed as the write_binary argument of write_array().
+#define WRITE_BINARY_COMPRESSED 2
+
+#define LZ4_HASH_LOG 14
+#define LZ4_MIN_MATCH 4
+#define LZ4_MFLIMIT 12       // No match may start closer to the end.
+#define LZ4_LAST_LITERALS 5  // The block always ends with literals.
+#define LZ4_MAX_OFFSET 65535
+
+static int read_le_u32(FILE *f, uint32_t *x) {
+  if (fread(x, sizeof(*x), 1, f) != 1) {
+    return 1;
+  }
+  if (IS_BIG_ENDIAN) {
+    flip_bytes(sizeof(*x), (unsigned char*)x);
+  }
+  return 0;
+}
+
+static void write_le_u32(FILE *f, uint32_t x) {
+  if (IS_BIG_ENDIAN) {
+    flip_bytes(sizeof(x), (unsigned char*)&x);
+  }
+  fwrite(&x, sizeof(x), 1, f);
+}
+
+// Split n elements into byte planes, least significant byte first.
+static void shuffle_bytes(unsigned char *dst, const unsigned char *src,
+                          size_t n, size_t elem_size) {
+  for (size_t b = 0; b < elem_size; b++) {
+    size_t j = IS_BIG_ENDIAN ? elem_size-1-b : b;
+    unsigned char *plane = dst + b * n;
+    for (size_t i = 0; i < n; i++) {
+      plane[i] = src[i * elem_size + j];
+    }
+  }
+}
+
+static void unshuffle_bytes(unsigned char *dst, const unsigned char *src,
+                            size_t n, size_t elem_size) {
+  for (size_t b = 0; b < elem_size; b++) {
+    size_t j = IS_BIG_ENDIAN ? elem_size-1-b : b;
+    const unsigned char *plane = src + b * n;
+    for (size_t i = 0; i < n; i++) {
+      dst[i * elem_size + j] = plane[i];
+    }
+  }
+}
+
+static uint32_t lz4_read32(const unsigned char *p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static uint32_t lz4_hash(uint32_t x) {
+  return (x * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Decode an LZ4 block that must expand to exactly dst_len bytes.
+// Returns nonzero if the block is malformed.
+static int lz4_decompress(const unsigned char *src, size_t src_len,
+                          unsigned char *dst, size_t dst_len) {
+  const unsigned char *ip = src, *iend = src + src_len;
+  unsigned char *op = dst, *oend = dst + dst_len;
+  while (ip < iend) {
+    unsigned token = *ip++;
+
+    size_t lits = token >> 4;
+    if (lits == 15) {
+      unsigned b;
+      do {
+        if (ip == iend) {
+          return 1;
+        }
+        b = *ip++;
+        lits += b;
+      } while (b == 255);
+    }
+    if (lits > (size_t)(iend - ip) || lits > (size_t)(oend - op)) {
+      return 1;
+    }
+    // Most runs of literals are short, and a fixed-size copy is much
+    // cheaper than a variable one.  Bytes beyond the run are
+    // overwritten later.
+    if (lits <= 16 && iend - ip >= 16 && oend - op >= 16) {
+      memcpy(op, ip, 16);
+    } else {
+      memcpy(op, ip, lits);
+    }
+    ip += lits;
+    op += lits;
+
+    // The last sequence has no match.
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return 1;
+    }
+    size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return 1;
+    }
+
+    size_t len = token & 15;
+    if (len == 15) {
+      unsigned b;
+      do {
+        if (ip == iend) {
+          return 1;
+        }
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    len += LZ4_MIN_MATCH;
+    if (len > (size_t)(oend - op)) {
+      return 1;
+    }
+
+    if (offset >= 16 && (size_t)(oend - op) >= len + 16) {
+      for (size_t i = 0; i < len; i += 16) {
+        memcpy(op + i, op - offset + i, 16);
+      }
+    } else if (offset >= len) {
+      memcpy(op, op - offset, len);
+    } else {
+      // The match overlaps its own output, so it repeats the last
+      // offset bytes.  Copy those, and then keep doubling what we
+      // have copied.
+      memcpy(op, op - offset, offset);
+      size_t done = offset;
+      while (done < len) {
+        size_t n = done < len - done ? done : len - done;
+        memcpy(op + done, op, n);
+        done += n;
+      }
+    }
+    op += len;
+  }
+  return op == oend ? 0 : 1;
+}
+
+static unsigned char* lz4_put_length(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+// The largest number of bytes needed to encode a sequence.
+static size_t lz4_sequence_bound(size_t lits, size_t len) {
+  return 1 + lits/255 + 1 + lits + 2 + len/255 + 1;
+}
+
+static unsigned char* lz4_put_sequence(unsigned char *op,
+                                       const unsigned char *lits, size_t num_lits,
+                                       int has_match, size_t offset, size_t len) {
+  unsigned char *token = op++;
+  *token = (unsigned char)((num_lits >= 15 ? 15 : num_lits) << 4);
+  if (num_lits >= 15) {
+    op = lz4_put_length(op, num_lits - 15);
+  }
+  memcpy(op, lits, num_lits);
+  op += num_lits;
+  if (has_match) {
+    *op++ = (unsigned char)(offset & 255);
+    *op++ = (unsigned char)(offset >> 8);
+    len -= LZ4_MIN_MATCH;
+    *token |= (unsigned char)(len >= 15 ? 15 : len);
+    if (len >= 15) {
+      op = lz4_put_length(op, len - 15);
+    }
+  }
+  return op;
+}
+
+// Encode n bytes as an LZ4 block of at most dst_cap bytes, using
+// table (of 1<<LZ4_HASH_LOG entries) as scratch space.  This is the
+// simple greedy parse of the reference implementation's fast mode,
+// which skips ahead ever faster through data that does not compress.
+// Returns the size of the block, or 0 if it does not fit.
+static size_t lz4_compress(const unsigned char *src, size_t n,
+                           unsigned char *dst, size_t dst_cap,
+                           uint32_t *table) {
+  const unsigned char *ip = src, *anchor = src, *iend = src + n;
+  unsigned char *op = dst, *oend = dst + dst_cap;
+
+  if (n > LZ4_MFLIMIT) {
+    const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+    const unsigned char *matchlimit = iend - LZ4_LAST_LITERALS;
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+
+    while (ip < mflimit) {
+      uint32_t seq = lz4_read32(ip);
+      uint32_t h = lz4_hash(seq);
+      const unsigned char *ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+        ip += 1 + ((size_t)(ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const unsigned char *p = ip + LZ4_MIN_MATCH, *q = ref + LZ4_MIN_MATCH;
+      while (p + 8 <= matchlimit && memcmp(p, q, 8) == 0) {
+        p += 8;
+        q += 8;
+      }
+      while (p < matchlimit && *p == *q) {
+        p++;
+        q++;
+      }
+
+      size_t num_lits = (size_t)(ip - anchor), len = (size_t)(p - ip);
+      if ((size_t)(oend - op) < lz4_sequence_bound(num_lits, len)) {
+        return 0;
+      }
+      op = lz4_put_sequence(op, anchor, num_lits, 1, (size_t)(ip - ref), len);
+      ip = anchor = p;
+      if (ip < mflimit) {
+        table[lz4_hash(lz4_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+      }
+    }
+  }
+
+  size_t num_lits = (size_t)(iend - anchor);
+  if ((size_t)(oend - op) < lz4_sequence_bound(num_lits, 0)) {
+    return 0;
+  }
+  op = lz4_put_sequence(op, anchor, num_lits, 0, 0, 0);
+  return (size_t)(op - dst);
+}
+
+// Read the elem_count elements of a compressed payload into dest.
+static void read_compressed_payload(FILE *f,
+                                    const struct primtype_info_t *type,
+                                    unsigned char *dest, int64_t elem_count) {
+  uint8_t codec;
+  uint32_t block_size;
+  if (read_byte(f, &codec) != 0 || read_le_u32(f, &block_size) != 0) {
+    futhark_panic(1, "binary-input: Couldn't read compression header.\n");
+  }
+  if (codec != COMPRESSED_CODEC_SHUFFLE_LZ4) {
+    futhark_panic(1, "binary-input: Unknown compression codec %i.\n", (int)codec);
+  }
+  size_t elem_size = (size_t)type->size;
+  if (block_size == 0 || block_size % elem_size != 0
+      || block_size > COMPRESSED_MAX_BLOCK_SIZE) {
+    futhark_panic(1, "binary-input: Invalid compression block size %i.\n", (int)block_size);
+  }
+
+  size_t left = (size_t)elem_count * elem_size;
+  size_t buf_size = left < block_size ? left : block_size;
+  unsigned char *stored = (unsigned char*) malloc(buf_size);
+  unsigned char *planes = (unsigned char*) malloc(buf_size);
+
+  while (left > 0) {
+    size_t raw_size = left < block_size ? left : block_size;
+    uint32_t stored_size;
+    if (read_le_u32(f, &stored_size) != 0 || stored_size > raw_size) {
+      futhark_panic(1, "binary-input: Invalid compressed block.\n");
+    }
+    if (fread(stored, 1, stored_size, f) != stored_size) {
+      futhark_panic(1, "binary-input: Couldn't read compressed block.\n");
+    }
+    if (stored_size == raw_size) {
+      unshuffle_bytes(dest, stored, raw_size / elem_size, elem_size);
+    } else if (lz4_decompress(stored, stored_size, planes, raw_size) == 0) {
+      unshuffle_bytes(dest, planes, raw_size / elem_size, elem_size);
+    } else {
+      futhark_panic(1, "binary-input: Corrupt compressed block.\n");
+    }
+    dest += raw_size;
+    left -= raw_size;
+  }
+
+  free(stored);
+  free(planes);
+}
+
+// Read a payload of the given version into dest, which must have room
+// for elem_count elements.
+static void read_bin_payload(FILE *f, int version,
+                             const struct primtype_info_t *type,
+                             void *dest, int64_t elem_count) {
+  if (version == COMPRESSED_FORMAT_VERSION) {
+    read_compressed_payload(f, type, (unsigned char*)dest, elem_count);
+    return;
+  }
+
+  int64_t elem_size = type->size;
+  int64_t num_elems_read = (int64_t)fread(dest, (size_t)elem_size, (size_t)elem_count, f);
+  if (num_elems_read != elem_count) {
+    futhark_panic(1, "binary-input: tried to read %i elements of an array, but only got %i elements.\n",
+          elem_count, num_elems_read);
+  }
+
+  // If we're on big endian platform we must change all multibyte elements
+  // from using little endian to big endian
+  if (IS_BIG_ENDIAN && elem_size != 1) {
+    flip_bytes((size_t)elem_size, (unsigned char*) dest);
+  }
 }
 
 //// High-level interface
 
-static int read_bin_array(FILE *f,
-                          const struct primtype_info_t *expected_type, void **data, int64_t *shape, int64_t dims) {
+// Read the header of a binary array (the part after the version
+// number), check that it matches the expected type and rank, store
+// the shape, and return the number of elements.
+static int64_t read_bin_array_header(FILE *f, int version,
+                                     const struct primtype_info_t *expected_type,
+                                     int64_t *shape, int64_t dims) {
   int ret;
 
   int8_t bin_dims;
@@ -663,6 +1574,14 @@ static int read_bin_array(FILE *f,
     shape[i] = bin_shape;
   }
 
+  read_bin_skip_padding(f, version);
+
+  return elem_count;
+}
+
+static int read_bin_array_payload(FILE *f, int version,
+                                  const struct primtype_info_t *expected_type,
+                                  void **data, int64_t elem_count) {
   int64_t elem_size = expected_type->size;
   void* tmp = realloc(*data, (size_t)(elem_count * elem_size));
   if (tmp == NULL) {
@@ -671,31 +1590,363 @@ static int read_bin_array(FILE *f,
   }
   *data = tmp;
 
-  int64_t num_elems_read = (int64_t)fread(*data, (size_t)elem_size, (size_t)elem_count, f);
-  if (num_elems_read != elem_count) {
-    futhark_panic(1, "binary-input: tried to read %i elements of an array, but only got %i elements.\n",
-          elem_count, num_elems_read);
+  read_bin_payload(f, version, expected_type, *data, elem_count);
+  return 0;
+}
+
+static int read_bin_array(FILE *f, int version,
+                          const struct primtype_info_t *expected_type, void **data, int64_t *shape, int64_t dims) {
+  int64_t elem_count = read_bin_array_header(f, version, expected_type, shape, dims);
+  return read_bin_array_payload(f, version, expected_type, data, elem_count);
+}
+
+static int read_array(FILE *f, const struct primtype_info_t *expected_type, void **data, int64_t *shape, int64_t dims) {
+  int version = read_is_binary(f);
+  if (!version) {
+    return read_str_array(f, expected_type->size, (str_reader)expected_type->read_str, expected_type->type_name, data, shape, dims);
+  } else {
+    return read_bin_array(f, version, expected_type, data, shape, dims);
   }
+}
 
-  // If we're on big endian platform we must change all multibyte elements
-  // from using little endian to big endian
-  if (IS_BIG_ENDIAN && elem_size != 1) {
-    flip_bytes((size_t)elem_size, (unsigned char*) *data);
+//// Memory-mapped input
+
+// Binary arrays of at least this many bytes are not copied out of
+// regular files, but read directly from a mapping of the file.
+// Smaller arrays are not worth the system calls.
+#define MAPPED_READ_THRESHOLD (1<<20)
+
+// A part of a file mapped by read_array_mapped().  The address is
+// NULL if nothing was mapped.
+struct mapped_region {
+  void *addr;
+  size_t len;
+};
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Map the next 'bytes' bytes of 'f' and move past them.  Returns NULL
+// (leaving the file position alone) if 'f' is not a regular file or
+// is too short, in which case the caller should just read.
+static void* map_file_bytes(FILE *f, size_t bytes, struct mapped_region *m) {
+  long pos = ftell(f);
+  struct stat st;
+  if (pos < 0 || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)
+      || (uint64_t)st.st_size < (uint64_t)pos + bytes) {
+    return NULL;
   }
 
-  return 0;
+  // The offset of a mapping must be page-aligned.
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = (size_t)pos & ~(page_size-1);
+  size_t len = (size_t)pos - start + bytes;
+  void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(f), (off_t)start);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+  if (fseek(f, pos + (long)bytes, SEEK_SET) != 0) {
+    munmap(addr, len);
+    return NULL;
+  }
+#ifdef MADV_SEQUENTIAL
+  // The data is consumed once, front to back.
+  (void)madvise(addr, len, MADV_SEQUENTIAL);
+#endif
+
+  m->addr = addr;
+  m->len = len;
+  return (unsigned char*)addr + ((size_t)pos - start);
 }
 
-static int read_array(FILE *f, const struct primtype_info_t *expected_type, void **data, int64_t *shape, int64_t dims) {
-  if (!read_is_binary(f)) {
+static void unmap_region(struct mapped_region *m) {
+  if (m->addr != NULL) {
+    munmap(m->addr, m->len);
+    m->addr = NULL;
+  }
+}
+
+#else
+
+static void* map_file_bytes(FILE *f, size_t bytes, struct mapped_region *m) {
+  (void)f; (void)bytes; (void)m;
+  return NULL;
+}
+
+static void unmap_region(struct mapped_region *m) {
+  (void)m;
+}
+
+#endif
+
+// Like read_array(), except that the payload of a large binary array
+// in a regular file is not read into *data.  Instead, *data is set to
+// point into a read-only mapping of the file, described by *m.  Either
+// way, the data must be released with free_array_data().
+static int read_array_mapped(FILE *f, const struct primtype_info_t *expected_type,
+                             void **data, int64_t *shape, int64_t dims,
+                             struct mapped_region *m) {
+  m->addr = NULL;
+  m->len = 0;
+  int version = read_is_binary(f);
+  if (!version) {
     return read_str_array(f, expected_type->size, (str_reader)expected_type->read_str, expected_type->type_name, data, shape, dims);
+  }
+  int64_t elem_count = read_bin_array_header(f, version, expected_type, shape, dims);
+  size_t bytes = (size_t)(elem_count * expected_type->size);
+  // On big-endian platforms the bytes must be flipped, and compressed
+  // payloads must be decompressed, so they need to be in a buffer of
+  // our own anyway.
+  if (!IS_BIG_ENDIAN && version != COMPRESSED_FORMAT_VERSION
+      && bytes >= MAPPED_READ_THRESHOLD) {
+    void *p = map_file_bytes(f, bytes, m);
+    if (p != NULL) {
+      *data = p;
+      return 0;
+    }
+  }
+  return read_bin_array_payload(f, version, expected_type, data, elem_count);
+}
+
+static void free_array_data(void *data, struct mapped_region *m) {
+  if (m->addr != NULL) {
+    unmap_region(m);
   } else {
-    return read_bin_array(f, expected_type, data, shape, dims);
+    free(data);
+  }
+}
+
+//// Indexed files
+
+// A file in binary format version 3 is a sequence of values, each
+// encoded as in version 2, except that the header is followed by
+// padding that places the payload at a multiple of 64 bytes from the
+// start of the file.  The values
+// are followed by an index that lets us find a value without reading
+// the ones before it, and the file ends with a trailer that lets us
+// find the index.  See docs/binary-data-format.rst for the details.
+
+#define INDEXED_TRAILER_MAGIC "FUTHINDX"
+#define INDEXED_TRAILER_SIZE 24
+#define INDEXED_HAS_CHECKSUM 1
+
+struct indexed_value {
+  char *name; // Empty if the value is not named.
+  const struct primtype_info_t *type;
+  int rank;
+  int64_t *shape;
+  int64_t header_offset; // Of the 'b'; relative to the file.
+  int64_t payload_offset;
+  int has_checksum;
+  uint64_t checksum;
+};
+
+struct value_index {
+  int64_t num_values;
+  struct indexed_value *values;
+};
+
+// The 64-bit FNV-1a hash.
+static uint64_t indexed_checksum(uint64_t h, const unsigned char *p, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ p[i]) * 1099511628211ULL;
   }
+  return h;
+}
+
+#define INDEXED_CHECKSUM_INIT 14695981039346656037ULL
+
+static int read_le_u64(FILE *f, uint64_t *x) {
+  if (fread(x, sizeof(*x), 1, f) != 1) {
+    return 1;
+  }
+  if (IS_BIG_ENDIAN) {
+    flip_bytes(sizeof(*x), (unsigned char*)x);
+  }
+  return 0;
+}
+
+static void write_le_u64(FILE *f, uint64_t x) {
+  if (IS_BIG_ENDIAN) {
+    flip_bytes(sizeof(x), (unsigned char*)&x);
+  }
+  fwrite(&x, sizeof(x), 1, f);
+}
+
+static void free_value_index(struct value_index *idx) {
+  for (int64_t i = 0; i < idx->num_values; i++) {
+    free(idx->values[i].name);
+    free(idx->values[i].shape);
+  }
+  free(idx->values);
+  idx->num_values = 0;
+  idx->values = NULL;
+}
+
+static const struct primtype_info_t* indexed_type(const char binname[4]) {
+  for (const struct primtype_info_t **type = primtypes; *type != NULL; type++) {
+    if (memcmp(binname, (*type)->binname, 4) == 0) {
+      return *type;
+    }
+  }
+  return NULL;
+}
+
+// Read the index of an indexed file, which must be seekable.
+// Returns nonzero if the file has no index, or if it is malformed.
+static int read_value_index(FILE *f, struct value_index *idx) {
+  idx->num_values = 0;
+  idx->values = NULL;
+
+  if (fseek(f, 0, SEEK_END) != 0) {
+    return 1;
+  }
+  long file_size = ftell(f);
+  if (file_size < INDEXED_TRAILER_SIZE
+      || fseek(f, file_size - INDEXED_TRAILER_SIZE, SEEK_SET) != 0) {
+    return 1;
+  }
+
+  uint64_t index_offset, container_size;
+  char magic[8];
+  if (read_le_u64(f, &index_offset) != 0
+      || read_le_u64(f, &container_size) != 0
+      || fread(magic, sizeof(magic), 1, f) != 1
+      || memcmp(magic, INDEXED_TRAILER_MAGIC, sizeof(magic)) != 0
+      || container_size > (uint64_t)file_size
+      || index_offset > container_size - INDEXED_TRAILER_SIZE) {
+    return 1;
+  }
+
+  // Offsets in the file are relative to the start of the indexed
+  // data, which need not be the start of the file.
+  int64_t start = file_size - (int64_t)container_size;
+  unsigned char marker[8];
+  uint64_t num_values;
+  if (fseek(f, start + (long)index_offset, SEEK_SET) != 0
+      || fread(marker, sizeof(marker), 1, f) != 1
+      || marker[0] != 'b' || marker[1] != INDEXED_FORMAT_VERSION
+      || marker[2] != INDEXED_INDEX_MARKER
+      || read_le_u64(f, &num_values) != 0
+      || num_values > container_size) {
+    return 1;
+  }
+
+  idx->values = (struct indexed_value*) calloc(num_values, sizeof(struct indexed_value));
+  if (idx->values == NULL && num_values > 0) {
+    return 1;
+  }
+  for (uint64_t i = 0; i < num_values; i++) {
+    struct indexed_value *v = &idx->values[i];
+    idx->num_values++;
+
+    uint64_t header_offset, payload_offset, checksum;
+    unsigned char desc[8]; // Rank, type, flags, and name length.
+    if (read_le_u64(f, &header_offset) != 0
+        || read_le_u64(f, &payload_offset) != 0
+        || read_le_u64(f, &checksum) != 0
+        || fread(desc, sizeof(desc), 1, f) != 1
+        || header_offset >= index_offset
+        || payload_offset > index_offset) {
+      free_value_index(idx);
+      return 1;
+    }
+    v->rank = desc[0];
+    v->type = indexed_type((const char*)desc+1);
+    v->has_checksum = (desc[5] & INDEXED_HAS_CHECKSUM) != 0;
+    v->checksum = checksum;
+    v->header_offset = start + (int64_t)header_offset;
+    v->payload_offset = start + (int64_t)payload_offset;
+    size_t name_len = (size_t)desc[6] | ((size_t)desc[7] << 8);
+
+    v->shape = (int64_t*) malloc((v->rank > 0 ? v->rank : 1) * sizeof(int64_t));
+    v->name = (char*) malloc(name_len + 1);
+    if (v->type == NULL) {
+      free_value_index(idx);
+      return 1;
+    }
+    for (int j = 0; j < v->rank; j++) {
+      if (read_le_u64(f, (uint64_t*)&v->shape[j]) != 0) {
+        free_value_index(idx);
+        return 1;
+      }
+    }
+
+    // The name is padded such that entries are eight-byte aligned.
+    size_t padded_len = (name_len + 7) & ~(size_t)7;
+    char pad[8];
+    if (fread(v->name, 1, name_len, f) != name_len
+        || fread(pad, 1, padded_len - name_len, f) != padded_len - name_len) {
+      free_value_index(idx);
+      return 1;
+    }
+    v->name[name_len] = 0;
+  }
+
+  return 0;
+}
+
+// Find a value by name, or if no value has that name, by its position
+// in the file.  The empty key matches nothing, as unnamed values can
+// only be found by position.
+static const struct indexed_value* find_indexed_value(const struct value_index *idx,
+                                                      const char *key) {
+  if (*key == 0) {
+    return NULL;
+  }
+  for (int64_t i = 0; i < idx->num_values; i++) {
+    if (strcmp(idx->values[i].name, key) == 0) {
+      return &idx->values[i];
+    }
+  }
+  char *end;
+  errno = 0;
+  long long i = strtoll(key, &end, 10);
+  if (errno == 0 && *end == 0 && i >= 0 && i < idx->num_values) {
+    return &idx->values[i];
+  }
+  return NULL;
+}
+
+// Check the payload of the value against its checksum, if it has
+// one.  Returns nonzero on mismatch.  Leaves the file position
+// unspecified.
+static int check_indexed_value(FILE *f, const struct indexed_value *v) {
+  if (!v->has_checksum) {
+    return 0;
+  }
+  int64_t bytes = v->type->size;
+  for (int i = 0; i < v->rank; i++) {
+    bytes *= v->shape[i];
+  }
+  if (fseek(f, (long)v->payload_offset, SEEK_SET) != 0) {
+    return 1;
+  }
+  uint64_t h = INDEXED_CHECKSUM_INIT;
+  unsigned char buf[1<<16];
+  while (bytes > 0) {
+    size_t n = bytes < (int64_t)sizeof(buf) ? (size_t)bytes : sizeof(buf);
+    if (fread(buf, 1, n, f) != n) {
+      return 1;
+    }
+    h = indexed_checksum(h, buf, n);
+    bytes -= (int64_t)n;
+  }
+  return h == v->checksum ? 0 : 1;
 }
 
 static int end_of_input(FILE *f) {
   skipspaces(f);
+  // The index at the end of an indexed file does not count as input.
+  int c = getc(f);
+  if (c == 'b') {
+    int version = getc(f);
+    int marker = getc(f);
+    return version == INDEXED_FORMAT_VERSION && marker == INDEXED_INDEX_MARKER ? 0 : 1;
+  }
+  ungetc(c, f);
   char token[2];
   next_token(f, token, sizeof(token));
   if (strcmp(token, "") == 0) {
@@ -705,13 +1956,40 @@ static int end_of_input(FILE *f) {
   }
 }
 
-static int write_str_array(FILE *out,
-                           const struct primtype_info_t *elem_type,
-                           const unsigned char *data,
-                           const int64_t *shape,
-                           int8_t rank) {
+// Textual output goes through a buffer, such that writing an array
+// is not a call into stdio per element.
+struct str_output {
+  FILE *out;
+  size_t used;
+  char buf[16384];
+};
+
+static void str_output_flush(struct str_output *o) {
+  fwrite(o->buf, 1, o->used, o->out);
+  o->used = 0;
+}
+
+// Return room for at least n bytes at the end of the buffer.
+static char* str_output_reserve(struct str_output *o, size_t n) {
+  if (o->used + n > sizeof(o->buf)) {
+    str_output_flush(o);
+  }
+  return o->buf + o->used;
+}
+
+static void str_output_char(struct str_output *o, char c) {
+  *str_output_reserve(o, 1) = c;
+  o->used++;
+}
+
+static void write_str_elems(struct str_output *o,
+                            const struct primtype_info_t *elem_type,
+                            const unsigned char *data,
+                            const int64_t *shape,
+                            int8_t rank) {
   if (rank==0) {
-    elem_type->write_str(out, (const void*)data);
+    char *p = str_output_reserve(o, STR_VALUE_MAX_LEN);
+    o->used += (size_t)elem_type->format_str(p, (const void*)data);
   } else {
     int64_t len = (int64_t)shape[0];
     int64_t slice_size = 1;
@@ -721,75 +1999,156 @@ static int write_str_array(FILE *out,
       slice_size *= shape[i];
     }
 
-    if (len*slice_size == 0) {
-      fprintf(out, "empty(");
-      for (int64_t i = 0; i < rank; i++) {
-        fprintf(out, "[%"PRIi64"]", shape[i]);
+    str_output_char(o, '[');
+    for (int64_t i = 0; i < len; i++) {
+      if (rank==1) {
+        char *p = str_output_reserve(o, STR_VALUE_MAX_LEN + 2);
+        o->used += (size_t)elem_type->format_str(p, (const void*) (data + i * elem_size));
+      } else {
+        write_str_elems(o, elem_type, data + i * slice_size * elem_size, shape+1, rank-1);
       }
-      fprintf(out, "%s", elem_type->type_name);
-      fprintf(out, ")");
-    } else if (rank==1) {
-      fputc('[', out);
-      for (int64_t i = 0; i < len; i++) {
-        elem_type->write_str(out, (const void*) (data + i * elem_size));
-        if (i != len-1) {
-          fprintf(out, ", ");
-        }
+      if (i != len-1) {
+        char *p = str_output_reserve(o, 2);
+        p[0] = ',';
+        p[1] = ' ';
+        o->used += 2;
       }
-      fputc(']', out);
-    } else {
-      fputc('[', out);
-      for (int64_t i = 0; i < len; i++) {
-        write_str_array(out, elem_type, data + i * slice_size * elem_size, shape+1, rank-1);
-        if (i != len-1) {
-          fprintf(out, ", ");
-        }
-      }
-      fputc(']', out);
     }
+    str_output_char(o, ']');
   }
-  return 0;
 }
 
-static int write_bin_array(FILE *out,
+static int write_str_array(FILE *out,
                            const struct primtype_info_t *elem_type,
                            const unsigned char *data,
                            const int64_t *shape,
                            int8_t rank) {
   int64_t num_elems = 1;
-  for (int64_t i = 0; i < rank; i++) {
+  for (int8_t i = 0; i < rank; i++) {
     num_elems *= shape[i];
   }
 
+  if (rank > 0 && num_elems == 0) {
+    fprintf(out, "empty(");
+    for (int64_t i = 0; i < rank; i++) {
+      fprintf(out, "[%"PRIi64"]", shape[i]);
+    }
+    fprintf(out, "%s", elem_type->type_name);
+    fprintf(out, ")");
+  } else {
+    struct str_output o;
+    o.out = out;
+    o.used = 0;
+    write_str_elems(&o, elem_type, data, shape, rank);
+    str_output_flush(&o);
+  }
+  return 0;
+}
+
+// Write the header of a binary array, with write_binary as for
+// write_array(), and return the version of the format used.
+static int write_bin_header(FILE *out, int write_binary,
+                            const struct primtype_info_t *elem_type,
+                            const int64_t *shape,
+                            int8_t rank) {
+  // Scalars are too small to be worth compressing.
+  int version = write_binary == WRITE_BINARY_COMPRESSED && rank > 0
+    ? COMPRESSED_FORMAT_VERSION : BINARY_FORMAT_VERSION;
+
   fputc('b', out);
-  fputc((char)BINARY_FORMAT_VERSION, out);
+  fputc((char)version, out);
   fwrite(&rank, sizeof(int8_t), 1, out);
   fwrite(elem_type->binname, 4, 1, out);
   if (shape != NULL) {
     fwrite(shape, sizeof(int64_t), (size_t)rank, out);
   }
+  if (version == COMPRESSED_FORMAT_VERSION) {
+    fputc(COMPRESSED_CODEC_SHUFFLE_LZ4, out);
+    write_le_u32(out, COMPRESSED_BLOCK_SIZE);
+  }
+  return version;
+}
 
-  if (IS_BIG_ENDIAN) {
+static void write_compressed_payload(FILE *out,
+                                     const struct primtype_info_t *elem_type,
+                                     const unsigned char *data,
+                                     int64_t num_elems) {
+  size_t elem_size = (size_t)elem_type->size;
+  size_t left = (size_t)num_elems * elem_size;
+  size_t buf_size = left < COMPRESSED_BLOCK_SIZE ? left : COMPRESSED_BLOCK_SIZE;
+  unsigned char *planes = (unsigned char*) malloc(buf_size);
+  unsigned char *packed = (unsigned char*) malloc(buf_size);
+  uint32_t *table = (uint32_t*) malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+
+  while (left > 0) {
+    size_t raw_size = left < COMPRESSED_BLOCK_SIZE ? left : COMPRESSED_BLOCK_SIZE;
+    shuffle_bytes(planes, data, raw_size / elem_size, elem_size);
+    // A compressed block must be smaller than the raw one, or the
+    // reader would take it to be stored.
+    size_t packed_size = lz4_compress(planes, raw_size, packed, raw_size - 1, table);
+    if (packed_size == 0) {
+      write_le_u32(out, (uint32_t)raw_size);
+      fwrite(planes, 1, raw_size, out);
+    } else {
+      write_le_u32(out, (uint32_t)packed_size);
+      fwrite(packed, 1, packed_size, out);
+    }
+    data += raw_size;
+    left -= raw_size;
+  }
+
+  free(planes);
+  free(packed);
+  free(table);
+}
+
+// Write num_elems elements of the payload of a binary array whose
+// header was written with the given version.  The payload can be
+// written in several pieces, but for COMPRESSED_FORMAT_VERSION all
+// pieces except the last must be a multiple of COMPRESSED_BLOCK_SIZE
+// bytes.
+static void write_bin_payload(FILE *out, int version,
+                              const struct primtype_info_t *elem_type,
+                              const unsigned char *data,
+                              int64_t num_elems) {
+  if (version == COMPRESSED_FORMAT_VERSION) {
+    write_compressed_payload(out, elem_type, data, num_elems);
+  } else if (IS_BIG_ENDIAN) {
     for (int64_t i = 0; i < num_elems; i++) {
       const unsigned char *elem = data+i*elem_type->size;
       for (int64_t j = 0; j < elem_type->size; j++) {
-        fwrite(&elem[elem_type->size-j], 1, 1, out);
+        fwrite(&elem[elem_type->size-1-j], 1, 1, out);
       }
     }
   } else {
     fwrite(data, (size_t)elem_type->size, (size_t)num_elems, out);
   }
+}
 
+static int write_bin_array(FILE *out, int write_binary,
+                           const struct primtype_info_t *elem_type,
+                           const unsigned char *data,
+                           const int64_t *shape,
+                           int8_t rank) {
+  int64_t num_elems = 1;
+  for (int64_t i = 0; i < rank; i++) {
+    num_elems *= shape[i];
+  }
+
+  int version = write_bin_header(out, write_binary, elem_type, shape, rank);
+  write_bin_payload(out, version, elem_type, data, num_elems);
   return 0;
 }
 
+// If write_binary is WRITE_BINARY_COMPRESSED, arrays are written in
+// the compressed format.
 static int write_array(FILE *out, int write_binary,
                        const struct primtype_info_t *elem_type,
                        const void *data,
                        const int64_t *shape,
                        const int8_t rank) {
   if (write_binary) {
-    return write_bin_array(out, elem_type, data, shape, rank);
+    return write_bin_array(out, write_binary, elem_type, data, shape, rank);
   } else {
     return write_str_array(out, elem_type, data, shape, rank);
   }
@@ -797,12 +2156,17 @@ static int write_array(FILE *out, int write_binary,
 
 static int read_scalar(FILE *f,
                        const struct primtype_info_t *expected_type, void *dest) {
-  if (!read_is_binary(f)) {
+  int version = read_is_binary(f);
+  if (!version) {
     char buf[100];
     next_token(f, buf, sizeof(buf));
     return expected_type->read_str(buf, dest);
   } else {
-    read_bin_ensure_scalar(f, expected_type);
+    read_bin_ensure_scalar(f, version, expected_type);
+    if (version == COMPRESSED_FORMAT_VERSION) {
+      read_compressed_payload(f, expected_type, (unsigned char*)dest, 1);
+      return 0;
+    }
     size_t elem_size = (size_t)expected_type->size;
     size_t num_elems_read = fread(dest, elem_size, 1, f);
     if (IS_BIG_ENDIAN) {
@@ -814,9 +2178,9 @@ static int read_scalar(FILE *f,
 
 static int write_scalar(FILE *out, int write_binary, const struct primtype_info_t *type, void *src) {
   if (write_binary) {
-    return write_bin_array(out, type, src, NULL, 0);
+    return write_bin_array(out, write_binary, type, src, NULL, 0);
   } else {
-    return type->write_str(out, src);
+    return write_str_array(out, type, src, NULL, 0);
   }
 }
 
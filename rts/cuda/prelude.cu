@@ -13,6 +13,9 @@ typedef unsigned short uint16_t;
 typedef unsigned int uint32_t;
 typedef unsigned long long uint64_t;
 
+// For copying arrays of 16-byte elements.
+typedef ulonglong2 elem_16b_t;
+
 #define __global
 #define __local
 #define __private
@@ -79,5 +79,6 @@ GEN_COPY_KERNEL(1b, uint8_t)
 GEN_COPY_KERNEL(2b, uint16_t)
 GEN_COPY_KERNEL(4b, uint32_t)
 GEN_COPY_KERNEL(8b, uint64_t)
+GEN_COPY_KERNEL(16b, elem_16b_t)
 
 // End of copy.cl
@@ -13,6 +13,9 @@ typedef ushort uint16_t;
 typedef uint uint32_t;
 typedef ulong uint64_t;
 
+// For copying arrays of 16-byte elements.
+typedef ulong2 elem_16b_t;
+
 #define get_tblock_id(d) get_group_id(d)
 #define get_num_tblocks(d) get_num_groups(d)
 
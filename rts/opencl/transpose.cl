@@ -269,5 +269,6 @@ GEN_TRANSPOSE_KERNELS(1b, uint8_t)
 GEN_TRANSPOSE_KERNELS(2b, uint16_t)
 GEN_TRANSPOSE_KERNELS(4b, uint32_t)
 GEN_TRANSPOSE_KERNELS(8b, uint64_t)
+GEN_TRANSPOSE_KERNELS(16b, elem_16b_t)
 
 // End of transpose.cl
@@ -354,7 +354,8 @@ compileCUDAAction fcfg mode outpath =
           extra_options =
             [ "-lcuda",
               "-lcudart",
-              "-lnvrtc"
+              "-lnvrtc",
+              "-pthread"
             ]
       case mode of
         ToLibrary -> do
@@ -385,7 +386,8 @@ compileHIPAction fcfg mode outpath =
           jsonpath = outpath `addExtension` "json"
           extra_options =
             [ "-lamdhip64",
-              "-lhiprtc"
+              "-lhiprtc",
+              "-pthread"
             ]
       case mode of
         ToLibrary -> do
@@ -16,6 +16,7 @@ import Data.Vector.Storable.Mutable qualified as USVec
 import Data.Word
 import Futhark.Data qualified as V
 import Futhark.Data.Reader (readValues)
+import Futhark.Test.Values.Indexed
 import Futhark.Util (convFloat)
 import Futhark.Util.Options
 import Language.Futhark.Parser
@@ -38,20 +39,20 @@ main = mainWithOptions initialDataOptions commandLineOptions "options..." f
   where
     f [] config
       | null $ optOrders config = Just $ do
-          maybe_vs <- readValues <$> BS.getContents
+          input <- BS.getContents
+          let maybe_vs
+                | isIndexed input = map snd <$> decodeIndexed input
+                | otherwise = readValues input
           case maybe_vs of
             Nothing -> do
               hPutStrLn stderr "Malformed data on standard input."
               exitFailure
             Just vs ->
-              case format config of
-                Text -> mapM_ (T.putStrLn . V.valueText) vs
-                Binary -> mapM_ (BS.putStr . Bin.encode) vs
-                Type -> mapM_ (T.putStrLn . V.valueTypeText . V.valueType) vs
+              outValues config $ map (format config,) vs
       | otherwise =
-          Just $
-            zipWithM_
-              ($)
+          Just . outValues config . concat $
+            zipWith
+              (\(fmt, g) seed -> map (fmt,) $ g seed)
               (optOrders config)
               [fromIntegral (optSeed config) ..]
     f _ _ =
@@ -60,18 +61,39 @@ main = mainWithOptions initialDataOptions commandLineOptions "options..." f
 data OutputFormat
   = Text
   | Binary
+  | Indexed
   | Type
   deriving (Eq, Ord, Show)
 
 data DataOptions = DataOptions
   { optSeed :: Int,
     optRange :: RandomConfiguration,
-    optOrders :: [Word64 -> IO ()],
-    format :: OutputFormat
+    optOrders :: [(OutputFormat, Word64 -> [V.Value])],
+    format :: OutputFormat,
+    optChecksums :: Bool
   }
 
 initialDataOptions :: DataOptions
-initialDataOptions = DataOptions 1 initialRandomConfiguration [] Text
+initialDataOptions = DataOptions 1 initialRandomConfiguration [] Text False
+
+-- | Values in the indexed format are written together after all
+-- other output, as the index must come last.  Only those values are
+-- kept until the end; everything else is written as it is produced.
+outValues :: DataOptions -> [(OutputFormat, V.Value)] -> IO ()
+outValues config vs = do
+  indexed <- foldM outValue [] vs
+  unless (null indexed) $
+    BS.putStr $
+      encodeIndexed (optChecksums config) (reverse indexed)
+  where
+    outValue indexed (Indexed, v) = pure $ ("", v) : indexed
+    outValue indexed (fmt, v) = do
+      case fmt of
+        Text -> T.putStrLn $ V.valueText v
+        Binary -> BS.putStr $ Bin.encode v
+        Type -> T.putStrLn $ V.valueTypeText $ V.valueType v
+        Indexed -> pure ()
+      pure indexed
 
 commandLineOptions :: [FunOptDescr DataOptions]
 commandLineOptions =
@@ -102,7 +124,7 @@ commandLineOptions =
                     config
                       { optOrders =
                           optOrders config
-                            ++ [g (optRange config) (format config)]
+                            ++ [(format config, g (optRange config))]
                       }
                 Left err ->
                   Left $ do
@@ -122,6 +144,16 @@ commandLineOptions =
       ["binary"]
       (NoArg $ Right $ \opts -> opts {format = Binary})
       "Output data in binary Futhark format (must precede --generate).",
+    Option
+      []
+      ["indexed"]
+      (NoArg $ Right $ \opts -> opts {format = Indexed})
+      "Output data in the indexed binary format (must precede --generate).",
+    Option
+      []
+      ["checksum"]
+      (NoArg $ Right $ \opts -> opts {optChecksums = True})
+      "Store checksums of values output in the indexed format.",
     Option
       "t"
       ["type"]
@@ -170,20 +202,15 @@ setRangeOption tname set =
 
 tryMakeGenerator ::
   String ->
-  Either T.Text (RandomConfiguration -> OutputFormat -> Word64 -> IO ())
+  Either T.Text (RandomConfiguration -> Word64 -> [V.Value])
 tryMakeGenerator t
   | Just vs <- readValues $ BS.pack t =
-      pure $ \_ fmt _ -> mapM_ (outValue fmt) vs
+      pure $ \_ _ -> vs
   | otherwise = do
       t' <- toValueType =<< either (Left . syntaxErrorMsg) Right (parseType name (T.pack t))
-      pure $ \conf fmt seed -> do
-        let v = randomValue conf t' seed
-        outValue fmt v
+      pure $ \conf seed -> [randomValue conf t' seed]
   where
     name = "option " ++ t
-    outValue Text = T.putStrLn . V.valueText
-    outValue Binary = BS.putStr . Bin.encode
-    outValue Type = T.putStrLn . V.valueTypeText . V.valueType
 
 toValueType :: UncheckedTypeExp -> Either T.Text V.ValueType
 toValueType TETuple {} = Left "Cannot handle tuples yet."
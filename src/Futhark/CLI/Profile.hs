@@ -31,6 +31,17 @@ memoryReport = T.unlines . ("Peak memory usage in bytes" :) . map f . M.toList
   where
     f (space, bytes) = space <> ": " <> showText bytes
 
+entryPointReport :: M.Map T.Text ProfilingEntryPoint -> T.Text
+entryPointReport = T.unlines . ("Device synchronisations per entry point" :) . map f . M.toList
+  where
+    f (name, ProfilingEntryPoint calls syncs) =
+      name
+        <> ": "
+        <> showText syncs
+        <> " in "
+        <> showText calls
+        <> (if calls == 1 then " call" else " calls")
+
 padRight :: Int -> T.Text -> T.Text
 padRight k s = s <> T.replicate (k - T.length s) " "
 
@@ -100,6 +111,8 @@ writeAnalysis :: TargetFiles -> ProfilingReport -> IO ()
 writeAnalysis tf r = do
   T.writeFile (summaryFile tf) $
     memoryReport (profilingMemory r)
+      <> "\n\n"
+      <> entryPointReport (profilingEntryPoints r)
       <> "\n\n"
       <> tabulateEvents (profilingEvents r)
   T.writeFile (timelineFile tf) $
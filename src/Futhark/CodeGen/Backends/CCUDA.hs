@@ -49,6 +49,11 @@ mkBoilerplate cuda_program macros kernels types failures = do
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_program(struct futhark_context_config *cfg, const char* s);|]
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_dump_ptx_to(struct futhark_context_config *cfg, const char* s);|]
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_load_ptx_from(struct futhark_context_config *cfg, const char* s);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_staging_buffer_size(struct futhark_context_config *cfg, size_t size);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_num_staging_buffers(struct futhark_context_config *cfg, int num);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_copy_streams(struct futhark_context_config *cfg, int flag);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_replay_launches(struct futhark_context_config *cfg, int num);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_compile_threads(struct futhark_context_config *cfg, int num);|]
 
 cliOptions :: [Option]
 cliOptions =
@@ -99,6 +104,41 @@ cliOptions =
              optionArgument = RequiredArgument "OPT",
              optionDescription = "Add an additional build option to the string passed to NVRTC.",
              optionAction = [C.cstm|futhark_context_config_add_nvrtc_option(cfg, optarg);|]
+           },
+         Option
+           { optionLongName = "staging-buffer-size",
+             optionShortName = Nothing,
+             optionArgument = RequiredArgument "BYTES",
+             optionDescription = "Size of each pinned buffer used for host/device transfers.",
+             optionAction = [C.cstm|futhark_context_config_set_staging_buffer_size(cfg, (size_t)atoll(optarg));|]
+           },
+         Option
+           { optionLongName = "num-staging-buffers",
+             optionShortName = Nothing,
+             optionArgument = RequiredArgument "INT",
+             optionDescription = "Number of pinned buffers used for host/device transfers (0 to disable).",
+             optionAction = [C.cstm|futhark_context_config_set_num_staging_buffers(cfg, atoi(optarg));|]
+           },
+         Option
+           { optionLongName = "no-copy-streams",
+             optionShortName = Nothing,
+             optionArgument = NoArgument,
+             optionDescription = "Perform host/device transfers on the same stream as kernels.",
+             optionAction = [C.cstm|futhark_context_config_set_copy_streams(cfg, 0);|]
+           },
+         Option
+           { optionLongName = "replay-launches",
+             optionShortName = Nothing,
+             optionArgument = RequiredArgument "INT",
+             optionDescription = "Number of launch sequences to record and replay as CUDA graphs (0 to disable).",
+             optionAction = [C.cstm|futhark_context_config_set_replay_launches(cfg, atoi(optarg));|]
+           },
+         Option
+           { optionLongName = "compile-threads",
+             optionShortName = Nothing,
+             optionArgument = RequiredArgument "INT",
+             optionDescription = "Number of threads used for compiling GPU code with NVRTC (0 for all cores).",
+             optionAction = [C.cstm|futhark_context_config_set_compile_threads(cfg, atoi(optarg));|]
            }
        ]
 
@@ -133,7 +173,15 @@ compileProg version prog = do
           --  ( [C.citems|CUDA_SUCCEED_FATAL((ctx->cfg->cuCtxPushCurrent)(ctx->cu_ctx));|],
           --    [C.citems|CUDA_SUCCEED_FATAL((ctx->cfg->cuCtxPopCurrent)(&ctx->cu_ctx));|]
           --  )
-          GC.opsCritical = mempty
+          -- Deferred launches must be issued before returning
+          -- to the caller.  Some API functions may still return
+          -- early from a critical section when freeing memory fails,
+          -- so the replay is also closed on entry.  This way a
+          -- recording never spans two API calls.
+          GC.opsCritical =
+            ( [C.citems|cuda_replay_end(ctx);|],
+              [C.citems|cuda_replay_end(ctx);|]
+            )
         }
     cuda_includes =
       [untrimming|
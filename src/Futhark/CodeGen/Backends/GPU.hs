@@ -21,7 +21,7 @@ import Futhark.CodeGen.Backends.GenericC.Options
 import Futhark.CodeGen.Backends.GenericC.Pretty (expText, idText)
 import Futhark.CodeGen.Backends.SimpleRep (primStorageType, toStorage)
 import Futhark.CodeGen.ImpCode.OpenCL
-import Futhark.CodeGen.RTS.C (gpuH, gpuPrototypesH)
+import Futhark.CodeGen.RTS.C (gpuCompileH, gpuH, gpuPrototypesH)
 import Futhark.MonadFreshNames
 import Futhark.Util (chunk)
 import Futhark.Util.Pretty (prettyTextOneLine)
@@ -45,7 +45,10 @@ genKernelFunction kernel_name safety arg_params arg_set = do
     if (grid_x * grid_y * grid_z * block_x * block_y * block_z != 0) {
       void* args[$int:num_args] = { $inits:(failure_inits<>args_inits) };
       size_t args_sizes[$int:num_args] = { $inits:(failure_sizes<>args_sizes) };
-      return gpu_launch_kernel(ctx, ctx->program->$id:kernel_name,
+      typename gpu_kernel kernel =
+        gpu_get_kernel(ctx, &ctx->program->$id:kernel_name,
+                       $string:(T.unpack (idText (C.toIdent kernel_name mempty))));
+      return gpu_launch_kernel(ctx, kernel,
                                $string:(prettyString kernel_name),
                                (const typename int32_t[]){grid_x, grid_y, grid_z},
                                (const typename int32_t[]){block_x, block_y, block_z},
@@ -231,12 +234,14 @@ gpuCopies =
       ((DefaultSpace, Space "device"), copygpu2host)
     ]
 
+-- | Kernels are created on first use by 'genKernelFunction', so
+-- context setup only clears the handles.
 createKernels :: [KernelName] -> GC.CompilerM op s ()
 createKernels kernels = forM_ kernels $ \name ->
   GC.contextFieldDyn
     (C.toIdent name mempty)
     [C.cty|typename gpu_kernel|]
-    [C.cstm|gpu_create_kernel(ctx, &ctx->program->$id:name, $string:(T.unpack (idText (C.toIdent name mempty))));|]
+    [C.cstm|ctx->program->$id:name = NULL;|]
     [C.cstm|gpu_free_kernel(ctx, ctx->program->$id:name);|]
 
 allocateGPU :: GC.Allocate op ()
@@ -278,6 +283,24 @@ readScalarGPU mem i t "device" _ = do
 readScalarGPU _ _ _ space _ =
   error $ "Cannot read from '" ++ space ++ "' memory space."
 
+-- Several reads are enqueued into one staging buffer and waited for
+-- together, such that we synchronise with the device only once.
+readScalarsGPU :: GC.ReadScalars op ()
+readScalarsGPU rs "device" = do
+  vals <- forM rs $ \(mem, i, t) -> do
+    val <- newVName "read_res"
+    GC.decl [C.cdecl|$ty:t $id:val;|]
+    GC.stm
+      [C.cstm|if ((err = gpu_scalar_from_device_async(ctx, &$id:val, $exp:mem, $exp:i * sizeof($ty:t), sizeof($ty:t))) != 0) { goto cleanup; }|]
+    pure val
+  GC.stm [C.cstm|if ((err = gpu_scalar_sync(ctx)) != 0) { goto cleanup; }|]
+  GC.stm
+    [C.cstm|if (ctx->failure_is_an_option && futhark_context_sync(ctx) != 0)
+            { err = 1; goto cleanup; }|]
+  pure [[C.cexp|$id:val|] | val <- vals]
+readScalarsGPU _ space =
+  error $ "Cannot read from '" ++ space ++ "' memory space."
+
 -- TODO: Optimised special case when the scalar is a constant, in
 -- which case we can do the write asynchronously.
 writeScalarGPU :: GC.WriteScalar op ()
@@ -312,6 +335,7 @@ gpuOperations =
     { GC.opsCompiler = callKernel,
       GC.opsWriteScalar = writeScalarGPU,
       GC.opsReadScalar = readScalarGPU,
+      GC.opsReadScalars = Just readScalarsGPU,
       GC.opsAllocate = allocateGPU,
       GC.opsDeallocate = deallocateGPU,
       GC.opsUnify = unifyGPU,
@@ -378,6 +402,13 @@ gpuOptions =
         optionArgument = RequiredArgument "INT",
         optionDescription = "The default parallelism threshold.",
         optionAction = [C.cstm|futhark_context_config_set_default_threshold(cfg, atoi(optarg));|]
+      },
+    Option
+      { optionLongName = "gpu-free-list-cap",
+        optionShortName = Nothing,
+        optionArgument = RequiredArgument "BYTES",
+        optionDescription = "Keep up to this many bytes of freed device memory for reuse.",
+        optionAction = [C.cstm|futhark_context_config_set_gpu_free_list_cap(cfg, (size_t)atoll(optarg));|]
       }
   ]
 
@@ -443,6 +474,7 @@ generateGPUBoilerplate gpu_program macros backendH kernels types failures = do
              static const int f64_required = $exp:f64_required;
              static const char *gpu_program[] = {$inits:program_fragments};
              $esc:(T.unpack gpuPrototypesH)
+             $esc:(T.unpack gpuCompileH)
              $esc:(T.unpack backendH)
              $esc:(T.unpack gpuH)
              static int gpu_macros(struct futhark_context *ctx, char*** names_out, typename int64_t** values_out) {
@@ -470,3 +502,4 @@ generateGPUBoilerplate gpu_program macros backendH kernels types failures = do
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_default_tile_size(struct futhark_context_config *cfg, int size);|]
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_default_reg_tile_size(struct futhark_context_config *cfg, int size);|]
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_default_threshold(struct futhark_context_config *cfg, int size);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_gpu_free_list_cap(struct futhark_context_config *cfg, size_t bytes);|]
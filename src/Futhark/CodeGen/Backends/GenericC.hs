@@ -93,6 +93,7 @@ defaultOperations =
   Operations
     { opsWriteScalar = defWriteScalar,
       opsReadScalar = defReadScalar,
+      opsReadScalars = Nothing,
       opsAllocate = defAllocate,
       opsDeallocate = defDeallocate,
       opsUnify = defUnify,
@@ -556,7 +557,7 @@ $entry_point_decls
 
       mapM_ earlyDecl $ concat memfuns
       type_funs <- generateAPITypes arr_space types
-      generateCommonLibFuns memreport
+      generateCommonLibFuns memreport [ename | (_, Function (Just (EntryPoint ename _ _)) _ _ _) <- funs]
 
       pure
         ( definitionsText prototypes,
@@ -601,8 +602,8 @@ generateTuningParams params = do
   earlyDecl [C.cedecl|static const char *tuning_param_classes[] = { $inits:size_class_inits, NULL };|]
   earlyDecl [C.cedecl|static typename int64_t tuning_param_defaults[] = { $inits:size_default_inits, 0 };|]
 
-generateCommonLibFuns :: [C.BlockItem] -> CompilerM op s ()
-generateCommonLibFuns memreport = do
+generateCommonLibFuns :: [C.BlockItem] -> [Name] -> CompilerM op s ()
+generateCommonLibFuns memreport entry_points = do
   ctx <- contextType
   cfg <- configType
   ops <- asks envOperations
@@ -674,7 +675,9 @@ generateCommonLibFuns memreport = do
                  $items:(L.intersperse comma memreport)
                  str_builder_str(&builder, "},\"events\":[");
                  report_events_in_list(ctx, &ctx->event_list, &builder);
-                 str_builder_str(&builder, "]}");
+                 str_builder_str(&builder, "],\"entry_points\":{");
+                 $items:(entryPointReport entry_points)
+                 str_builder_str(&builder, "}}");
                  return builder.str;
                }|]
     )
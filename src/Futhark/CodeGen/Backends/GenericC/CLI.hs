@@ -77,6 +77,13 @@ genericOptions =
         optionDescription = "Print the program result in the binary output format.",
         optionAction = [C.cstm|binary_output = 1;|]
       },
+    Option
+      { optionLongName = "compressed-output",
+        optionShortName = Nothing,
+        optionArgument = NoArgument,
+        optionDescription = "Print the program result in the compressed binary output format.",
+        optionAction = [C.cstm|binary_output = WRITE_BINARY_COMPRESSED;|]
+      },
     Option
       { optionLongName = "no-print-result",
         optionShortName = Just 'n',
@@ -182,6 +182,59 @@ compileRead src (Count iexp) restype space vol = do
   iexp' <- compileExp (untyped iexp)
   generateRead src' iexp' restype space vol
 
+-- | A read from a non-default memory space, possibly with the
+-- declaration of its destination.
+data SpaceRead
+  = SpaceRead
+      (Maybe (Volatility, PrimType))
+      VName
+      VName
+      (Count Elements (TExp Int64))
+      PrimType
+      SpaceId
+
+-- | Split off the longest prefix of reads from a single non-default
+-- memory space that can be performed together: each read is
+-- nonvolatile, and no read depends on the result of an earlier one.
+spaceReads :: [Code op] -> ([SpaceRead], [Code op])
+spaceReads = go Nothing mempty
+  where
+    go sid dests (DeclareScalar name vol t : Read dest src i restype (Space sid') Nonvolatile : code)
+      | name == dest,
+        independent sid dests sid' src i restype =
+          continue sid' dests code $ SpaceRead (Just (vol, t)) dest src i restype sid'
+    go sid dests (Read dest src i restype (Space sid') Nonvolatile : code)
+      | independent sid dests sid' src i restype,
+        dest `notNameIn` dests =
+          continue sid' dests code $ SpaceRead Nothing dest src i restype sid'
+    go _ _ code = ([], code)
+
+    continue sid dests code r@(SpaceRead _ dest _ _ _ _) =
+      let (rs, code') = go (Just sid) (oneName dest <> dests) code
+       in (r : rs, code')
+
+    independent sid dests sid' src (Count i) restype =
+      maybe True (== sid') sid
+        && restype /= Unit
+        && src `notNameIn` dests
+        && not (freeIn (untyped i) `namesIntersect` dests)
+
+compileSpaceReads :: ReadScalars op s -> [SpaceRead] -> CompilerM op s ()
+compileSpaceReads _ [] = pure ()
+compileSpaceReads f rs@(SpaceRead _ _ _ _ _ sid : _) = do
+  rs' <- forM rs $ \(SpaceRead _ _ src (Count i) restype _) -> do
+    src' <- rawMem src
+    i' <- compileExp (untyped i)
+    pure (src', i', primStorageType restype)
+  es <- f rs' sid
+  forM_ (zip rs es) $ \(SpaceRead declared dest _ _ restype _, e) -> do
+    let e' = fromStorage restype e
+    case declared of
+      Just (vol, t) ->
+        item [C.citem|$tyquals:(volQuals vol) $ty:(primTypeToCType t) $id:dest = $exp:e';|]
+      Nothing ->
+        stm [C.cstm|$id:dest = $exp:e';|]
+
 memNeedsWrapping :: VName -> CompilerM op s Bool
 memNeedsWrapping v = do
   refcount <- fatMemory DefaultSpace
@@ -244,30 +297,39 @@ compileCode (DebugPrint s Nothing) =
           fprintf(ctx->log, "%s\n", $exp:s);
        }|]
 -- :>>: is treated in a special way to detect declare-set pairs in
--- order to generate prettier code.
+-- order to generate prettier code, and to batch consecutive reads
+-- from the same memory space.
 compileCode (c1 :>>: c2) = go (linearCode (c1 :>>: c2))
   where
-    go (DeclareScalar name vol t : SetScalar dest e : code)
+    go code
+      | (rs@(_ : _ : _), code') <- spaceReads code = do
+          read_scalars <- asks (opsReadScalars . envOperations)
+          case read_scalars of
+            Just f -> compileSpaceReads f rs >> go code'
+            Nothing -> go' code
+    go code = go' code
+
+    go' (DeclareScalar name vol t : SetScalar dest e : code)
       | name == dest = do
           let ct = primTypeToCType t
           e' <- compileExp e
           item [C.citem|$tyquals:(volQuals vol) $ty:ct $id:name = $exp:e';|]
           go code
-    go (DeclareScalar name vol t : Read dest src i restype space read_vol : code)
+    go' (DeclareScalar name vol t : Read dest src i restype space read_vol : code)
       | name == dest = do
           let ct = primTypeToCType t
           e <- compileRead src i restype space read_vol
           item [C.citem|$tyquals:(volQuals vol) $ty:ct $id:name = $exp:e;|]
           go code
-    go (DeclareScalar name vol t : Call [dest] fname args : code)
+    go' (DeclareScalar name vol t : Call [dest] fname args : code)
       | name == dest,
         isBuiltInFunction fname = do
           let ct = primTypeToCType t
           args' <- mapM compileArg args
           item [C.citem|$tyquals:(volQuals vol) $ty:ct $id:name = $id:(funName fname)($args:args');|]
           go code
-    go (x : xs) = compileCode x >> go xs
-    go [] = pure ()
+    go' (x : xs) = compileCode x >> go xs
+    go' [] = pure ()
 compileCode (Assert e msg (loc, locs)) = do
   e' <- compileExp e
   err <-
@@ -362,6 +424,8 @@ compileCode (DeclareArray name t vs) = do
       let vs'' = [[C.cinit|$exp:v|] | v <- vs']
       earlyDecl [C.cedecl|static $ty:ct $id:name_realtype[$int:(length vs')] = {$inits:vs''};|]
     ArrayZeros n ->
+      -- No initialiser: this puts the array in .bss, so it costs
+      -- nothing at startup and is backed by zero pages until touched.
       earlyDecl [C.cedecl|static $ty:ct $id:name_realtype[$int:n];|]
   -- Fake a memory block.
   item
@@ -3,11 +3,13 @@
 -- | Generate the entry point packing/unpacking code.
 module Futhark.CodeGen.Backends.GenericC.EntryPoints
   ( onEntryPoint,
+    entryPointReport,
   )
 where
 
 import Control.Monad
 import Control.Monad.Reader (asks)
+import Data.List qualified as L
 import Data.Maybe
 import Data.Text qualified as T
 import Futhark.CodeGen.Backends.GenericC.Monad
@@ -134,6 +136,26 @@ prepareEntryOutputs = collect' . zipWithM prepare [(0 :: Int) ..]
 entryName :: Name -> T.Text
 entryName = ("entry_" <>) . escapeName . nameToText
 
+entryCalls, entrySyncs :: Name -> C.Id
+entryCalls ename = C.toIdent (entryName ename <> "_calls") mempty
+entrySyncs ename = C.toIdent (entryName ename <> "_syncs") mempty
+
+-- | Report the number of calls of each entry point, and how many
+-- times they waited for the device, since the last report.
+entryPointReport :: [Name] -> [C.BlockItem]
+entryPointReport =
+  L.intercalate [C.citems|str_builder_char(&builder, ',');|] . map report
+  where
+    report ename =
+      [C.citems|
+       str_builder_json_str(&builder, $string:(nameToString ename));
+       str_builder(&builder, ":{\"calls\":%lld,\"syncs\":%lld}",
+                   (long long)ctx->program->$id:(entryCalls ename),
+                   (long long)ctx->program->$id:(entrySyncs ename));
+       ctx->program->$id:(entryCalls ename) = 0;
+       ctx->program->$id:(entrySyncs ename) = 0;
+      |]
+
 onEntryPoint ::
   [C.BlockItem] ->
   [Name] ->
@@ -159,6 +181,9 @@ onEntryPoint get_consts relevant_params fname (Function (Just (EntryPoint ename
 
   ctx_ty <- contextType
 
+  contextField (entryCalls ename) [C.cty|typename int64_t|] $ Just [C.cexp|0|]
+  contextField (entrySyncs ename) [C.cty|typename int64_t|] $ Just [C.cexp|0|]
+
   headerDecl
     EntryDecl
     [C.cedecl|int $id:entry_point_function_name
@@ -182,6 +207,7 @@ onEntryPoint get_consts relevant_params fname (Function (Just (EntryPoint ename
          $items:decl_mem
          $items:unpack_entry_inputs
          $items:check_input
+         typename int64_t syncs_before = ctx->num_syncs;
          if (ret == 0) {
            ret = $id:(funName fname)(ctx, $args:out_args, $args:in_args);
            if (ret == 0) {
@@ -190,6 +216,8 @@ onEntryPoint get_consts relevant_params fname (Function (Just (EntryPoint ename
              $items:pack_entry_outputs
            }
          }
+         ctx->program->$id:(entryCalls ename)++;
+         ctx->program->$id:(entrySyncs ename) += ctx->num_syncs - syncs_before;
         |]
 
   ops <- asks envOperations
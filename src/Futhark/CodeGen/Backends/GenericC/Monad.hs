@@ -14,6 +14,7 @@ module Futhark.CodeGen.Backends.GenericC.Monad
     writeScalarPointerWithQuals,
     ReadScalar,
     readScalarPointerWithQuals,
+    ReadScalars,
     Allocate,
     Deallocate,
     Unify,
@@ -166,6 +167,13 @@ type WriteScalar op s =
 type ReadScalar op s =
   C.Exp -> C.Exp -> C.Type -> SpaceId -> Volatility -> CompilerM op s C.Exp
 
+-- | Read several nonvolatile scalars from the given memory space at
+-- once.  Each element of the list is a memory block, an element
+-- index, and a type, as for 'ReadScalar'.  Returns an expression for
+-- each value read.
+type ReadScalars op s =
+  [(C.Exp, C.Exp, C.Type)] -> SpaceId -> CompilerM op s [C.Exp]
+
 -- | Allocate a memory block of the given size and with the given tag
 -- in the given memory space, saving a reference in the given variable
 -- name.
@@ -228,6 +236,10 @@ type CallCompiler op s = [VName] -> Name -> [C.Exp] -> CompilerM op s ()
 data Operations op s = Operations
   { opsWriteScalar :: WriteScalar op s,
     opsReadScalar :: ReadScalar op s,
+    -- | If present, used instead of 'opsReadScalar' for consecutive
+    -- reads from the same memory space, such that the backend can
+    -- wait for all of them at once.
+    opsReadScalars :: Maybe (ReadScalars op s),
     opsAllocate :: Allocate op s,
     opsDeallocate :: Deallocate op s,
     opsUnify :: Unify op s,
@@ -55,6 +55,13 @@ genericOptions =
                    exit(0);
                   }|]
       },
+    Option
+      { optionLongName = "binary-protocol",
+        optionShortName = Nothing,
+        optionArgument = NoArgument,
+        optionDescription = "Use the length-prefixed binary framing of the server protocol.",
+        optionAction = [C.cstm|binary_protocol = true;|]
+      },
     Option
       { optionLongName = "print-params",
         optionShortName = Nothing,
@@ -132,6 +139,11 @@ typeBoilerplate _ (tname, TypeArray _ et rank ops) =
       info_name = et <> "_info"
       shape_args = [[C.cexp|shape[$int:i]|] | i <- [0 .. rank - 1]]
       array_new_wrap = arrayNew ops <> "_wrap"
+      -- These are generated for every array type, but are not listed
+      -- in the manifest.
+      array_name = et <> "_" <> T.pack (show rank) <> "d"
+      values_slice = "futhark_values_slice_" <> array_name
+      values_raw = "futhark_values_raw_" <> array_name
    in ( [C.cedecl|const struct type $id:type_name;|],
         [C.cinit|&$id:type_name|],
         [C.cunit|
@@ -147,7 +159,8 @@ typeBoilerplate _ (tname, TypeArray _ et rank ops) =
                 .new = (typename array_new_fn)$id:array_new_wrap,
                 .free = (typename array_free_fn)$id:(arrayFree ops),
                 .shape = (typename array_shape_fn)$id:(arrayShape ops),
-                .values = (typename array_values_fn)$id:(arrayValues ops)
+                .values_slice = (typename array_values_slice_fn)$id:values_slice,
+                .values_raw = (typename array_values_raw_fn)$id:values_raw
               };
               const struct type $id:type_name = {
                 .name = $string:(T.unpack tname),
@@ -341,6 +354,9 @@ $esc:("#include <inttypes.h>")
 // If the entry point is NULL, the program will terminate after doing initialisation and such.  It is not used for anything else in server mode.
 static const char *entry_point = "main";
 
+// Set by --binary-protocol.
+static bool binary_protocol = false;
+
 $esc:(T.unpack valuesH)
 $esc:(T.unpack serverH)
 $esc:(T.unpack tuningH)
@@ -389,7 +405,7 @@ int main(int argc, char** argv) {
   }
 
   if (entry_point != NULL) {
-    run_server(&prog, cfg, ctx);
+    run_server(&prog, cfg, ctx, binary_protocol);
   }
 
   futhark_context_free(ctx);
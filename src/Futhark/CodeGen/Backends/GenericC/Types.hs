@@ -55,6 +55,7 @@ arrayLibraryFunctions pub space pt signed rank = do
   free_array <- publicName $ "free_" <> name
   values_array <- publicName $ "values_" <> name
   values_raw_array <- publicName $ "values_raw_" <> name
+  values_slice_array <- publicName $ "values_slice_" <> name
   shape_array <- publicName $ "shape_" <> name
 
   let shape_names = ["dim" <> prettyText i | i <- [0 .. rank - 1]]
@@ -71,34 +72,42 @@ arrayLibraryFunctions pub space pt signed rank = do
           [C.cexp|arr->mem|]
           [C.cexp|$exp:arr_size * $int:(primByteSize pt::Int)|]
           space
-          [C.cstm|return NULL;|]
+          [C.cstm|err = 1;|]
         forM_ [0 .. rank - 1] $ \i ->
           let dim_s = "dim" ++ show i
            in stm [C.cstm|arr->shape[$int:i] = $id:dim_s;|]
 
+  -- Allocation failure is reported through 'err' rather than by
+  -- returning, such that the end of the critical section still runs.
   new_body <- collect $ do
     prepare_new
-    copy
-      CopyNoBarrier
-      [C.cexp|arr->mem.mem|]
-      [C.cexp|0|]
-      space
-      [C.cexp|(const unsigned char*)data|]
-      [C.cexp|0|]
-      DefaultSpace
-      [C.cexp|((size_t)$exp:arr_size) * $int:(primByteSize pt::Int)|]
+    copy_data <-
+      collect $
+        copy
+          CopyNoBarrier
+          [C.cexp|arr->mem.mem|]
+          [C.cexp|0|]
+          space
+          [C.cexp|(const unsigned char*)data|]
+          [C.cexp|0|]
+          DefaultSpace
+          [C.cexp|((size_t)$exp:arr_size) * $int:(primByteSize pt::Int)|]
+    stm [C.cstm|if (err == 0) { $items:copy_data }|]
 
   new_raw_body <- collect $ do
     prepare_new
-    copy
-      CopyNoBarrier
-      [C.cexp|arr->mem.mem|]
-      [C.cexp|0|]
-      space
-      [C.cexp|data|]
-      [C.cexp|offset|]
-      space
-      [C.cexp|((size_t)$exp:arr_size) * $int:(primByteSize pt::Int)|]
+    copy_data <-
+      collect $
+        copy
+          CopyNoBarrier
+          [C.cexp|arr->mem.mem|]
+          [C.cexp|0|]
+          space
+          [C.cexp|data|]
+          [C.cexp|offset|]
+          space
+          [C.cexp|((size_t)$exp:arr_size) * $int:(primByteSize pt::Int)|]
+    stm [C.cstm|if (err == 0) { $items:copy_data }|]
 
   free_body <- collect $ unRefMem [C.cexp|arr->mem|] space
 
@@ -114,6 +123,18 @@ arrayLibraryFunctions pub space pt signed rank = do
         space
         [C.cexp|((size_t)$exp:arr_size_array) * $int:(primByteSize pt::Int)|]
 
+  values_slice_body <-
+    collect $
+      copy
+        CopyNoBarrier
+        [C.cexp|(unsigned char*)data|]
+        [C.cexp|0|]
+        DefaultSpace
+        [C.cexp|arr->mem.mem|]
+        [C.cexp|offset * $int:(primByteSize pt::Int)|]
+        space
+        [C.cexp|((size_t)n) * $int:(primByteSize pt::Int)|]
+
   ctx_ty <- contextType
   ops <- asks envOperations
 
@@ -135,6 +156,10 @@ arrayLibraryFunctions pub space pt signed rank = do
     [C.cedecl|$ty:memty $id:values_raw_array($ty:ctx_ty *ctx, $ty:array_type *arr);|]
   proto
     [C.cedecl|const typename int64_t* $id:shape_array($ty:ctx_ty *ctx, $ty:array_type *arr);|]
+  -- Not part of the public API, but used by the server to store
+  -- arrays piecemeal.
+  libDecl
+    [C.cedecl|int $id:values_slice_array($ty:ctx_ty *ctx, $ty:array_type *arr, $ty:pt' *data, typename int64_t offset, typename int64_t n);|]
 
   mapM_
     libDecl
@@ -162,6 +187,10 @@ arrayLibraryFunctions pub space pt signed rank = do
               return bad;
             }
             $items:(criticalSection ops new_raw_body)
+            if (err != 0) {
+              free(arr);
+              return bad;
+            }
             return arr;
           }
 
@@ -177,6 +206,12 @@ arrayLibraryFunctions pub space pt signed rank = do
             return err;
           }
 
+          int $id:values_slice_array($ty:ctx_ty *ctx, $ty:array_type *arr, $ty:pt' *data, typename int64_t offset, typename int64_t n) {
+            int err = 0;
+            $items:(criticalSection ops values_slice_body)
+            return err;
+          }
+
           $ty:memty $id:values_raw_array($ty:ctx_ty *ctx, $ty:array_type *arr) {
             (void)ctx;
             return arr->mem.mem;
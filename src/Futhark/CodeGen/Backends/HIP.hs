@@ -47,6 +47,7 @@ mkBoilerplate hip_program macros kernels types failures = do
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_device(struct futhark_context_config *cfg, const char* s);|]
   GC.headerDecl GC.InitDecl [C.cedecl|const char* futhark_context_config_get_program(struct futhark_context_config *cfg);|]
   GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_program(struct futhark_context_config *cfg, const char* s);|]
+  GC.headerDecl GC.InitDecl [C.cedecl|void futhark_context_config_set_compile_threads(struct futhark_context_config *cfg, int num);|]
 
 cliOptions :: [Option]
 cliOptions =
@@ -81,6 +82,13 @@ cliOptions =
              optionArgument = RequiredArgument "OPT",
              optionDescription = "Add an additional build option to the string passed to NVRTC.",
              optionAction = [C.cstm|futhark_context_config_add_build_option(cfg, optarg);|]
+           },
+         Option
+           { optionLongName = "compile-threads",
+             optionShortName = Nothing,
+             optionArgument = RequiredArgument "INT",
+             optionDescription = "Number of threads used for compiling GPU code with HIPRTC (0 for all cores).",
+             optionAction = [C.cstm|futhark_context_config_set_compile_threads(cfg, atoi(optarg));|]
            }
        ]
 
@@ -237,7 +237,9 @@ type Function = FunctionT
 data ArrayContents
   = -- | Precisely these values.
     ArrayValues [PrimValue]
-  | -- | This many zeroes.
+  | -- | This many zeroes.  Backends should not materialise these
+    -- explicitly; the C backends emit them without an initialiser so
+    -- they end up in @.bss@ and are zeroed by the OS on first touch.
     ArrayZeros Int
   deriving (Show)
 
@@ -76,7 +76,9 @@ translateGPU target prog =
 
       (device_prototypes, device_defs) = unzip $ M.elems device_funs
       kernels' = M.map fst kernels
-      opencl_code = T.unlines $ map snd $ M.elems kernels
+      opencl_code =
+        T.unlines . concatMap (\unit -> [moduleSplitMarker, unit]) $
+          [transposeCL, copyCL] <> map snd (M.elems kernels)
 
       opencl_prelude =
         T.unlines
@@ -524,13 +526,19 @@ constDef kernel_name (ConstUse v e) =
     undef = "#undef " <> idText (C.toIdent v mempty)
 constDef _ _ = Nothing
 
+-- | Precedes every unit of kernels in the generated program.  The
+-- runtime may compile the text before the first marker together with
+-- any subset of units, such that large programs can be compiled as
+-- several modules in parallel.  Must match @GPU_MODULE_SPLIT_MARKER@
+-- in @rts/c/gpu_compile.h@.
+moduleSplitMarker :: T.Text
+moduleSplitMarker = "// FUTHARK_MODULE_SPLIT"
+
 commonPrelude :: T.Text
 commonPrelude =
   halfH
     <> cScalarDefs
     <> atomicsH
-    <> transposeCL
-    <> copyCL
 
 genOpenClPrelude :: S.Set PrimType -> T.Text
 genOpenClPrelude ts =
@@ -598,6 +606,7 @@ inKernelOperations env mode body =
       GC.opsMemoryType = kernelMemoryType,
       GC.opsWriteScalar = kernelWriteScalar,
       GC.opsReadScalar = kernelReadScalar,
+      GC.opsReadScalars = Nothing,
       GC.opsAllocate = cannotAllocate,
       GC.opsDeallocate = cannotDeallocate,
       GC.opsUnify = cannotUnify,
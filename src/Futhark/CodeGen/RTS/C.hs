@@ -10,6 +10,7 @@ module Futhark.CodeGen.RTS.C
     eventListH,
     gpuH,
     gpuPrototypesH,
+    gpuCompileH,
     halfH,
     lockH,
     miniserverH,
@@ -69,6 +70,11 @@ gpuPrototypesH :: T.Text
 gpuPrototypesH = $(embedStringFile "rts/c/gpu_prototypes.h")
 {-# NOINLINE gpuPrototypesH #-}
 
+-- | @rts/c/gpu_compile.h@
+gpuCompileH :: T.Text
+gpuCompileH = $(embedStringFile "rts/c/gpu_compile.h")
+{-# NOINLINE gpuCompileH #-}
+
 -- | @rts/c/half.h@
 halfH :: T.Text
 halfH = $(embedStringFile "rts/c/half.h")
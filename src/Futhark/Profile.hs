@@ -1,6 +1,7 @@
 -- | Profiling information emitted by a running Futhark program.
 module Futhark.Profile
   ( ProfilingEvent (..),
+    ProfilingEntryPoint (..),
     ProfilingReport (..),
     profilingReportFromText,
     decodeProfilingReport,
@@ -43,25 +44,53 @@ instance JSON.FromJSON ProfilingEvent where
       <*> o JSON..: "duration"
       <*> o JSON..: "description"
 
+-- | Counters for an entry point.
+data ProfilingEntryPoint = ProfilingEntryPoint
+  { -- | Number of calls.
+    entryPointCalls :: Integer,
+    -- | Number of times the calls waited for the device.
+    entryPointSyncs :: Integer
+  }
+  deriving (Eq, Ord, Show)
+
+instance JSON.ToJSON ProfilingEntryPoint where
+  toJSON (ProfilingEntryPoint calls syncs) =
+    JSON.object
+      [ ("calls", JSON.toJSON calls),
+        ("syncs", JSON.toJSON syncs)
+      ]
+
+instance JSON.FromJSON ProfilingEntryPoint where
+  parseJSON = JSON.withObject "entry-point" $ \o ->
+    ProfilingEntryPoint
+      <$> o JSON..: "calls"
+      <*> o JSON..: "syncs"
+
 data ProfilingReport = ProfilingReport
   { profilingEvents :: [ProfilingEvent],
     -- | Mapping memory spaces to bytes.
-    profilingMemory :: M.Map T.Text Integer
+    profilingMemory :: M.Map T.Text Integer,
+    -- | Mapping entry point names to their counters.
+    profilingEntryPoints :: M.Map T.Text ProfilingEntryPoint
   }
   deriving (Eq, Ord, Show)
 
 instance JSON.ToJSON ProfilingReport where
-  toJSON (ProfilingReport events memory) =
+  toJSON (ProfilingReport events memory entry_points) =
     JSON.object
       [ ("events", JSON.toJSON events),
-        ("memory", JSON.object $ map (bimap JSON.fromText JSON.toJSON) $ M.toList memory)
+        ("memory", JSON.object $ map (bimap JSON.fromText JSON.toJSON) $ M.toList memory),
+        ("entry_points", JSON.object $ map (bimap JSON.fromText JSON.toJSON) $ M.toList entry_points)
       ]
 
+-- Reports from programs compiled before entry point counters were
+-- added do not have an "entry_points" field.
 instance JSON.FromJSON ProfilingReport where
   parseJSON = JSON.withObject "profiling-info" $ \o ->
     ProfilingReport
       <$> o JSON..: "events"
       <*> (JSON.toMapText <$> o JSON..: "memory")
+      <*> (maybe mempty JSON.toMapText <$> o JSON..:? "entry_points")
 
 decodeProfilingReport :: LBS.ByteString -> Maybe ProfilingReport
 decodeProfilingReport = JSON.decode
@@ -0,0 +1,181 @@
+-- | The indexed binary data format (version 3 of the binary format).
+-- The values are encoded as in version 2, except that each header is
+-- padded such that the payload is aligned, and the values are
+-- followed by an index of their names, types, shapes, and positions.
+-- This allows a reader to find and map a single value of a large file
+-- without reading the values before it.  See
+-- @docs/binary-data-format.rst@ for the details.
+module Futhark.Test.Values.Indexed
+  ( encodeIndexed,
+    decodeIndexed,
+    isIndexed,
+  )
+where
+
+import Control.Monad
+import Data.Binary qualified as Bin
+import Data.Binary.Get qualified as Bin
+import Data.Binary.Put qualified as Bin
+import Data.Bits (xor, (.&.))
+import Data.ByteString qualified as SBS
+import Data.ByteString.Lazy qualified as LBS
+import Data.Int (Int64)
+import Data.List (mapAccumL)
+import Data.Maybe (fromMaybe)
+import Data.Text qualified as T
+import Data.Text.Encoding qualified as T
+import Data.Word
+import Futhark.Data
+
+data Entry = Entry
+  { entryName :: T.Text,
+    -- | Rank, type, and shape, as in version 2.
+    entryDesc :: LBS.ByteString,
+    entryHeaderOffset :: Word64,
+    entryPayloadOffset :: Word64,
+    entryChecksum :: Maybe Word64
+  }
+
+alignment :: Int64
+alignment = 64
+
+indexMarker :: Word8
+indexMarker = 255
+
+trailerMagic :: LBS.ByteString
+trailerMagic = "FUTHINDX"
+
+trailerSize :: Int64
+trailerSize = 24
+
+-- | 64-bit FNV-1a.
+checksum :: LBS.ByteString -> Word64
+checksum = LBS.foldl' (\h b -> (h `xor` fromIntegral b) * 1099511628211) 14695981039346656037
+
+-- Split the version 2 encoding of a value into the part describing
+-- its type and shape, and its payload.
+splitEncoding :: Value -> (LBS.ByteString, LBS.ByteString)
+splitEncoding v =
+  let bytes = Bin.encode v
+      rank = fromIntegral $ LBS.index bytes 2
+   in LBS.splitAt (5 + 8 * rank) $ LBS.drop 2 bytes
+
+encodeValue :: Bool -> Int64 -> (T.Text, Value) -> (Int64, (LBS.ByteString, Entry))
+encodeValue checksums offset (name, v) =
+  (payload_offset + LBS.length payload, (bytes, entry))
+  where
+    (desc, payload) = splitEncoding v
+    header_size = 2 + LBS.length desc + 1
+    pad = (alignment - (offset + header_size) `mod` alignment) `mod` alignment
+    payload_offset = offset + header_size + pad
+    bytes = Bin.runPut $ do
+      Bin.putWord8 98 -- 'b'
+      Bin.putWord8 3
+      Bin.putLazyByteString desc
+      Bin.putWord8 $ fromIntegral pad
+      Bin.putLazyByteString $ LBS.replicate pad 0
+      Bin.putLazyByteString payload
+    entry =
+      Entry
+        { entryName = name,
+          entryDesc = desc,
+          entryHeaderOffset = fromIntegral offset,
+          entryPayloadOffset = fromIntegral payload_offset,
+          entryChecksum = if checksums then Just (checksum payload) else Nothing
+        }
+
+putEntry :: Entry -> Bin.Put
+putEntry e = do
+  Bin.putWord64le $ entryHeaderOffset e
+  Bin.putWord64le $ entryPayloadOffset e
+  Bin.putWord64le $ fromMaybe 0 $ entryChecksum e
+  Bin.putLazyByteString $ LBS.take 5 $ entryDesc e
+  Bin.putWord8 $ maybe 0 (const 1) $ entryChecksum e
+  Bin.putWord16le $ fromIntegral $ SBS.length name
+  Bin.putLazyByteString $ LBS.drop 5 $ entryDesc e
+  Bin.putByteString name
+  Bin.putLazyByteString $ LBS.replicate ((8 - fromIntegral (SBS.length name)) .&. 7) 0
+  where
+    name = T.encodeUtf8 $ entryName e
+
+-- | Encode named values in the indexed format, optionally with
+-- checksums of their payloads.  Names may be empty.
+encodeIndexed :: Bool -> [(T.Text, Value)] -> LBS.ByteString
+encodeIndexed checksums vs =
+  mconcat values <> index <> trailer
+  where
+    (index_offset, (values, entries)) =
+      unzip <$> mapAccumL (encodeValue checksums) 0 vs
+    index = Bin.runPut $ do
+      mapM_ Bin.putWord8 [98, 3, indexMarker, 105, 110, 100, 120, 0] -- "indx"
+      Bin.putWord64le $ fromIntegral $ length entries
+      mapM_ putEntry entries
+    size = index_offset + LBS.length index + trailerSize
+    trailer = Bin.runPut $ do
+      Bin.putWord64le $ fromIntegral index_offset
+      Bin.putWord64le $ fromIntegral size
+      Bin.putLazyByteString trailerMagic
+
+-- | Does this look like data in the indexed format?
+isIndexed :: LBS.ByteString -> Bool
+isIndexed bs =
+  LBS.length bs >= trailerSize
+    && LBS.drop (LBS.length bs - 8) bs == trailerMagic
+
+-- The header offset is not needed when decoding, since we know the
+-- type and shape from the entry itself.
+getEntry :: Bin.Get (T.Text, Word64, Maybe Word64, LBS.ByteString)
+getEntry = do
+  _header_offset <- Bin.getWord64le
+  payload_offset <- Bin.getWord64le
+  sum' <- Bin.getWord64le
+  rank <- Bin.getWord8
+  t <- Bin.getLazyByteString 4
+  flags <- Bin.getWord8
+  name_len <- fromIntegral <$> Bin.getWord16le
+  shape <- Bin.getLazyByteString $ 8 * fromIntegral rank
+  name <- Bin.getByteString name_len
+  Bin.skip $ (8 - name_len) .&. 7
+  let desc = LBS.cons rank $ t <> shape
+  pure
+    ( T.decodeUtf8 name,
+      payload_offset,
+      if flags .&. 1 == 1 then Just sum' else Nothing,
+      desc
+    )
+
+getIndex :: Bin.Get [(T.Text, Word64, Maybe Word64, LBS.ByteString)]
+getIndex = do
+  marker <- Bin.getLazyByteString 8
+  unless (LBS.take 3 marker == LBS.pack [98, 3, indexMarker]) $
+    fail "Invalid index marker."
+  n <- Bin.getWord64le
+  replicateM (fromIntegral n) getEntry
+
+-- | Decode data in the indexed format, checking the checksums of the
+-- payloads that have them.  Returns 'Nothing' if the data is
+-- malformed.
+decodeIndexed :: LBS.ByteString -> Maybe [(T.Text, Value)]
+decodeIndexed bs = do
+  guard $ isIndexed bs
+  let trailer = LBS.drop (LBS.length bs - trailerSize) bs
+      (index_offset, size) =
+        Bin.runGet ((,) <$> Bin.getWord64le <*> Bin.getWord64le) trailer
+      start = LBS.length bs - fromIntegral size
+  guard $ size <= fromIntegral (LBS.length bs) && start >= 0
+  let container = LBS.drop start bs
+  entries <-
+    either (const Nothing) (Just . thd) $
+      Bin.runGetOrFail getIndex $
+        LBS.drop (fromIntegral index_offset) container
+  forM entries $ \(name, payload_offset, sum', desc) -> do
+    let payload = LBS.drop (fromIntegral payload_offset) container
+    (_, used, v) <-
+      either (const Nothing) Just $
+        Bin.decodeOrFail $
+          LBS.pack [98, 2] <> desc <> payload
+    let payload_size = used - 2 - LBS.length desc
+    forM_ sum' $ guard . (== checksum (LBS.take payload_size payload))
+    pure (name, v)
+  where
+    thd (_, _, x) = x
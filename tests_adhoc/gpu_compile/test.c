@@ -0,0 +1,153 @@
+// Exercise the splitting, parallel compilation, and packing of GPU
+// modules from gpu_compile.h, with a stub in place of NVRTC/HIPRTC.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../../rts/c/lock.h"
+#include "../../rts/c/gpu_compile.h"
+
+#define M GPU_MODULE_SPLIT_MARKER
+
+// "Compiles" a module by copying its source, unless it contains the
+// word "broken".
+static char* stub_compile(void *arg, const char *src, char **code, size_t *code_size) {
+  int *num_compiled = (int*)arg;
+  __atomic_add_fetch(num_compiled, 1, __ATOMIC_SEQ_CST);
+  if (strstr(src, "broken") != NULL) {
+    return strdup("stub: broken unit");
+  }
+  *code = strdup(src);
+  *code_size = strlen(src) + 1;
+  return NULL;
+}
+
+// The number of modules whose source contains s.
+static int num_containing(struct gpu_module *modules, int num_modules, const char *s) {
+  int n = 0;
+  for (int i = 0; i < num_modules; i++) {
+    n += strstr(modules[i].src, s) != NULL;
+  }
+  return n;
+}
+
+static void test_balanced_split(void) {
+  const char *src =
+    "prelude\n"
+    M "big() { xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx }\n"
+    M "a() {}\n"
+    M "b() {}\n"
+    M "c() {}\n"
+    M "d() {}\n";
+  struct gpu_module *modules;
+  int num_modules = gpu_split_program(src, 2, &modules);
+  assert(num_modules == 2);
+
+  // Every module has the prelude, and every unit is in exactly one
+  // module.
+  for (int i = 0; i < num_modules; i++) {
+    assert(strncmp(modules[i].src, "prelude\n", 8) == 0);
+  }
+  const char *units[] = {"big()", "a()", "b()", "c()", "d()"};
+  for (int i = 0; i < 5; i++) {
+    assert(num_containing(modules, num_modules, units[i]) == 1);
+  }
+
+  // The large unit is alone, as the small ones together are smaller.
+  for (int i = 0; i < num_modules; i++) {
+    if (strstr(modules[i].src, "big()") != NULL) {
+      assert(strstr(modules[i].src, "a()") == NULL);
+    }
+  }
+
+  // The units keep their relative order.
+  for (int i = 0; i < num_modules; i++) {
+    char *a = strstr(modules[i].src, "a()");
+    char *d = strstr(modules[i].src, "d()");
+    if (a != NULL && d != NULL) {
+      assert(a < d);
+    }
+  }
+
+  int num_compiled = 0;
+  assert(gpu_compile_modules(modules, num_modules, 4, stub_compile, &num_compiled) == NULL);
+  assert(num_compiled == 2);
+  for (int i = 0; i < num_modules; i++) {
+    assert(strcmp(modules[i].code, modules[i].src) == 0);
+  }
+  gpu_free_modules(modules, num_modules);
+
+  // Never more modules than units.
+  num_modules = gpu_split_program(src, 100, &modules);
+  assert(num_modules == 5);
+  gpu_free_modules(modules, num_modules);
+}
+
+static void test_no_marker(void) {
+  const char *src = "prelude\nk() {}\n";
+  struct gpu_module *modules;
+  int num_modules = gpu_split_program(src, 8, &modules);
+  assert(num_modules == 1);
+  assert(strcmp(modules[0].src, src) == 0);
+  gpu_free_modules(modules, num_modules);
+}
+
+static void test_failing_module(void) {
+  const char *src = "prelude\n" M "a() {}\n" M "broken() {}\n" M "c() {}\n";
+  struct gpu_module *modules;
+  int num_modules = gpu_split_program(src, 3, &modules);
+  assert(num_modules == 3);
+  int num_compiled = 0;
+  char *problem = gpu_compile_modules(modules, num_modules, gpu_num_compile_threads(),
+                                      stub_compile, &num_compiled);
+  assert(problem != NULL && strcmp(problem, "stub: broken unit") == 0);
+  assert(num_compiled == 3);
+  free(problem);
+  gpu_free_modules(modules, num_modules);
+}
+
+static void test_pack(void) {
+  const char *src = "prelude\n" M "a() {}\n" M "bb() {}\n" M "ccc() {}\n";
+  struct gpu_module *modules;
+  int num_modules = gpu_split_program(src, 3, &modules);
+  int num_compiled = 0;
+  assert(gpu_compile_modules(modules, num_modules, 1, stub_compile, &num_compiled) == NULL);
+
+  unsigned char *buf;
+  size_t len;
+  gpu_pack_modules(modules, num_modules, &buf, &len);
+
+  const unsigned char **codes;
+  size_t *sizes;
+  assert(gpu_unpack_modules(buf, len, &codes, &sizes) == num_modules);
+  for (int i = 0; i < num_modules; i++) {
+    assert(sizes[i] == modules[i].code_size);
+    assert(memcmp(codes[i], modules[i].code, sizes[i]) == 0);
+    assert(((uintptr_t)codes[i] - (uintptr_t)buf) % 8 == 0);
+  }
+  free(codes);
+  free(sizes);
+
+  // A truncated blob is rejected, unless only padding is cut off.
+  size_t last_size = modules[num_modules-1].code_size;
+  size_t padding = GPU_MODULE_ALIGN(last_size) - last_size;
+  for (size_t n = 0; n < len - padding; n++) {
+    assert(gpu_unpack_modules(buf, n, &codes, &sizes) < 0);
+  }
+
+  free(buf);
+  gpu_free_modules(modules, num_modules);
+}
+
+int main() {
+  test_balanced_split();
+  test_no_marker();
+  test_failing_module();
+  test_pack();
+}
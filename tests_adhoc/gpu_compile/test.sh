@@ -0,0 +1,11 @@
+#!/bin/sh
+#
+# Test the module splitting, compilation, and packing in
+# rts/c/gpu_compile.h.  Needs only a C compiler.
+
+set -e
+
+${CC:-cc} -std=c99 -Wall -o test test.c -lpthread
+./test
+
+rm -f test
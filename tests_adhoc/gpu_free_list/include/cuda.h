@@ -0,0 +1,46 @@
+// Just enough of the CUDA driver API for the test driver in this
+// directory.  The program never calls the real driver, as every
+// function is taken from the configuration.
+
+#include <stdint.h>
+
+typedef int CUresult;
+typedef int CUdevice;
+typedef unsigned long long CUdeviceptr;
+typedef struct CUctx_st *CUcontext;
+typedef struct CUevent_st *CUevent;
+typedef struct CUfunc_st *CUfunction;
+typedef struct CUmod_st *CUmodule;
+typedef struct CUstream_st *CUstream;
+typedef struct CUgraph_st *CUgraph;
+typedef struct CUgraphExec_st *CUgraphExec;
+typedef int CUdevice_attribute;
+typedef int CUfunction_attribute;
+typedef int CUstreamCaptureMode;
+
+#define CUDA_SUCCESS 0
+#define CUDA_ERROR_OUT_OF_MEMORY 2
+#define CUDA_ERROR_NOT_FOUND 500
+
+#define CU_COMPUTEMODE_PROHIBITED 2
+#define CU_STREAM_DEFAULT 0
+#define CU_STREAM_NON_BLOCKING 1
+#define CU_EVENT_DISABLE_TIMING 2
+#define CU_STREAM_CAPTURE_MODE_RELAXED 2
+
+enum {
+  CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR,
+  CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR,
+  CU_DEVICE_ATTRIBUTE_COMPUTE_MODE,
+  CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT,
+  CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_MULTIPROCESSOR,
+  CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK_OPTIN,
+  CU_DEVICE_ATTRIBUTE_RESERVED_SHARED_MEMORY_PER_BLOCK,
+  CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK,
+  CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_X,
+  CU_DEVICE_ATTRIBUTE_MAX_REGISTERS_PER_BLOCK,
+  CU_DEVICE_ATTRIBUTE_L2_CACHE_SIZE,
+  CU_DEVICE_ATTRIBUTE_WARP_SIZE
+};
+
+#define cudaFuncAttributeMaxDynamicSharedMemorySize 8
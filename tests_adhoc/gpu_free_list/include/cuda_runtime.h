@@ -0,0 +1 @@
+// Intentionally empty; see cuda.h.
@@ -0,0 +1,6 @@
+// Just enough of NVRTC for the test driver in this directory.
+
+typedef int nvrtcResult;
+typedef struct _nvrtcProgram *nvrtcProgram;
+
+#define NVRTC_SUCCESS 0
@@ -0,0 +1,319 @@
+// Exercise the GPU free list through the library API, with a mock
+// CUDA driver where device memory is host memory.  This needs no GPU.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cuda.h>
+#include <nvrtc.h>
+#include "prog.h"
+
+// The driver function setters are not part of the generated header.
+#define SETTER(f) \
+  void futhark_context_config_set_##f(struct futhark_context_config *cfg, void *ptr)
+SETTER(gpu_alloc); SETTER(gpu_free); SETTER(gpu_unify);
+SETTER(gpu_global_failure_alloc); SETTER(gpu_global_failure_free);
+SETTER(cuGetErrorString); SETTER(cuInit); SETTER(cuDeviceGetCount);
+SETTER(cuDeviceGetName); SETTER(cuDeviceGet); SETTER(cuDeviceGetAttribute);
+SETTER(cuDevicePrimaryCtxRetain); SETTER(cuDevicePrimaryCtxRelease);
+SETTER(cuCtxCreate); SETTER(cuCtxDestroy); SETTER(cuCtxPopCurrent);
+SETTER(cuCtxPushCurrent); SETTER(cuCtxSynchronize);
+SETTER(cuMemAlloc); SETTER(cuMemFree); SETTER(cuMemcpy);
+SETTER(cuMemcpyHtoD); SETTER(cuMemcpyDtoH); SETTER(cuMemcpyAsync);
+SETTER(cuMemcpyHtoDAsync); SETTER(cuMemcpyDtoHAsync);
+SETTER(cuStreamSynchronize); SETTER(cuEventCreate); SETTER(cuEventDestroy);
+SETTER(cuEventRecord); SETTER(cuEventElapsedTime);
+SETTER(nvrtcGetErrorString); SETTER(nvrtcCreateProgram);
+SETTER(nvrtcDestroyProgram); SETTER(nvrtcCompileProgram);
+SETTER(nvrtcGetProgramLogSize); SETTER(nvrtcGetProgramLog);
+SETTER(nvrtcGetPTXSize); SETTER(nvrtcGetPTX);
+SETTER(cuModuleLoadData); SETTER(cuModuleUnload); SETTER(cuModuleGetFunction);
+SETTER(cuFuncGetAttribute); SETTER(cuFuncSetAttribute); SETTER(cuLaunchKernel);
+
+// Number of device allocations, and the blocks released so far, in
+// the order they were released.
+static int num_allocs = 0;
+static int num_frees = 0;
+static CUdeviceptr frees[64];
+
+// Make the next device allocation fail as if the device was full.
+static int fail_next_alloc = 0;
+
+static CUresult mock_ok() {
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_error_string(CUresult e, const char **s) {
+  (void)e;
+  *s = "mock error";
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_device_count(int *n) {
+  *n = 1;
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_device_name(char *s, int n, CUdevice dev) {
+  (void)dev;
+  strncpy(s, "Mock", n);
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_device_get(CUdevice *dev, int i) {
+  *dev = i;
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_device_attribute(int *v, CUdevice_attribute a, CUdevice dev) {
+  (void)dev;
+  switch (a) {
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR: *v = 8; break;
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR: *v = 0; break;
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_MODE: *v = 0; break;
+  case CU_DEVICE_ATTRIBUTE_WARP_SIZE: *v = 32; break;
+  default: *v = 1024;
+  }
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_ctx_retain(CUcontext *ctx, CUdevice dev) {
+  (void)dev;
+  *ctx = (CUcontext)1;
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_mem_alloc(CUdeviceptr *p, size_t n) {
+  *p = (CUdeviceptr)(uintptr_t)malloc(n);
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_mem_free(CUdeviceptr p) {
+  free((void*)(uintptr_t)p);
+  return CUDA_SUCCESS;
+}
+
+static int mock_gpu_alloc(CUdeviceptr *p, size_t n, const char *tag) {
+  (void)tag;
+  if (fail_next_alloc) {
+    fail_next_alloc = 0;
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  }
+  num_allocs++;
+  return mock_mem_alloc(p, n);
+}
+
+static int mock_gpu_free(CUdeviceptr p) {
+  assert(num_frees < 64);
+  frees[num_frees++] = p;
+  return mock_mem_free(p);
+}
+
+static void mock_gpu_unify(const char *ltag, const char *rtag) {
+  (void)ltag; (void)rtag;
+}
+
+static CUresult mock_memcpy(CUdeviceptr dst, CUdeviceptr src, size_t n) {
+  memmove((void*)(uintptr_t)dst, (void*)(uintptr_t)src, n);
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_memcpy_htod(CUdeviceptr dst, const void *src, size_t n) {
+  memcpy((void*)(uintptr_t)dst, src, n);
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_memcpy_dtoh(void *dst, CUdeviceptr src, size_t n) {
+  memcpy(dst, (void*)(uintptr_t)src, n);
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_memcpy_async(CUdeviceptr dst, CUdeviceptr src, size_t n, CUstream s) {
+  (void)s;
+  return mock_memcpy(dst, src, n);
+}
+
+static CUresult mock_memcpy_htod_async(CUdeviceptr dst, const void *src, size_t n, CUstream s) {
+  (void)s;
+  return mock_memcpy_htod(dst, src, n);
+}
+
+static CUresult mock_memcpy_dtoh_async(void *dst, CUdeviceptr src, size_t n, CUstream s) {
+  (void)s;
+  return mock_memcpy_dtoh(dst, src, n);
+}
+
+static CUresult mock_event_create(CUevent *e, unsigned int flags) {
+  (void)flags;
+  *e = (CUevent)1;
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_event_elapsed(float *ms, CUevent start, CUevent end) {
+  (void)start; (void)end;
+  *ms = 0;
+  return CUDA_SUCCESS;
+}
+
+static const char *mock_nvrtc_error_string(nvrtcResult e) {
+  (void)e;
+  return "mock error";
+}
+
+static nvrtcResult mock_nvrtc_create(nvrtcProgram *prog, const char *src, const char *name,
+                                     int n, const char * const *headers,
+                                     const char * const *names) {
+  (void)src; (void)name; (void)n; (void)headers; (void)names;
+  *prog = (nvrtcProgram)1;
+  return NVRTC_SUCCESS;
+}
+
+static nvrtcResult mock_nvrtc_size(nvrtcProgram prog, size_t *n) {
+  (void)prog;
+  *n = 1;
+  return NVRTC_SUCCESS;
+}
+
+static nvrtcResult mock_nvrtc_string(nvrtcProgram prog, char *s) {
+  (void)prog;
+  *s = 0;
+  return NVRTC_SUCCESS;
+}
+
+static CUresult mock_module_load(CUmodule *m, const void *image) {
+  (void)image;
+  *m = (CUmodule)1;
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_get_function(CUfunction *f, CUmodule m, const char *name) {
+  (void)m;
+  *f = (CUfunction)name;
+  return CUDA_SUCCESS;
+}
+
+static CUresult mock_func_attribute(int *v, CUfunction_attribute a, CUfunction f) {
+  (void)a; (void)f;
+  *v = 0;
+  return CUDA_SUCCESS;
+}
+
+static struct futhark_context_config *mock_config(size_t cap) {
+  struct futhark_context_config *cfg = futhark_context_config_new();
+#define SET(f, p) futhark_context_config_set_##f(cfg, (void*)p)
+  SET(gpu_alloc, mock_gpu_alloc);
+  SET(gpu_free, mock_gpu_free);
+  SET(gpu_unify, mock_gpu_unify);
+  SET(gpu_global_failure_alloc, mock_mem_alloc);
+  SET(gpu_global_failure_free, mock_mem_free);
+  SET(cuGetErrorString, mock_error_string);
+  SET(cuInit, mock_ok);
+  SET(cuDeviceGetCount, mock_device_count);
+  SET(cuDeviceGetName, mock_device_name);
+  SET(cuDeviceGet, mock_device_get);
+  SET(cuDeviceGetAttribute, mock_device_attribute);
+  SET(cuDevicePrimaryCtxRetain, mock_ctx_retain);
+  SET(cuDevicePrimaryCtxRelease, mock_ok);
+  SET(cuCtxCreate, mock_ok);
+  SET(cuCtxDestroy, mock_ok);
+  SET(cuCtxPopCurrent, mock_ok);
+  SET(cuCtxPushCurrent, mock_ok);
+  SET(cuCtxSynchronize, mock_ok);
+  SET(cuMemAlloc, mock_mem_alloc);
+  SET(cuMemFree, mock_mem_free);
+  SET(cuMemcpy, mock_memcpy);
+  SET(cuMemcpyHtoD, mock_memcpy_htod);
+  SET(cuMemcpyDtoH, mock_memcpy_dtoh);
+  SET(cuMemcpyAsync, mock_memcpy_async);
+  SET(cuMemcpyHtoDAsync, mock_memcpy_htod_async);
+  SET(cuMemcpyDtoHAsync, mock_memcpy_dtoh_async);
+  SET(cuStreamSynchronize, mock_ok);
+  SET(cuEventCreate, mock_event_create);
+  SET(cuEventDestroy, mock_ok);
+  SET(cuEventRecord, mock_ok);
+  SET(cuEventElapsedTime, mock_event_elapsed);
+  SET(nvrtcGetErrorString, mock_nvrtc_error_string);
+  SET(nvrtcCreateProgram, mock_nvrtc_create);
+  SET(nvrtcDestroyProgram, mock_ok);
+  SET(nvrtcCompileProgram, mock_ok);
+  SET(nvrtcGetProgramLogSize, mock_nvrtc_size);
+  SET(nvrtcGetProgramLog, mock_nvrtc_string);
+  SET(nvrtcGetPTXSize, mock_nvrtc_size);
+  SET(nvrtcGetPTX, mock_nvrtc_string);
+  SET(cuModuleLoadData, mock_module_load);
+  SET(cuModuleUnload, mock_ok);
+  SET(cuModuleGetFunction, mock_get_function);
+  SET(cuFuncGetAttribute, mock_func_attribute);
+  SET(cuFuncSetAttribute, mock_ok);
+  SET(cuLaunchKernel, mock_ok);
+#undef SET
+  futhark_context_config_set_gpu_free_list_cap(cfg, cap);
+  return cfg;
+}
+
+static uint8_t data[8192];
+
+static struct futhark_u8_1d *new_array(struct futhark_context *ctx, int64_t n,
+                                      CUdeviceptr *mem) {
+  struct futhark_u8_1d *arr = futhark_new_u8_1d(ctx, data, n);
+  assert(arr != NULL);
+  *mem = futhark_values_raw_u8_1d(ctx, arr);
+  return arr;
+}
+
+int main() {
+  struct futhark_context_config *cfg;
+  struct futhark_context *ctx;
+  struct futhark_u8_1d *a, *b, *c;
+  CUdeviceptr a_mem, b_mem, c_mem;
+
+  // With a cap of zero, blocks go straight back to the driver.
+  cfg = mock_config(0);
+  ctx = futhark_context_new(cfg);
+  assert(futhark_context_get_error(ctx) == NULL);
+  num_allocs = num_frees = 0;
+  a = new_array(ctx, 4096, &a_mem);
+  assert(futhark_free_u8_1d(ctx, a) == 0);
+  assert(num_allocs == 1 && num_frees == 1 && frees[0] == a_mem);
+  futhark_context_free(ctx);
+  futhark_context_config_free(cfg);
+
+  // Room for two blocks of 4096 bytes.
+  cfg = mock_config(8192);
+  ctx = futhark_context_new(cfg);
+  assert(futhark_context_get_error(ctx) == NULL);
+  num_allocs = num_frees = 0;
+
+  // A freed block is kept and reused.
+  a = new_array(ctx, 4096, &a_mem);
+  assert(futhark_free_u8_1d(ctx, a) == 0);
+  assert(num_frees == 0);
+  b = new_array(ctx, 4096, &b_mem);
+  assert(b_mem == a_mem && num_allocs == 1);
+
+  // The third block exceeds the cap, which evicts the oldest one.
+  a = new_array(ctx, 4096, &a_mem);
+  c = new_array(ctx, 4096, &c_mem);
+  assert(num_allocs == 3);
+  assert(futhark_free_u8_1d(ctx, b) == 0);
+  assert(futhark_free_u8_1d(ctx, a) == 0);
+  assert(num_frees == 0);
+  assert(futhark_free_u8_1d(ctx, c) == 0);
+  assert(num_frees == 1 && frees[0] == b_mem);
+
+  // When the device is out of memory, the free list is released one
+  // block at a time until the allocation succeeds.
+  fail_next_alloc = 1;
+  b = new_array(ctx, 8192, &b_mem);
+  assert(num_allocs == 4);
+  assert(num_frees == 2 && frees[1] == a_mem);
+
+  // Keeping this block evicts the remaining older one.
+  assert(futhark_free_u8_1d(ctx, b) == 0);
+  assert(num_frees == 3 && frees[2] == c_mem);
+
+  futhark_context_free(ctx);
+  assert(num_frees == 4 && frees[3] == b_mem);
+  futhark_context_config_free(cfg);
+}
@@ -0,0 +1,14 @@
+#!/bin/sh
+#
+# Check the GPU free list (reuse, eviction at the cap, and release
+# when out of memory) against a mock CUDA driver, so no GPU or CUDA
+# installation is needed.  The headers in include/ stand in for the
+# real ones.
+
+set -e
+
+futhark cuda --library prog.fut
+${CC:-cc} -std=c99 -Iinclude -o test test.c prog.c -lm -lpthread
+./test
+
+rm -f test prog.c prog.h prog.json
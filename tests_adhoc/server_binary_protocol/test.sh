@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Drive a server through the binary protocol, passing values in the
+# request and reply payloads.
+
+set -e
+
+futhark c --server prog.fut
+
+python3 - <<'PYTHON'
+import struct, subprocess
+
+server = subprocess.Popen(["./prog", "--binary-protocol"],
+                          stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+def read_field():
+    (n,) = struct.unpack("<Q", server.stdout.read(8))
+    return server.stdout.read(n)
+
+def reply():
+    failed = server.stdout.read(1) != b"\0"
+    return failed, read_field(), read_field()
+
+def cmd(command, payload=b""):
+    command = command.encode()
+    server.stdin.write(struct.pack("<Q", len(command)) + command +
+                       struct.pack("<Q", len(payload)) + payload)
+    server.stdin.flush()
+    return reply()
+
+def i32(x):
+    return b"b\x02\x00 i32" + struct.pack("<i", x)
+
+assert reply() == (False, b"", b"")
+assert cmd("restore - x i32 y i32", i32(2) + i32(3)) == (False, b"", b"")
+failed, text, _ = cmd("call add z x y")
+assert not failed and text.startswith(b"runtime: ")
+assert cmd("store - z x") == (False, b"", i32(5) + i32(2))
+assert cmd("restore - w i32", b"  7 ") == (False, b"", b"")
+assert cmd("store - w") == (False, b"", i32(7))
+assert cmd("store - nope") == (True, b"Unknown variable: nope\n", b"")
+assert cmd("inputs add") == (False, b"i32\ni32\n", b"")
+assert cmd("free x y z w") == (False, b"", b"")
+
+server.stdin.close()
+assert server.wait() == 0
+PYTHON
+
+rm -f prog prog.c
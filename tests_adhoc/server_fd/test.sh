@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Pass arrays to and from a server through memfds (so Linux only).
+# Set N for larger arrays.
+
+set -e
+
+futhark c --server prog.fut
+
+N=${N:-1000000} python3 - <<'PYTHON'
+import os, struct, subprocess
+
+n = int(os.environ["N"])
+
+def i32s(xs):
+    return b"b\x02\x01 i32" + struct.pack("<q", len(xs)) + struct.pack("<%di" % len(xs), *xs)
+
+ins = os.memfd_create("ins")
+outs = os.memfd_create("outs")
+server = subprocess.Popen(["./prog"], pass_fds=(ins, outs),
+                          stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+def cmd(command):
+    server.stdin.write(command.encode() + b"\n")
+    server.stdin.flush()
+    output = []
+    while True:
+        line = server.stdout.readline()
+        if line == b"%%% OK\n":
+            return b"".join(output)
+        output.append(line)
+
+assert server.stdout.readline() == b"%%% OK\n"
+
+xs = list(range(n))
+os.write(ins, i32s(xs) + i32s(xs))
+assert cmd("restore_fd %d xs []i32 ys []i32" % ins) == b""
+assert cmd("call add zs xs ys").startswith(b"runtime: ")
+assert cmd("store_fd %d zs" % outs) == b""
+assert os.pread(outs, os.fstat(outs).st_size, 0) == i32s([2 * x for x in xs])
+assert cmd("store_fd %d xs" % outs) == b""
+assert os.pread(outs, os.fstat(outs).st_size, 0) == i32s(xs)
+assert b"FAILURE" in cmd("restore_fd 1000 bad []i32")
+
+server.stdin.close()
+assert server.wait() == 0
+PYTHON
+
+rm -f prog prog.c
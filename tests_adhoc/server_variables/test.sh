@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Stress the server command loop with many live variables, and report
+# how long it takes.  Set N for more variables.
+
+set -e
+
+n=${N:-10000}
+
+futhark c --server prog.fut
+
+seq 1 $n > vals.txt
+awk -v n=$n 'BEGIN {
+  line = "restore vals.txt"
+  for (i = 1; i <= n; i++) line = line " v" i " i32"
+  print line
+  for (i = 1; i <= n; i++) print "call add o" i " v" i " v" (i % n + 1)
+  line = "free"
+  for (i = 1; i <= n; i++) line = line " v" i " o" i
+  print line
+}' > commands.txt
+
+command time -p ./prog < commands.txt > output.txt
+
+if grep -q FAILURE output.txt; then
+    grep -A1 FAILURE output.txt | head
+    exit 1
+fi
+
+rm -f prog prog.c vals.txt commands.txt output.txt
@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Check that textual input is read exactly like the same values in
+# binary, and report how long reading the text takes for each element
+# type.  Set N for larger arrays.
+
+set -e
+
+n=${N:-1000000}
+
+futhark c prog.fut
+
+for t in i8 i16 i32 i64 u8 u16 u32 u64 f16 f32 f64 bool; do
+    futhark dataset -g "[$n]$t" > $t.txt
+    futhark dataset -b < $t.txt > $t.bin
+    ./prog -e id_$t -b < $t.bin > $t.expected
+    echo "$t:"
+    command time -p ./prog -e id_$t -b < $t.txt > $t.actual
+    cmp $t.expected $t.actual
+done
+
+rm -f prog prog.c *.txt *.bin *.expected *.actual
@@ -16,8 +16,12 @@ arbText = T.pack <$> printable
 instance Arbitrary ProfilingEvent where
   arbitrary = ProfilingEvent <$> arbText <*> arbitrary <*> arbText
 
+instance Arbitrary ProfilingEntryPoint where
+  arbitrary = ProfilingEntryPoint <$> arbitrary <*> arbitrary
+
 instance Arbitrary ProfilingReport where
   arbitrary =
     ProfilingReport
       <$> arbitrary
       <*> (M.fromList <$> listOf ((,) <$> arbText <*> arbitrary))
+      <*> (M.fromList <$> listOf ((,) <$> arbText <*> arbitrary))
@@ -0,0 +1,25 @@
+module Futhark.Test.Values.IndexedTests (tests) where
+
+import Data.Maybe (fromMaybe)
+import Data.Text qualified as T
+import Futhark.Test.Values
+import Futhark.Test.Values.Indexed
+import Test.Tasty
+import Test.Tasty.HUnit
+
+values :: [(T.Text, Value)]
+values =
+  zip ["", "xs", "matrix", "ys"] . fromMaybe [] $
+    readValues "42i32 [1f32, 2f32, 3f32] [[1u8, 2u8], [3u8, 4u8]] empty([0]i64)"
+
+tests :: TestTree
+tests =
+  testGroup
+    "Futhark.Test.Values.IndexedTests"
+    [ testCase "encoding and decoding are inverse" $
+        decodeIndexed (encodeIndexed False values) @?= Just values,
+      testCase "encoding and decoding with checksums are inverse" $
+        decodeIndexed (encodeIndexed True values) @?= Just values,
+      testCase "indexed data is recognised" $
+        isIndexed (encodeIndexed False values) @?= True
+    ]